@@ -0,0 +1,97 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Storage backends that stand in for a raw backing file. blockif keeps
+ * the request queues, ordering and i/o threads, and calls the backend from
+ * those threads. Backends are therefore called concurrently, though never
+ * for overlapping ranges when one of the requests is a write.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Most iovecs that blockif passes to a backend in one call */
+#define BLOCKIF_BACKEND_IOV 256
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct blockif_binfo {
+	off_t bi_size;		/* disk size */
+	int bi_rdonly;		/* set by blockif from "ro", may be forced on */
+	int bi_candelete;	/* bb_delete works */
+	int bi_blksz;		/* preferred i/o size, reported as sector size */
+	int bi_inline;		/* i/o never blocks, see blockif_inline() */
+};
+
+struct blockif_backend {
+	const char *bb_name;
+	/*
+	 * Non-zero if path names an image of this backend rather than a
+	 * file, for images that live elsewhere. Such images are opened
+	 * without a file, and fd is -1.
+	 */
+	int (*bb_match)(const char *path);
+	/*
+	 * Non-zero if fd holds an image in this backend's format. Set for
+	 * file formats, which are chosen with format=; it only checks a file
+	 * the user said is in the format, and is never used to guess one.
+	 */
+	int (*bb_probe)(int fd);
+	/*
+	 * Open the image at path. fd belongs to the backend once this
+	 * succeeds. Returns NULL, with a message printed, on failure.
+	 */
+	void *(*bb_open)(const char *path, int fd, struct blockif_binfo *bi);
+	/* Same semantics as preadv(2)/pwritev(2) */
+	ssize_t (*bb_preadv)(void *arg, const struct iovec *iov, int iovcnt,
+		off_t off);
+	ssize_t (*bb_pwritev)(void *arg, const struct iovec *iov, int iovcnt,
+		off_t off);
+	/* These return 0 or an errno value */
+	int (*bb_flush)(void *arg);
+	int (*bb_delete)(void *arg, off_t off, off_t len);
+	void (*bb_close)(void *arg);
+};
+#pragma clang diagnostic pop
+
+extern const struct blockif_backend blockif_overlay_backend;
+extern const struct blockif_backend blockif_bgzf_backend;
+extern const struct blockif_backend blockif_stripe_backend;
+extern const struct blockif_backend blockif_nbd_backend;
+extern const struct blockif_backend blockif_ram_backend;
+
+int blockif_overlay_create(const char *path, const char *backing);
+
+ssize_t blockif_preadv(int fd, const struct iovec *iov, int iovcnt,
+	off_t offset);
+ssize_t blockif_pwritev(int fd, const struct iovec *iov, int iovcnt,
+	off_t offset);
+size_t blockif_iov_len(const struct iovec *iov, int iovcnt);
+int blockif_iov_slice(const struct iovec *iov, int iovcnt, size_t skip,
+	size_t len, struct iovec *out);
@@ -37,6 +37,9 @@
 #define	wmb()	__asm __volatile("sfence;" : : : "memory")
 #define	rmb()	__asm __volatile("lfence;" : : : "memory")
 
+/* Pause in a spin loop */
+#define	cpu_spinwait()	__asm __volatile("pause" : : : "memory")
+
 /*
  * Various simple operations on memory, each of which is atomic in the
  * presence of interrupts and multiple processors.
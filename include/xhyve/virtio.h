@@ -217,6 +217,7 @@ struct vring_used {
 #define	VIRTIO_DEV_NET		0x1000
 #define	VIRTIO_DEV_BLOCK	0x1001
 #define	VIRTIO_DEV_RANDOM	0x1002
+#define	VIRTIO_DEV_SCSI		0x1004
 
 /*
  * PCI config space constants.
@@ -321,6 +322,7 @@ struct vqueue_info;
 #define	VIRTIO_USE_MSIX		0x01
 #define	VIRTIO_EVENT_IDX	0x02	/* use the event-index values */
 #define	VIRTIO_BROKED		0x08	/* ??? */
+#define	VIRTIO_QNOTIFY_NOLOCK	0x10	/* device locks queues on notify */
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
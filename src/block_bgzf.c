@@ -0,0 +1,445 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Read-only disk images compressed with BGZF, the blocked gzip format that
+ * bgzip(1) writes. The image is a series of gzip members, each holding at
+ * most 64 KiB of the disk, so any part of the disk can be reached by
+ * inflating a single member. Member offsets are taken from the .gzi index
+ * that "bgzip -i" writes next to the image; without one, the member
+ * headers are walked once at open. Inflated members are kept in a small
+ * LRU cache.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_backend.h>
+
+#define BGZF_HDRSZ 18
+#define BGZF_MAXBLK 65536	/* largest member, before and after inflating */
+#define BGZF_CACHE 256		/* inflated members kept */
+#define BGZF_HASHSZ 512
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct bgzf_blk {
+	TAILQ_ENTRY(bgzf_blk) zb_link;
+	struct bgzf_blk *zb_hnext;
+	size_t zb_idx;			/* SIZE_MAX if unused */
+	uint8_t *zb_data;
+};
+
+struct bgzf {
+	int bz_fd;
+	off_t bz_size;			/* inflated size */
+	off_t bz_csize;			/* file size */
+	/*
+	 * Start of each non-empty member in the file and on the disk. Both
+	 * arrays end with an extra entry for the end of the image.
+	 */
+	size_t bz_nblk;
+	size_t bz_maxblk;
+	off_t *bz_coff;
+	off_t *bz_uoff;
+	pthread_mutex_t bz_mtx;
+	struct bgzf_blk bz_cache[BGZF_CACHE];
+	struct bgzf_blk *bz_hash[BGZF_HASHSZ];
+	TAILQ_HEAD(bgzf_blk_lru, bgzf_blk) bz_lru;
+};
+#pragma clang diagnostic pop
+
+/*
+ * Size of the BGZF member at off, or 0 if there is none. bgzip always puts
+ * the BC subfield, which holds the member size, first in the extra field.
+ */
+static size_t
+bgzf_member(int fd, off_t off)
+{
+	uint8_t h[BGZF_HDRSZ];
+
+	if (pread(fd, h, sizeof(h), off) != sizeof(h))
+		return (0);
+	if (h[0] != 31 || h[1] != 139 || h[2] != 8 || (h[3] & 4) == 0 ||
+	    h[10] != 6 || h[11] != 0 || h[12] != 'B' || h[13] != 'C' ||
+	    h[14] != 2 || h[15] != 0)
+		return (0);
+	return (((size_t) (h[16] | (h[17] << 8))) + 1);
+}
+
+static int
+bgzf_probe(int fd)
+{
+	return (bgzf_member(fd, 0) != 0);
+}
+
+static int
+bgzf_add(struct bgzf *bz, off_t coff, off_t uoff)
+{
+	off_t *c, *u;
+	size_t n;
+
+	if (bz->bz_nblk + 1 >= bz->bz_maxblk) {
+		n = MAX(bz->bz_maxblk * 2, 1024);
+		c = realloc(bz->bz_coff, n * sizeof(off_t));
+		if (c != NULL)
+			bz->bz_coff = c;
+		u = realloc(bz->bz_uoff, n * sizeof(off_t));
+		if (u != NULL)
+			bz->bz_uoff = u;
+		if (c == NULL || u == NULL)
+			return (ENOMEM);
+		bz->bz_maxblk = n;
+	}
+	bz->bz_coff[bz->bz_nblk] = coff;
+	bz->bz_uoff[bz->bz_nblk] = uoff;
+	bz->bz_nblk++;
+	return (0);
+}
+
+/*
+ * Load the .gzi index if there is one. It lists the file and disk offset
+ * of every member but the first, as little-endian 64-bit pairs. Entries
+ * are held to the same limits bgzf_scan() puts on members, since members
+ * are inflated into buffers of BGZF_MAXBLK.
+ */
+static void
+bgzf_load_gzi(struct bgzf *bz, const char *path)
+{
+	char ipath[MAXPATHLEN];
+	uint64_t n, i, ent[2];
+	FILE *fp;
+
+	snprintf(ipath, sizeof(ipath), "%s.gzi", path);
+	if ((fp = fopen(ipath, "r")) == NULL)
+		return;
+	if (fread(&n, sizeof(n), 1, fp) != 1 || bgzf_add(bz, 0, 0) != 0)
+		goto out;
+	for (i = 0; i < n; i++) {
+		if (fread(ent, sizeof(ent), 1, fp) != 1 ||
+		    ((off_t) ent[0]) <= bz->bz_coff[bz->bz_nblk - 1] ||
+		    ((off_t) ent[1]) < bz->bz_uoff[bz->bz_nblk - 1] ||
+		    ((off_t) ent[1]) - bz->bz_uoff[bz->bz_nblk - 1] >
+		    BGZF_MAXBLK || ((off_t) ent[0]) >= bz->bz_csize) {
+			fprintf(stderr, "%s: ignoring bad index\n", ipath);
+			bz->bz_nblk = 0;
+			break;
+		}
+		/* Members that inflate to nothing are not worth a slot */
+		if (((off_t) ent[1]) == bz->bz_uoff[bz->bz_nblk - 1])
+			bz->bz_coff[bz->bz_nblk - 1] = (off_t) ent[0];
+		else if (bgzf_add(bz, (off_t) ent[0], (off_t) ent[1]) != 0)
+			break;
+	}
+out:
+	fclose(fp);
+}
+
+/*
+ * Walk the members from the last one known to the end of the file,
+ * recording the non-empty ones and the size of the disk.
+ */
+static int
+bgzf_scan(struct bgzf *bz, const char *path)
+{
+	uint8_t isz[4];
+	off_t coff, uoff;
+	size_t bsize;
+	uint32_t ulen;
+
+	coff = uoff = 0;
+	if (bz->bz_nblk > 0) {
+		bz->bz_nblk--;
+		coff = bz->bz_coff[bz->bz_nblk];
+		uoff = bz->bz_uoff[bz->bz_nblk];
+	}
+	while (coff < bz->bz_csize) {
+		bsize = bgzf_member(bz->bz_fd, coff);
+		if (bsize == 0 || pread(bz->bz_fd, isz, sizeof(isz),
+		    coff + ((off_t) bsize) - 4) != sizeof(isz)) {
+			fprintf(stderr, "%s: corrupt member at offset %lld\n",
+			    path, (long long) coff);
+			return (EINVAL);
+		}
+		ulen = ((uint32_t) isz[0]) | (((uint32_t) isz[1]) << 8) |
+			(((uint32_t) isz[2]) << 16) | (((uint32_t) isz[3]) << 24);
+		if (ulen > BGZF_MAXBLK) {
+			fprintf(stderr, "%s: oversized member at offset %lld\n",
+			    path, (long long) coff);
+			return (EINVAL);
+		}
+		if (ulen > 0 && bgzf_add(bz, coff, uoff) != 0)
+			return (ENOMEM);
+		coff += (off_t) bsize;
+		uoff += ulen;
+	}
+	bz->bz_size = uoff;
+	/* The end-of-image sentinel */
+	if (bgzf_add(bz, bz->bz_csize, uoff) != 0)
+		return (ENOMEM);
+	bz->bz_nblk--;
+	return (0);
+}
+
+/*
+ * Index of the member holding disk offset off.
+ */
+static size_t
+bgzf_find(struct bgzf *bz, off_t off)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = bz->bz_nblk;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (bz->bz_uoff[mid] <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+static int
+bgzf_inflate(struct bgzf *bz, size_t i, uint8_t *dst, uint8_t *cbuf)
+{
+	z_stream zs;
+	size_t clen, ulen;
+	int ret;
+
+	clen = MIN((size_t) (bz->bz_coff[i + 1] - bz->bz_coff[i]),
+		BGZF_MAXBLK);
+	ulen = (size_t) (bz->bz_uoff[i + 1] - bz->bz_uoff[i]);
+	if (pread(bz->bz_fd, cbuf, clen, bz->bz_coff[i]) != (ssize_t) clen)
+		return (EIO);
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+		return (ENOMEM);
+	zs.next_in = cbuf;
+	zs.avail_in = (uInt) clen;
+	zs.next_out = dst;
+	zs.avail_out = (uInt) ulen;
+	ret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	return (ret == Z_STREAM_END && zs.total_out == ulen ? 0 : EIO);
+}
+
+static struct bgzf_blk *
+bgzf_lookup(struct bgzf *bz, size_t i)
+{
+	struct bgzf_blk *zb;
+
+	for (zb = bz->bz_hash[i % BGZF_HASHSZ]; zb != NULL; zb = zb->zb_hnext)
+		if (zb->zb_idx == i)
+			break;
+	return (zb);
+}
+
+/*
+ * Cache an inflated member in place of the least recently used one.
+ */
+static void
+bgzf_insert(struct bgzf *bz, size_t i, const uint8_t *data)
+{
+	struct bgzf_blk *zb, **zbp;
+
+	zb = TAILQ_LAST(&bz->bz_lru, bgzf_blk_lru);
+	if (zb->zb_data == NULL &&
+	    (zb->zb_data = malloc(BGZF_MAXBLK)) == NULL)
+		return;
+	if (zb->zb_idx != SIZE_MAX) {
+		for (zbp = &bz->bz_hash[zb->zb_idx % BGZF_HASHSZ]; *zbp != zb;
+		     zbp = &(*zbp)->zb_hnext)
+			;
+		*zbp = zb->zb_hnext;
+	}
+	zb->zb_idx = i;
+	zb->zb_hnext = bz->bz_hash[i % BGZF_HASHSZ];
+	bz->bz_hash[i % BGZF_HASHSZ] = zb;
+	memcpy(zb->zb_data, data, (size_t) (bz->bz_uoff[i + 1] -
+		bz->bz_uoff[i]));
+	TAILQ_REMOVE(&bz->bz_lru, zb, zb_link);
+	TAILQ_INSERT_HEAD(&bz->bz_lru, zb, zb_link);
+}
+
+static void
+bgzf_copyout(const struct iovec *iov, int iovcnt, const uint8_t *src)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(iov[i].iov_base, src, iov[i].iov_len);
+		src += iov[i].iov_len;
+	}
+}
+
+static ssize_t
+bgzf_preadv(void *arg, const struct iovec *iov, int iovcnt, off_t off)
+{
+	struct iovec siov[BLOCKIF_BACKEND_IOV];
+	struct bgzf *bz;
+	struct bgzf_blk *zb;
+	uint8_t *buf;
+	size_t done, len, n, boff, i;
+	off_t pos;
+	int err, scnt;
+
+	bz = arg;
+	if (off >= bz->bz_size)
+		return (0);
+	len = MIN(blockif_iov_len(iov, iovcnt), (size_t) (bz->bz_size - off));
+	buf = NULL;
+	for (done = 0; done < len; done += n) {
+		pos = off + ((off_t) done);
+		i = bgzf_find(bz, pos);
+		boff = (size_t) (pos - bz->bz_uoff[i]);
+		n = MIN(len - done, (size_t) (bz->bz_uoff[i + 1] - pos));
+		scnt = blockif_iov_slice(iov, iovcnt, done, n, siov);
+
+		pthread_mutex_lock(&bz->bz_mtx);
+		if ((zb = bgzf_lookup(bz, i)) != NULL) {
+			TAILQ_REMOVE(&bz->bz_lru, zb, zb_link);
+			TAILQ_INSERT_HEAD(&bz->bz_lru, zb, zb_link);
+			bgzf_copyout(siov, scnt, zb->zb_data + boff);
+			pthread_mutex_unlock(&bz->bz_mtx);
+			continue;
+		}
+		pthread_mutex_unlock(&bz->bz_mtx);
+
+		/* Inflate without the lock held */
+		if (buf == NULL && (buf = malloc(2 * BGZF_MAXBLK)) == NULL)
+			return (-1);
+		if ((err = bgzf_inflate(bz, i, buf, buf + BGZF_MAXBLK)) != 0) {
+			free(buf);
+			errno = err;
+			return (-1);
+		}
+		bgzf_copyout(siov, scnt, buf + boff);
+
+		pthread_mutex_lock(&bz->bz_mtx);
+		if (bgzf_lookup(bz, i) == NULL)
+			bgzf_insert(bz, i, buf);
+		pthread_mutex_unlock(&bz->bz_mtx);
+	}
+	free(buf);
+	return ((ssize_t) len);
+}
+
+static ssize_t
+bgzf_pwritev(UNUSED void *arg, UNUSED const struct iovec *iov,
+	UNUSED int iovcnt, UNUSED off_t off)
+{
+	errno = EROFS;
+	return (-1);
+}
+
+static int
+bgzf_flush(UNUSED void *arg)
+{
+	return (0);
+}
+
+static void
+bgzf_close(void *arg)
+{
+	struct bgzf *bz;
+	int i;
+
+	bz = arg;
+	for (i = 0; i < BGZF_CACHE; i++)
+		free(bz->bz_cache[i].zb_data);
+	pthread_mutex_destroy(&bz->bz_mtx);
+	free(bz->bz_coff);
+	free(bz->bz_uoff);
+	close(bz->bz_fd);
+	free(bz);
+}
+
+static void *
+bgzf_open(const char *path, int fd, struct blockif_binfo *bi)
+{
+	struct stat sbuf;
+	struct bgzf *bz;
+	int i;
+
+	if (fstat(fd, &sbuf) < 0) {
+		perror("fstat");
+		return (NULL);
+	}
+	bz = calloc(1, sizeof(struct bgzf));
+	if (bz == NULL) {
+		perror("calloc");
+		return (NULL);
+	}
+	bz->bz_fd = fd;
+	bz->bz_csize = sbuf.st_size;
+	bgzf_load_gzi(bz, path);
+	if (bgzf_scan(bz, path) != 0) {
+		free(bz->bz_coff);
+		free(bz->bz_uoff);
+		free(bz);
+		return (NULL);
+	}
+
+	pthread_mutex_init(&bz->bz_mtx, NULL);
+	TAILQ_INIT(&bz->bz_lru);
+	for (i = 0; i < BGZF_CACHE; i++) {
+		bz->bz_cache[i].zb_idx = SIZE_MAX;
+		TAILQ_INSERT_TAIL(&bz->bz_lru, &bz->bz_cache[i], zb_link);
+	}
+
+	bi->bi_size = bz->bz_size;
+	bi->bi_rdonly = 1;
+	bi->bi_candelete = 0;
+	return (bz);
+}
+
+const struct blockif_backend blockif_bgzf_backend = {
+	.bb_name = "bgzf",
+	.bb_match = NULL,
+	.bb_probe = bgzf_probe,
+	.bb_open = bgzf_open,
+	.bb_preadv = bgzf_preadv,
+	.bb_pwritev = bgzf_pwritev,
+	.bb_flush = bgzf_flush,
+	.bb_delete = NULL,
+	.bb_close = bgzf_close
+};
@@ -31,9 +31,11 @@
 #include <sys/queue.h>
 #include <sys/errno.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/disk.h>
 
+#include <aio.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -41,35 +43,118 @@
 #include <string.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
+#include <AvailabilityMacros.h>
+#include <mach/mach_time.h>
 
 #include <xhyve/support/atomic.h>
+
+/*
+ * Every structural change of the interval tree recomputes the max-end of
+ * the touched node and of its ancestors; RB_INSERT and RB_REMOVE only
+ * augment the immediate parent.
+ */
+struct blockif_elem;
+static void blockif_augment(struct blockif_elem *be);
+#define RB_AUGMENT(x) blockif_augment(x)
+#include <xhyve/support/tree.h>
+
 #include <xhyve/xhyve.h>
 #include <xhyve/mevent.h>
 #include <xhyve/block_if.h>
+#include <xhyve/block_backend.h>
 
 #define BLOCKIF_SIG 0xb109b109
-/* xhyve: FIXME
- *
- * // #define BLOCKIF_NUMTHR 8
- *
- * OS X does not support preadv/pwritev, we need to serialize reads and writes
- * for the time being until we find a better solution.
+#define BLOCKIF_NUMTHR 8
+#define BLOCKIF_MAXTHR 64
+
+#define BLOCKIF_MAXQDEPTH 32768
+
+/*
+ * Limits on how many contiguous requests are folded into one syscall.
+ */
+#define BLOCKIF_MERGE_MAX 16
+#define BLOCKIF_MERGE_IOV BLOCKIF_BACKEND_IOV
+
+/* Number of data/hole extents cached per sparse image */
+#define BLOCKIF_SPARSE_MAX 4096
+
+/* Block cache page size and the largest cache, in MiB */
+#define BLOCKIF_CACHE_PGSHIFT 16
+#define BLOCKIF_CACHE_PGSZ (1 << BLOCKIF_CACHE_PGSHIFT)
+#define BLOCKIF_CACHE_MAXMB 65536
+
+/*
+ * The write-back cache tracks dirty data per sector, in pages the size of
+ * block cache pages. Data is written back at the latest BLOCKIF_WB_DELAY
+ * seconds after it was absorbed.
+ */
+#define BLOCKIF_WB_SECT 512
+#define BLOCKIF_WB_NSECT (BLOCKIF_CACHE_PGSZ / BLOCKIF_WB_SECT)
+#define BLOCKIF_WB_DEFMB 64
+#define BLOCKIF_WB_DELAY 5
+
+/*
+ * Readahead: streams tracked per file, and the window a stream starts
+ * with. The largest window is set with readahead=, in KiB.
+ */
+#define BLOCKIF_RA_STREAMS 4
+#define BLOCKIF_RA_MIN (128 * 1024)
+#define BLOCKIF_RA_MAXKB (64 * 1024)
+
+/*
+ * Boot traces: how long to record for by default, the block cache that
+ * replay fills when bcache= is not given, and the size of replay reads.
  */
-#define BLOCKIF_NUMTHR 1
+#define BLOCKIF_TRACE_DEFSECS 30
+#define BLOCKIF_TRACE_DEFMB 64
+#define BLOCKIF_TRACE_IOSZ (1024 * 1024)
 
-#define BLOCKIF_MAXREQ (64 + BLOCKIF_NUMTHR)
+/* Nanoseconds in a second, for the QoS buckets */
+#define BLOCKIF_NSEC 1000000000ULL
+
+/* How long the aio engine waits before retrying after EAGAIN, in ms */
+#define BLOCKIF_AIO_RETRY 10
+
+/* Size of the bounce buffers used for unaligned nocache i/o */
+#define BLOCKIF_BOUNCE_SZ (256 * 1024)
+
+/*
+ * preadv(2)/pwritev(2) only appeared in macOS 11. Use them when both the SDK
+ * and the running system have them, and fall back to a positional loop of
+ * pread(2)/pwrite(2) otherwise. Neither path touches the shared file offset,
+ * so any number of block i/o threads may run against the same descriptor.
+ */
+#if defined(MAC_OS_VERSION_11_0) && \
+    (MAC_OS_X_VERSION_MAX_ALLOWED >= MAC_OS_VERSION_11_0)
+#define BLOCKIF_HAVE_PREADV
+#endif
 
 enum blockop {
 	BOP_READ,
 	BOP_WRITE,
 	BOP_FLUSH,
-	BOP_DELETE
+	BOP_DELETE,
+	BOP_ZERO
+};
+
+enum blockengine {
+	BENG_THREAD,
+	BENG_AIO
+};
+
+enum blockcq {
+	BCQ_FREE,
+	BCQ_A1IN,
+	BCQ_AM,
+	BCQ_A1OUT
 };
 
 enum blockstat {
 	BST_FREE,
 	BST_BLOCK,
+	BST_PARK,
 	BST_PEND,
 	BST_BUSY,
 	BST_DONE
@@ -83,33 +168,325 @@ struct blockif_elem {
 	enum blockop be_op;
 	enum blockstat be_status;
 	pthread_t be_tid;
-	off_t be_block;
+	off_t be_start;			/* first byte of the request */
+	off_t be_block;			/* byte after the request */
+	off_t be_maxend;		/* max be_block within subtree */
+	uint64_t be_seq;		/* arrival order */
+	RB_ENTRY(blockif_elem) be_rb;
+	struct blockif_elem *be_merged;	/* next request issued with this one */
+	struct blockif_elem *be_reaped;	/* aio completion list linkage */
+};
+
+/*
+ * A run of the backing file known to be either all data or all hole.
+ */
+struct blockif_extent {
+	off_t bx_start;
+	off_t bx_end;
+	int bx_hole;
+};
+
+/*
+ * Per-element state of the POSIX AIO engine. OS X has no vectored aio, so
+ * each iovec of a request gets its own control block, allocated when the
+ * request is started. Control blocks are submitted in order; if the system
+ * aio limit is hit the remainder is submitted as earlier operations
+ * complete, or by the context's aio thread after BLOCKIF_AIO_RETRY ms.
+ * Discards and zeroing have no aio counterpart and are run by that thread
+ * (ba_sync).
+ */
+struct blockif_aiocb {
+	struct aiocb bac_cb;
+	int bac_reaped;
+};
+
+struct blockif_aio {
+	struct blockif_aiocb *ba_cb;
+	int ba_ncb;
+	int ba_nsub;
+	int ba_nreap;
+	int ba_sync;
+	int ba_syncdone;
+	int ba_err;
+	ssize_t ba_len;
+};
+
+/*
+ * A page of the block cache. Pages on A1in and Am hold data, pages on
+ * A1out are ghosts that only remember the index of a recently evicted page.
+ */
+struct blockif_cpage {
+	TAILQ_ENTRY(blockif_cpage) cp_link;
+	struct blockif_cpage *cp_hnext;	/* hash chain */
+	off_t cp_idx;
+	enum blockcq cp_q;
+	uint8_t *cp_data;
+};
+
+TAILQ_HEAD(blockif_cpq, blockif_cpage);
+
+/*
+ * Block cache with 2Q replacement. A page read for the first time enters
+ * A1in and leaves it in FIFO order; a page read again while its ghost is
+ * still on A1out is promoted to the Am LRU. A single pass over the disk
+ * thus cannot flush out the blocks that are read repeatedly.
+ *
+ * There is one cache per backing file, shared by every context that opens
+ * it with a cache: all the disks of VMs booted from one base image, or the
+ * queues of a multiqueue virtio-blk disk. Writers invalidate what they
+ * overwrite, so sharing a cache between writable contexts stays coherent.
+ * Every bcache= on one file must ask for the same size.
+ */
+struct blockif_cache {
+	struct blockif_cache *bk_next;
+	int bk_refs;
+	dev_t bk_dev;
+	ino_t bk_ino;
+	pthread_mutex_t bk_mtx;
+	size_t bk_npages;		/* data buffers */
+	size_t bk_kin;			/* A1in target size */
+	size_t bk_kout;			/* A1out size */
+	size_t bk_nin;
+	size_t bk_nout;
+	size_t bk_nnodes;
+	struct blockif_cpage *bk_pages;
+	uint8_t *bk_data;
+	uint8_t **bk_bufs;		/* stack of free data buffers */
+	size_t bk_nbufs;
+	struct blockif_cpage **bk_hash;
+	size_t bk_hmask;
+	struct blockif_cpq bk_free;
+	struct blockif_cpq bk_a1in;
+	struct blockif_cpq bk_am;
+	struct blockif_cpq bk_a1out;
+	uint64_t bk_gen;
+	uint64_t bk_hits;
+	uint64_t bk_misses;
+};
+
+/*
+ * A page of the write-back cache. wp_first is the number of the oldest
+ * absorbed write whose data in the page may not have reached the file.
+ */
+struct blockif_wpage {
+	TAILQ_ENTRY(blockif_wpage) wp_link;
+	struct blockif_wpage *wp_hnext;	/* hash chain */
+	off_t wp_idx;
+	uint64_t wp_first;
+	uint64_t wp_gen;		/* bumped by every write to the page */
+	uint64_t wp_dirty[BLOCKIF_WB_NSECT / 64];
+	int wp_busy;			/* being written back */
+	uint8_t *wp_data;
+};
+
+TAILQ_HEAD(blockif_wpq, blockif_wpage);
+
+/* A range of the disk read while a boot trace was recorded */
+struct blockif_trange {
+	off_t tr_off;
+	off_t tr_len;
+};
+
+/*
+ * A token bucket, kept as the time at which it will be full again:
+ * taking n tokens pushes tb_full n/rate seconds later, and a request has
+ * to wait for whatever of that exceeds the burst, tb_tau, from now.
+ */
+struct blockif_bucket {
+	uint64_t tb_rate;		/* tokens per second, 0 if unlimited */
+	uint64_t tb_tau;		/* burst, in ns of tb_rate */
+	uint64_t tb_full;		/* ns */
+};
+
+/*
+ * A sequential read stream. ra_buf holds the file's data for
+ * [ra_start, ra_end), read ahead of where the stream is expected to
+ * continue.
+ */
+struct blockif_ra {
+	off_t ra_next;			/* end of the stream's last read */
+	off_t ra_start;
+	off_t ra_end;
+	size_t ra_win;			/* bytes to keep read ahead */
+	int ra_seq;			/* sequential reads seen */
+	int ra_hit;			/* window used since the last fill */
+	int ra_want;			/* waiting for a fill */
+	int ra_busy;			/* being filled */
+	uint64_t ra_used;		/* for LRU replacement */
+	uint8_t *ra_buf;
+};
+
+/*
+ * State shared by every context open on one backing file, e.g. the queues
+ * of a multiqueue virtio-blk disk. A write through one context must be
+ * visible to the others, so they share the backend instance, the sparse
+ * map and the write-back cache.
+ */
+struct blockif_file {
+	struct blockif_file *bf_next;
+	int bf_refs;
+	dev_t bf_dev;
+	ino_t bf_ino;
+	const struct blockif_backend *bf_be;
+	void *bf_bearg;
+	struct blockif_binfo bf_bi;
+	/*
+	 * Sparse map: sorted, non-overlapping extents learned with
+	 * SEEK_DATA/SEEK_HOLE. bf_sp_gen and bf_sp_writers keep a probe
+	 * that raced with a modification from being cached.
+	 */
+	int bf_sparse;
+	pthread_mutex_t bf_sp_mtx;
+	struct blockif_extent *bf_sp_ext;
+	int bf_sp_n;
+	int bf_sp_writers;
+	uint64_t bf_sp_gen;
+	/*
+	 * Write-back cache, present if bf_wb_hash is set. Pages are kept in
+	 * the order they were first dirtied. bf_wb_seq changes whenever
+	 * dirty data leaves the cache, which tells a reader that the file
+	 * may have changed under it.
+	 */
+	pthread_mutex_t bf_wb_mtx;
+	pthread_cond_t bf_wb_cond;	/* a page stopped being busy */
+	int bf_wce;			/* absorb writes */
+	size_t bf_wb_max;		/* pages */
+	size_t bf_wb_npages;
+	struct blockif_wpage **bf_wb_hash;
+	size_t bf_wb_hmask;
+	struct blockif_wpq bf_wb_pages;
+	uint64_t bf_wb_wseq;		/* writes absorbed */
+	uint64_t bf_wb_seq;
+	time_t bf_wb_deadline;		/* of the timed writeback, or 0 */
+	int bf_wb_timer;		/* timed writeback running */
+	uint64_t bf_wb_nback;		/* pages written back */
+	/*
+	 * Readahead, if bf_ra_max is set. bf_ra_gen changes with every
+	 * modification of the file, so that a fill that raced with one is
+	 * thrown away.
+	 */
+	pthread_mutex_t bf_ra_mtx;
+	size_t bf_ra_max;
+	struct blockif_ra bf_ra[BLOCKIF_RA_STREAMS];
+	int bf_ra_want;			/* streams waiting for a fill */
+	uint64_t bf_ra_gen;
+	uint64_t bf_ra_clock;
+	uint64_t bf_ra_hits;
+	uint64_t bf_ra_fills;
+	/* I/O limits, shared by all the queues of a disk */
+	pthread_mutex_t bf_qos_mtx;
+	struct blockif_bucket bf_qos_iops;
+	struct blockif_bucket bf_qos_bps;
+	uint64_t bf_qos_nthrottled;	/* requests delayed */
+	uint64_t bf_qos_ns;		/* time they were delayed for */
+	/*
+	 * Boot trace. bf_tr_path is set by the first context opened with
+	 * trace=, which either records the trace here or replays it.
+	 */
+	pthread_mutex_t bf_tr_mtx;
+	char *bf_tr_path;
+	int bf_tr_rec;			/* recording */
+	time_t bf_tr_end;		/* until then */
+	struct blockif_trange *bf_tr;
+	size_t bf_tr_n;
+	size_t bf_tr_max;
 };
 
 struct blockif_ctxt {
 	int bc_magic;
 	int bc_fd;
+	struct blockif_file *bc_file;
+	const struct blockif_backend *bc_be;
+	void *bc_bearg;
 	int bc_ischr;
-	int bc_isgeom;
 	int bc_candelete;
+	int bc_blksz;		/* hole punching granularity */
+	/*
+	 * nocache: the alignment direct i/o needs, and a pool of aligned
+	 * bounce buffers for requests that don't have it.
+	 */
+	int bc_nocache;
+	size_t bc_dalign;
+	pthread_mutex_t bc_bounce_mtx;
+	uint8_t **bc_bounce;
+	int bc_nbounce;
+	struct blockif_cache *bc_cache;
+	/* Boot trace being replayed into bc_cache */
+	pthread_t bc_tr_tid;
+	struct blockif_trange *bc_tr;
+	size_t bc_tr_n;
+	size_t bc_tr_done;		/* ranges prefetched */
+	char *bc_ident;
+	struct blockif_ctxt *bc_next;	/* all open contexts */
 	int bc_rdonly;
 	off_t bc_size;
 	int bc_sectsz;
 	int bc_psectsz;
 	int bc_psectoff;
 	int bc_closing;
-	pthread_t bc_btid[BLOCKIF_NUMTHR];
+	enum blockengine bc_engine;
+	/*
+	 * The backend never blocks and no option needs the i/o threads, so
+	 * requests may run in the submitter's thread; bc_inline once the
+	 * device model has agreed to that.
+	 */
+	int bc_caninline;
+	int bc_inline;
+	struct blockif_aio *bc_aio;
+	struct blockif_ctxt *bc_aio_next;
+	int bc_aio_stalled;
+	int bc_numthr;
+	int bc_maxreq;
+	pthread_t bc_btid[BLOCKIF_MAXTHR];
 	pthread_mutex_t bc_mtx;
 	pthread_cond_t bc_cond;
 	/* Request elements and free/pending/busy queues */
 	TAILQ_HEAD(, blockif_elem) bc_freeq;
+	TAILQ_HEAD(, blockif_elem) bc_blockq;
 	TAILQ_HEAD(, blockif_elem) bc_pendq;
 	TAILQ_HEAD(, blockif_elem) bc_busyq;
-	struct blockif_elem	bc_reqs[BLOCKIF_MAXREQ];
+	/* Flushes waiting for the fsync in progress to finish */
+	TAILQ_HEAD(, blockif_elem) bc_flushq;
+	int bc_flushing;
+	uint64_t bc_nflush;
+	uint64_t bc_nfsync;
+	/* Interval tree of all queued and in-flight data requests */
+	RB_HEAD(blockif_rbq, blockif_elem) bc_rbq;
+	uint64_t bc_seq;
+	struct blockif_elem	*bc_reqs;
 };
 
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
 
+static int
+blockif_rb_cmp(struct blockif_elem *a, struct blockif_elem *b)
+{
+	if (a->be_start != b->be_start)
+		return (a->be_start < b->be_start ? -1 : 1);
+	if (a->be_seq != b->be_seq)
+		return (a->be_seq < b->be_seq ? -1 : 1);
+	return (0);
+}
+
+RB_PROTOTYPE_STATIC(blockif_rbq, blockif_elem, be_rb, blockif_rb_cmp);
+RB_GENERATE_STATIC(blockif_rbq, blockif_elem, be_rb, blockif_rb_cmp)
+
+static void
+blockif_augment(struct blockif_elem *be)
+{
+	struct blockif_elem *l, *r;
+
+	for (; be != NULL; be = RB_PARENT(be, be_rb)) {
+		be->be_maxend = be->be_block;
+		l = RB_LEFT(be, be_rb);
+		r = RB_RIGHT(be, be_rb);
+		if (l != NULL && l->be_maxend > be->be_maxend)
+			be->be_maxend = l->be_maxend;
+		if (r != NULL && r->be_maxend > be->be_maxend)
+			be->be_maxend = r->be_maxend;
+	}
+}
+
 struct blockif_sig_elem {
 	pthread_mutex_t bse_mtx;
 	pthread_cond_t bse_cond;
@@ -119,33 +496,136 @@ struct blockif_sig_elem {
 
 static struct blockif_sig_elem *blockif_bse_head;
 
+/* Contexts using the aio engine, scanned on every SIGIO */
+static pthread_mutex_t blockif_aio_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct blockif_ctxt *blockif_aio_head;
+
+/* All open contexts, for SIGINFO statistics */
+static pthread_mutex_t blockif_list_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct blockif_ctxt *blockif_list_head;
+
+/* Block caches, one per backing file */
+static pthread_mutex_t blockif_cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct blockif_cache *blockif_cache_head;
+
+/* Shared state of every open backing file */
+static pthread_mutex_t blockif_file_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct blockif_file *blockif_file_head;
+
+/* Converts mach_absolute_time() to nanoseconds for the qos limits */
+static mach_timebase_info_data_t blockif_timebase;
+
 #pragma clang diagnostic pop
 
 static ssize_t
-preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+blockif_rwv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+	int wr)
 {
-	off_t res;
+	ssize_t done, len;
+	size_t voff;
+	uint8_t *base;
+	int i;
 
-	res = lseek(fd, offset, SEEK_SET);
-	assert(res == offset);
-	return readv(fd, iov, iovcnt);
+	done = 0;
+	for (i = 0; i < iovcnt; i++) {
+		voff = 0;
+		while (voff < iov[i].iov_len) {
+			base = ((uint8_t *) iov[i].iov_base) + voff;
+			if (wr)
+				len = pwrite(fd, base, iov[i].iov_len - voff,
+					offset + done);
+			else
+				len = pread(fd, base, iov[i].iov_len - voff,
+					offset + done);
+			if (len < 0)
+				return (done ? done : -1);
+			if (len == 0)
+				return (done);
+			voff += (size_t) len;
+			done += len;
+		}
+	}
+	return (done);
 }
 
-static ssize_t
-pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+ssize_t
+blockif_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+#ifdef BLOCKIF_HAVE_PREADV
+	if (__builtin_available(macOS 11.0, *))
+		return (preadv(fd, iov, iovcnt, offset));
+#endif
+	return (blockif_rwv(fd, iov, iovcnt, offset, 0));
+}
+
+ssize_t
+blockif_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+#ifdef BLOCKIF_HAVE_PREADV
+	if (__builtin_available(macOS 11.0, *))
+		return (pwritev(fd, iov, iovcnt, offset));
+#endif
+	return (blockif_rwv(fd, iov, iovcnt, offset, 1));
+}
+
+static int
+blockif_iswrite(struct blockif_elem *be)
+{
+	return (be->be_op == BOP_WRITE || be->be_op == BOP_DELETE ||
+	    be->be_op == BOP_ZERO);
+}
+
+/*
+ * Is there an older request in the tree whose range overlaps that of be
+ * and which must be ordered against it? Only two reads may run out of
+ * order. The max-end augmentation prunes subtrees that end before be
+ * starts.
+ */
+static int
+blockif_conflict(struct blockif_elem *node, struct blockif_elem *be)
 {
-	off_t res;
+	while (node != NULL && node->be_maxend > be->be_start) {
+		if (blockif_conflict(RB_LEFT(node, be_rb), be))
+			return (1);
+		if (node->be_start >= be->be_block)
+			return (0);
+		if (node != be && node->be_seq < be->be_seq &&
+		    node->be_block > be->be_start &&
+		    (blockif_iswrite(node) || blockif_iswrite(be)))
+			return (1);
+		node = RB_RIGHT(node, be_rb);
+	}
+	return (0);
+}
 
-	res = lseek(fd, offset, SEEK_SET);
-	assert(res == offset);
-	return writev(fd, iov, iovcnt);
+/*
+ * Move blocked requests overlapping the range of a completed request back
+ * to the pending queue if nothing else holds them up.
+ */
+static void
+blockif_unblock(struct blockif_ctxt *bc, struct blockif_elem *node,
+	struct blockif_elem *done)
+{
+	while (node != NULL && node->be_maxend > done->be_start) {
+		blockif_unblock(bc, RB_LEFT(node, be_rb), done);
+		if (node->be_start >= done->be_block)
+			return;
+		if (node->be_status == BST_BLOCK &&
+		    node->be_block > done->be_start &&
+		    !blockif_conflict(RB_ROOT(&bc->bc_rbq), node)) {
+			TAILQ_REMOVE(&bc->bc_blockq, node, be_link);
+			node->be_status = BST_PEND;
+			TAILQ_INSERT_TAIL(&bc->bc_pendq, node, be_link);
+		}
+		node = RB_RIGHT(node, be_rb);
+	}
 }
 
 static int
 blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
 {
-	struct blockif_elem *be, *tbe;
+	struct blockif_elem *be;
 	off_t off;
 	int i;
 
@@ -155,33 +635,40 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	TAILQ_REMOVE(&bc->bc_freeq, be, be_link);
 	be->be_req = breq;
 	be->be_op = op;
+	be->be_seq = bc->bc_seq++;
+	be->be_start = breq->br_offset;
 	switch (op) {
 	case BOP_READ:
 	case BOP_WRITE:
-	case BOP_DELETE:
 		off = breq->br_offset;
 		for (i = 0; i < breq->br_iovcnt; i++)
 			off += breq->br_iov[i].iov_len;
 		break;
+	case BOP_DELETE:
+	case BOP_ZERO:
+		off = breq->br_offset + breq->br_resid;
+		break;
 	case BOP_FLUSH:
 		off = OFF_MAX;
 	}
 	be->be_block = off;
-	TAILQ_FOREACH(tbe, &bc->bc_pendq, be_link) {
-		if (tbe->be_block == breq->br_offset)
-			break;
-	}
-	if (tbe == NULL) {
-		TAILQ_FOREACH(tbe, &bc->bc_busyq, be_link) {
-			if (tbe->be_block == breq->br_offset)
-				break;
-		}
-	}
-	if (tbe == NULL)
+
+	/* Flushes are not ordered against data requests */
+	if (op == BOP_FLUSH) {
 		be->be_status = BST_PEND;
-	else
+		TAILQ_INSERT_TAIL(&bc->bc_pendq, be, be_link);
+		return (1);
+	}
+
+	be->be_maxend = off;
+	RB_INSERT(blockif_rbq, &bc->bc_rbq, be);
+	if (blockif_conflict(RB_ROOT(&bc->bc_rbq), be)) {
 		be->be_status = BST_BLOCK;
-	TAILQ_INSERT_TAIL(&bc->bc_pendq, be, be_link);
+		TAILQ_INSERT_TAIL(&bc->bc_blockq, be, be_link);
+	} else {
+		be->be_status = BST_PEND;
+		TAILQ_INSERT_TAIL(&bc->bc_pendq, be, be_link);
+	}
 	return (be->be_status == BST_PEND);
 }
 
@@ -190,13 +677,10 @@ blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 {
 	struct blockif_elem *be;
 
-	TAILQ_FOREACH(be, &bc->bc_pendq, be_link) {
-		if (be->be_status == BST_PEND)
-			break;
-		assert(be->be_status == BST_BLOCK);
-	}
+	be = TAILQ_FIRST(&bc->bc_pendq);
 	if (be == NULL)
 		return (0);
+	assert(be->be_status == BST_PEND);
 	TAILQ_REMOVE(&bc->bc_pendq, be, be_link);
 	be->be_status = BST_BUSY;
 	be->be_tid = t;
@@ -205,234 +689,2711 @@ blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 	return (1);
 }
 
+/*
+ * Pull runnable requests of the same type that start exactly where the
+ * dequeued one ends off the pending queue, so that blockif_proc_merged
+ * can issue the whole run as one vectored i/o.
+ */
 static void
-blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
+blockif_merge(struct blockif_ctxt *bc, struct blockif_elem *be)
 {
-	struct blockif_elem *tbe;
+	struct blockif_elem *tbe, *last, key;
+	int iovcnt, n;
+
+	if (be->be_op != BOP_READ && be->be_op != BOP_WRITE)
+		return;
+
+	last = be;
+	iovcnt = be->be_req->br_iovcnt;
+	for (n = 1; n < BLOCKIF_MERGE_MAX; n++) {
+		key.be_start = last->be_block;
+		key.be_seq = 0;
+		for (tbe = RB_NFIND(blockif_rbq, &bc->bc_rbq, &key);
+		     tbe != NULL && tbe->be_start == key.be_start;
+		     tbe = RB_NEXT(blockif_rbq, &bc->bc_rbq, tbe)) {
+			if (tbe->be_status == BST_PEND &&
+			    tbe->be_op == be->be_op &&
+			    iovcnt + tbe->be_req->br_iovcnt <= BLOCKIF_MERGE_IOV)
+				break;
+		}
+		if (tbe == NULL || tbe->be_start != key.be_start)
+			break;
+		TAILQ_REMOVE(&bc->bc_pendq, tbe, be_link);
+		tbe->be_status = BST_BUSY;
+		tbe->be_tid = be->be_tid;
+		TAILQ_INSERT_TAIL(&bc->bc_busyq, tbe, be_link);
+		iovcnt += tbe->be_req->br_iovcnt;
+		last->be_merged = tbe;
+		last = tbe;
+	}
+}
 
+static void
+blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
 	if (be->be_status == BST_DONE || be->be_status == BST_BUSY)
 		TAILQ_REMOVE(&bc->bc_busyq, be, be_link);
+	else if (be->be_status == BST_BLOCK)
+		TAILQ_REMOVE(&bc->bc_blockq, be, be_link);
+	else if (be->be_status == BST_PARK)
+		TAILQ_REMOVE(&bc->bc_flushq, be, be_link);
 	else
 		TAILQ_REMOVE(&bc->bc_pendq, be, be_link);
-	TAILQ_FOREACH(tbe, &bc->bc_pendq, be_link) {
-		if (tbe->be_req->br_offset == be->be_block)
-			tbe->be_status = BST_PEND;
+	if (be->be_op != BOP_FLUSH) {
+		RB_REMOVE(blockif_rbq, &bc->bc_rbq, be);
+		blockif_unblock(bc, RB_ROOT(&bc->bc_rbq), be);
 	}
 	be->be_tid = 0;
 	be->be_status = BST_FREE;
 	be->be_req = NULL;
+	be->be_merged = NULL;
 	TAILQ_INSERT_TAIL(&bc->bc_freeq, be, be_link);
 }
 
+/*
+ * Index of the first extent ending after off, or bf_sp_n.
+ */
+static int
+blockif_sp_search(struct blockif_file *bf, off_t off)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = bf->bf_sp_n;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (bf->bf_sp_ext[mid].bx_end <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+/*
+ * Drop cached extents of the given kind overlapping [start, end). A write
+ * turns holes into data and a discard turns data into holes; extents of
+ * the other kind stay valid.
+ */
+static void
+blockif_sp_drop(struct blockif_file *bf, off_t start, off_t end, int hole)
+{
+	struct blockif_extent *bx;
+	int i, j;
+
+	i = j = blockif_sp_search(bf, start);
+	for (; i < bf->bf_sp_n && bf->bf_sp_ext[i].bx_start < end; i++) {
+		bx = &bf->bf_sp_ext[i];
+		if (bx->bx_hole != hole)
+			bf->bf_sp_ext[j++] = *bx;
+	}
+	memmove(&bf->bf_sp_ext[j], &bf->bf_sp_ext[i],
+		sizeof(struct blockif_extent) * ((size_t) (bf->bf_sp_n - i)));
+	bf->bf_sp_n -= i - j;
+}
+
+static void
+blockif_sp_insert(struct blockif_file *bf, off_t start, off_t end, int hole)
+{
+	int i;
+
+	blockif_sp_drop(bf, start, end, 0);
+	blockif_sp_drop(bf, start, end, 1);
+	if (bf->bf_sp_n == BLOCKIF_SPARSE_MAX)
+		bf->bf_sp_n = 0;
+	i = blockif_sp_search(bf, start);
+	memmove(&bf->bf_sp_ext[i + 1], &bf->bf_sp_ext[i],
+		sizeof(struct blockif_extent) * ((size_t) (bf->bf_sp_n - i)));
+	bf->bf_sp_ext[i].bx_start = start;
+	bf->bf_sp_ext[i].bx_end = end;
+	bf->bf_sp_ext[i].bx_hole = hole;
+	bf->bf_sp_n++;
+}
+
+/*
+ * Learn the extent containing off from the filesystem.
+ */
+static void
+blockif_sp_probe(struct blockif_ctxt *bc, off_t off)
+{
+	struct blockif_file *bf;
+#ifdef SEEK_DATA
+	off_t data, hole;
+	uint64_t gen;
+
+	bf = bc->bc_file;
+	pthread_mutex_lock(&bf->bf_sp_mtx);
+	gen = bf->bf_sp_gen;
+	if (bf->bf_sp_writers) {
+		pthread_mutex_unlock(&bf->bf_sp_mtx);
+		return;
+	}
+	pthread_mutex_unlock(&bf->bf_sp_mtx);
+
+	data = lseek(bc->bc_fd, off, SEEK_DATA);
+	if (data < 0 && errno == ENXIO)
+		data = bc->bc_size;
+	hole = -1;
+	if (data == off)
+		hole = lseek(bc->bc_fd, off, SEEK_HOLE);
+
+	pthread_mutex_lock(&bf->bf_sp_mtx);
+	if (data < 0 || (data == off && hole < 0)) {
+		/* The filesystem can't tell us; stop asking */
+		bf->bf_sparse = 0;
+	} else if (gen == bf->bf_sp_gen && !bf->bf_sp_writers) {
+		if (data > off)
+			blockif_sp_insert(bf, off, data, 1);
+		else if (hole > off)
+			blockif_sp_insert(bf, off, hole, 0);
+	}
+	pthread_mutex_unlock(&bf->bf_sp_mtx);
+#else
+	bf = bc->bc_file;
+	pthread_mutex_lock(&bf->bf_sp_mtx);
+	bf->bf_sparse = 0;
+	pthread_mutex_unlock(&bf->bf_sp_mtx);
+	(void) off;
+#endif
+}
+
+/*
+ * Does [off, off + len) lie entirely within a hole?
+ */
+static int
+blockif_sp_ishole(struct blockif_ctxt *bc, off_t off, off_t len)
+{
+	struct blockif_file *bf;
+	struct blockif_extent *bx;
+	int i, probed, hole;
+
+	bf = bc->bc_file;
+	for (probed = 0;; probed = 1) {
+		pthread_mutex_lock(&bf->bf_sp_mtx);
+		if (!bf->bf_sparse) {
+			pthread_mutex_unlock(&bf->bf_sp_mtx);
+			return (0);
+		}
+		i = blockif_sp_search(bf, off);
+		bx = &bf->bf_sp_ext[i];
+		if (i < bf->bf_sp_n && bx->bx_start <= off) {
+			hole = bx->bx_hole && bx->bx_end >= off + len;
+			pthread_mutex_unlock(&bf->bf_sp_mtx);
+			return (hole);
+		}
+		pthread_mutex_unlock(&bf->bf_sp_mtx);
+		if (probed)
+			return (0);
+		blockif_sp_probe(bc, off);
+	}
+}
+
+static void
+blockif_sp_begin(struct blockif_ctxt *bc, off_t off, off_t len, int hole)
+{
+	struct blockif_file *bf;
+
+	bf = bc->bc_file;
+	if (bf->bf_sp_ext == NULL)
+		return;
+	pthread_mutex_lock(&bf->bf_sp_mtx);
+	bf->bf_sp_writers++;
+	blockif_sp_drop(bf, off, off + len, hole);
+	pthread_mutex_unlock(&bf->bf_sp_mtx);
+}
+
+static void
+blockif_sp_end(struct blockif_ctxt *bc, off_t off, off_t len, int hole)
+{
+	struct blockif_file *bf;
+
+	bf = bc->bc_file;
+	if (bf->bf_sp_ext == NULL)
+		return;
+	pthread_mutex_lock(&bf->bf_sp_mtx);
+	bf->bf_sp_writers--;
+	bf->bf_sp_gen++;
+	blockif_sp_drop(bf, off, off + len, hole);
+	pthread_mutex_unlock(&bf->bf_sp_mtx);
+}
+
+size_t
+blockif_iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len;
+	int i;
+
+	len = 0;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return (len);
+}
+
+/*
+ * Describe len bytes of an iovec array, starting skip bytes in, with a
+ * new array. out needs room for iovcnt entries.
+ */
+int
+blockif_iov_slice(const struct iovec *iov, int iovcnt, size_t skip,
+	size_t len, struct iovec *out)
+{
+	int i, n;
+
+	for (i = n = 0; i < iovcnt && len > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		out[n].iov_base = ((uint8_t *) iov[i].iov_base) + skip;
+		out[n].iov_len = MIN(iov[i].iov_len - skip, len);
+		len -= out[n].iov_len;
+		skip = 0;
+		n++;
+	}
+	return (n);
+}
+
+/*
+ * Copy len bytes from buf into an iovec array, starting skip bytes in.
+ */
+static void
+blockif_iov_copyin(const struct iovec *iov, int iovcnt, size_t skip,
+	const uint8_t *buf, size_t len)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		n = MIN(iov[i].iov_len - skip, len);
+		memcpy(((uint8_t *) iov[i].iov_base) + skip, buf, n);
+		buf += n;
+		len -= n;
+		skip = 0;
+	}
+}
+
+/*
+ * Copy len bytes out of an iovec array into buf, starting skip bytes in.
+ */
 static void
-blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
+blockif_iov_copyout(const struct iovec *iov, int iovcnt, size_t skip,
+	uint8_t *buf, size_t len)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		n = MIN(iov[i].iov_len - skip, len);
+		memcpy(buf, ((uint8_t *) iov[i].iov_base) + skip, n);
+		buf += n;
+		len -= n;
+		skip = 0;
+	}
+}
+
+/*
+ * Are the iovecs aligned for nocache i/o? Only memory is checked: a bounce
+ * buffer could not fix up an unaligned file offset, and the kernel serves
+ * such requests through the buffer cache.
+ */
+static int
+blockif_iov_aligned(struct blockif_ctxt *bc, const struct iovec *iov,
+	int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		if ((((uintptr_t) iov[i].iov_base) | iov[i].iov_len) &
+		    (bc->bc_dalign - 1))
+			return (0);
+	return (1);
+}
+
+static uint8_t *
+blockif_bounce_get(struct blockif_ctxt *bc)
+{
+	void *buf;
+
+	pthread_mutex_lock(&bc->bc_bounce_mtx);
+	if (bc->bc_nbounce > 0) {
+		buf = bc->bc_bounce[--bc->bc_nbounce];
+		pthread_mutex_unlock(&bc->bc_bounce_mtx);
+		return (buf);
+	}
+	pthread_mutex_unlock(&bc->bc_bounce_mtx);
+	if ((errno = posix_memalign(&buf, bc->bc_dalign,
+	    BLOCKIF_BOUNCE_SZ)) != 0)
+		return (NULL);
+	return (buf);
+}
+
+static void
+blockif_bounce_put(struct blockif_ctxt *bc, uint8_t *buf)
+{
+	pthread_mutex_lock(&bc->bc_bounce_mtx);
+	if (bc->bc_nbounce < bc->bc_numthr) {
+		bc->bc_bounce[bc->bc_nbounce++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&bc->bc_bounce_mtx);
+	free(buf);
+}
+
+/*
+ * nocache i/o through an aligned bounce buffer, a buffer-full at a time.
+ */
+static ssize_t
+blockif_bounce_rw(struct blockif_ctxt *bc, const struct iovec *iov,
+	int iovcnt, off_t off, int wr)
+{
+	size_t done, len, n;
+	uint8_t *buf;
+	ssize_t ret;
+	int err;
+
+	if ((buf = blockif_bounce_get(bc)) == NULL)
+		return (-1);
+	len = blockif_iov_len(iov, iovcnt);
+	err = 0;
+	for (done = 0; done < len; done += (size_t) ret) {
+		n = MIN(len - done, BLOCKIF_BOUNCE_SZ);
+		if (wr) {
+			blockif_iov_copyout(iov, iovcnt, done, buf, n);
+			ret = pwrite(bc->bc_fd, buf, n, off + ((off_t) done));
+		} else {
+			ret = pread(bc->bc_fd, buf, n, off + ((off_t) done));
+			if (ret > 0)
+				blockif_iov_copyin(iov, iovcnt, done, buf,
+					(size_t) ret);
+		}
+		if (ret < 0)
+			err = errno;
+		if (ret <= 0)
+			break;
+	}
+	blockif_bounce_put(bc, buf);
+	if (err != 0 && done == 0) {
+		errno = err;
+		return (-1);
+	}
+	return ((ssize_t) done);
+}
+
+/*
+ * Positional i/o on the backing store, whether a file or a backend.
+ */
+static ssize_t
+blockif_breadv(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+	off_t off)
+{
+	if (bc->bc_be != NULL)
+		return (bc->bc_be->bb_preadv(bc->bc_bearg, iov, iovcnt, off));
+	if (bc->bc_nocache && !blockif_iov_aligned(bc, iov, iovcnt))
+		return (blockif_bounce_rw(bc, iov, iovcnt, off, 0));
+	return (blockif_preadv(bc->bc_fd, iov, iovcnt, off));
+}
+
+static ssize_t
+blockif_bwritev(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+	off_t off)
+{
+	if (bc->bc_be != NULL)
+		return (bc->bc_be->bb_pwritev(bc->bc_bearg, iov, iovcnt, off));
+	if (bc->bc_nocache && !blockif_iov_aligned(bc, iov, iovcnt))
+		return (blockif_bounce_rw(bc, iov, iovcnt, off, 1));
+	return (blockif_pwritev(bc->bc_fd, iov, iovcnt, off));
+}
+
+/*
+ * Whether a read at off continues a stream. Requests run on several
+ * threads and can overtake each other, so a little slack either side of
+ * where the stream left off still counts.
+ */
+static int
+blockif_ra_near(const struct blockif_ra *ra, off_t off)
+{
+	return (off < ra->ra_next + BLOCKIF_RA_MIN &&
+	    off + BLOCKIF_RA_MIN > ra->ra_next);
+}
+
+/*
+ * Serve a read from a readahead window if it lies entirely within one,
+ * and follow the read streams: a stream that has read sequentially twice
+ * gets its window topped up by an i/o thread once less than half of it
+ * is left ahead of the reader. The window doubles, up to bf_ra_max, every
+ * time it is topped up after being used.
+ */
+static ssize_t
+blockif_ra_read(struct blockif_ctxt *bc, const struct iovec *iov,
+	int iovcnt, off_t off)
+{
+	struct blockif_file *bf;
+	struct blockif_ra *ra, *lru;
+	size_t len;
+	int i, hit;
+
+	bf = bc->bc_file;
+	len = blockif_iov_len(iov, iovcnt);
+	hit = 0;
+
+	pthread_mutex_lock(&bf->bf_ra_mtx);
+	ra = lru = NULL;
+	for (i = 0; i < BLOCKIF_RA_STREAMS; i++) {
+		if (blockif_ra_near(&bf->bf_ra[i], off) ||
+		    (off >= bf->bf_ra[i].ra_start && off < bf->bf_ra[i].ra_end)) {
+			ra = &bf->bf_ra[i];
+			break;
+		}
+		if (!bf->bf_ra[i].ra_busy &&
+		    (lru == NULL || bf->bf_ra[i].ra_used < lru->ra_used))
+			lru = &bf->bf_ra[i];
+	}
+	if (ra != NULL) {
+		if (off >= ra->ra_start && off + ((off_t) len) <= ra->ra_end) {
+			blockif_iov_copyin(iov, iovcnt, 0,
+				ra->ra_buf + (off - ra->ra_start), len);
+			ra->ra_hit = 1;
+			bf->bf_ra_hits++;
+			hit = 1;
+		}
+		if (blockif_ra_near(ra, off))
+			ra->ra_seq++;
+	} else if (lru != NULL) {
+		/* A new stream, perhaps */
+		ra = lru;
+		ra->ra_next = off;
+		ra->ra_start = ra->ra_end = 0;
+		ra->ra_win = MIN(BLOCKIF_RA_MIN, bf->bf_ra_max);
+		ra->ra_seq = 0;
+		ra->ra_hit = 0;
+		if (ra->ra_want) {
+			ra->ra_want = 0;
+			bf->bf_ra_want--;
+		}
+	}
+	if (ra != NULL) {
+		ra->ra_next = MAX(ra->ra_next, off + ((off_t) len));
+		ra->ra_used = ++bf->bf_ra_clock;
+		if (ra->ra_seq >= 2 && !ra->ra_want && !ra->ra_busy &&
+		    ra->ra_next < bc->bc_size &&
+		    ra->ra_end - ra->ra_next < ((off_t) ra->ra_win) / 2) {
+			ra->ra_want = 1;
+			bf->bf_ra_want++;
+		}
+	}
+	pthread_mutex_unlock(&bf->bf_ra_mtx);
+
+	if (hit)
+		return ((ssize_t) len);
+	return (blockif_breadv(bc, iov, iovcnt, off));
+}
+
+/*
+ * Top up the window of a stream that wants it. Run by an i/o thread once
+ * it has completed a request, so the guest never waits for it.
+ */
+static void
+blockif_ra_fill(struct blockif_ctxt *bc)
+{
+	struct blockif_file *bf;
+	struct blockif_ra *ra;
+	struct iovec iov;
+	size_t keep;
+	uint64_t gen;
+	ssize_t len;
+	off_t start;
+	int i;
+
+	bf = bc->bc_file;
+	pthread_mutex_lock(&bf->bf_ra_mtx);
+	for (i = 0, ra = NULL; i < BLOCKIF_RA_STREAMS && ra == NULL; i++)
+		if (bf->bf_ra[i].ra_want && !bf->bf_ra[i].ra_busy)
+			ra = &bf->bf_ra[i];
+	if (ra == NULL) {
+		pthread_mutex_unlock(&bf->bf_ra_mtx);
+		return;
+	}
+	ra->ra_want = 0;
+	bf->bf_ra_want--;
+	if (ra->ra_buf == NULL &&
+	    (ra->ra_buf = malloc(bf->bf_ra_max)) == NULL) {
+		pthread_mutex_unlock(&bf->bf_ra_mtx);
+		return;
+	}
+	if (ra->ra_hit) {
+		ra->ra_win = MIN(ra->ra_win * 2, bf->bf_ra_max);
+		ra->ra_hit = 0;
+	}
+
+	/* Keep what is still ahead of the reader */
+	if (ra->ra_next >= ra->ra_start && ra->ra_next < ra->ra_end) {
+		keep = (size_t) (ra->ra_end - ra->ra_next);
+		memmove(ra->ra_buf, ra->ra_buf + (ra->ra_next - ra->ra_start),
+			keep);
+		ra->ra_start = ra->ra_next;
+	} else {
+		keep = 0;
+		ra->ra_start = ra->ra_end = ra->ra_next;
+	}
+	iov.iov_base = ra->ra_buf + keep;
+	iov.iov_len = (size_t) MIN(((off_t) (ra->ra_win - keep)),
+		bc->bc_size - ra->ra_end);
+	start = ra->ra_start;
+	gen = bf->bf_ra_gen;
+	ra->ra_busy = 1;
+	bf->bf_ra_fills++;
+	pthread_mutex_unlock(&bf->bf_ra_mtx);
+
+	len = blockif_breadv(bc, &iov, 1, start + ((off_t) keep));
+
+	pthread_mutex_lock(&bf->bf_ra_mtx);
+	ra->ra_busy = 0;
+	if (len > 0 && gen == bf->bf_ra_gen && ra->ra_start == start)
+		ra->ra_end = start + ((off_t) keep) + len;
+	pthread_mutex_unlock(&bf->bf_ra_mtx);
+}
+
+/*
+ * Drop the readahead data of a range that is changing.
+ */
+static void
+blockif_ra_inval(struct blockif_ctxt *bc, off_t off, off_t len)
+{
+	struct blockif_file *bf;
+	struct blockif_ra *ra;
+	int i;
+
+	bf = bc->bc_file;
+	if (bf->bf_ra_max == 0)
+		return;
+	pthread_mutex_lock(&bf->bf_ra_mtx);
+	bf->bf_ra_gen++;
+	for (i = 0; i < BLOCKIF_RA_STREAMS; i++) {
+		ra = &bf->bf_ra[i];
+		if (ra->ra_start < off + len && off < ra->ra_end)
+			ra->ra_end = ra->ra_start;
+	}
+	pthread_mutex_unlock(&bf->bf_ra_mtx);
+}
+
+/*
+ * Read from the backing file. Reads that fall entirely within a hole of a
+ * sparse image are satisfied by zero-filling the iovecs.
+ */
+static ssize_t
+blockif_file_readv(struct blockif_ctxt *bc, const struct iovec *iov,
+	int iovcnt, off_t off)
+{
+	size_t len;
+	int i;
+
+	if (bc->bc_file->bf_sparse) {
+		len = blockif_iov_len(iov, iovcnt);
+		if (blockif_sp_ishole(bc, off, (off_t) len)) {
+			for (i = 0; i < iovcnt; i++)
+				memset(iov[i].iov_base, 0, iov[i].iov_len);
+			return ((ssize_t) len);
+		}
+	}
+	if (bc->bc_file->bf_ra_max != 0)
+		return (blockif_ra_read(bc, iov, iovcnt, off));
+	return (blockif_breadv(bc, iov, iovcnt, off));
+}
+
+/*
+ * Reference the cache of a file, creating it with mb MiB if there is none.
+ * An existing cache of another size is an error (EEXIST) when exact is set;
+ * otherwise mb is only a default and any size will do.
+ */
+static struct blockif_cache *
+blockif_cache_get(const struct stat *sbuf, int mb, int exact)
+{
+	struct blockif_cache *bk;
+	size_t i, hsize;
+
+	pthread_mutex_lock(&blockif_cache_mtx);
+	for (bk = blockif_cache_head; bk != NULL; bk = bk->bk_next) {
+		if (bk->bk_dev == sbuf->st_dev && bk->bk_ino == sbuf->st_ino) {
+			if (exact && bk->bk_npages != ((size_t) mb) <<
+			    (20 - BLOCKIF_CACHE_PGSHIFT)) {
+				fprintf(stderr, "bcache=%d: the file is already "
+				    "cached with %zu MiB\n", mb,
+				    bk->bk_npages >>
+				    (20 - BLOCKIF_CACHE_PGSHIFT));
+				pthread_mutex_unlock(&blockif_cache_mtx);
+				errno = EEXIST;
+				return (NULL);
+			}
+			bk->bk_refs++;
+			pthread_mutex_unlock(&blockif_cache_mtx);
+			return (bk);
+		}
+	}
+
+	bk = calloc(1, sizeof(struct blockif_cache));
+	if (bk == NULL)
+		goto err;
+	bk->bk_npages = ((size_t) mb) << (20 - BLOCKIF_CACHE_PGSHIFT);
+	bk->bk_kin = MAX(bk->bk_npages / 4, 1);
+	bk->bk_kout = MAX(bk->bk_npages / 2, 1);
+	/* Enough nodes for every buffer, every ghost and one insertion */
+	bk->bk_nnodes = bk->bk_npages + bk->bk_kout + 1;
+	for (hsize = 1; hsize < bk->bk_nnodes; hsize <<= 1)
+		;
+	bk->bk_hmask = hsize - 1;
+	bk->bk_pages = calloc(bk->bk_nnodes, sizeof(struct blockif_cpage));
+	bk->bk_bufs = calloc(bk->bk_npages, sizeof(uint8_t *));
+	bk->bk_hash = calloc(hsize, sizeof(struct blockif_cpage *));
+	bk->bk_data = malloc(bk->bk_npages * BLOCKIF_CACHE_PGSZ);
+	if (bk->bk_pages == NULL || bk->bk_bufs == NULL ||
+	    bk->bk_hash == NULL || bk->bk_data == NULL) {
+		free(bk->bk_pages);
+		free(bk->bk_bufs);
+		free(bk->bk_hash);
+		free(bk->bk_data);
+		free(bk);
+		goto err;
+	}
+
+	pthread_mutex_init(&bk->bk_mtx, NULL);
+	TAILQ_INIT(&bk->bk_free);
+	TAILQ_INIT(&bk->bk_a1in);
+	TAILQ_INIT(&bk->bk_am);
+	TAILQ_INIT(&bk->bk_a1out);
+	for (i = 0; i < bk->bk_nnodes; i++) {
+		bk->bk_pages[i].cp_q = BCQ_FREE;
+		TAILQ_INSERT_TAIL(&bk->bk_free, &bk->bk_pages[i], cp_link);
+	}
+	for (i = 0; i < bk->bk_npages; i++)
+		bk->bk_bufs[i] = bk->bk_data + i * BLOCKIF_CACHE_PGSZ;
+	bk->bk_nbufs = bk->bk_npages;
+	bk->bk_refs = 1;
+	bk->bk_dev = sbuf->st_dev;
+	bk->bk_ino = sbuf->st_ino;
+	bk->bk_next = blockif_cache_head;
+	blockif_cache_head = bk;
+	pthread_mutex_unlock(&blockif_cache_mtx);
+	return (bk);
+err:
+	pthread_mutex_unlock(&blockif_cache_mtx);
+	return (NULL);
+}
+
+static void
+blockif_cache_put(struct blockif_cache *bk)
+{
+	struct blockif_cache **bkp;
+
+	pthread_mutex_lock(&blockif_cache_mtx);
+	if (--bk->bk_refs > 0) {
+		pthread_mutex_unlock(&blockif_cache_mtx);
+		return;
+	}
+	for (bkp = &blockif_cache_head; *bkp != bk; bkp = &(*bkp)->bk_next)
+		;
+	*bkp = bk->bk_next;
+	pthread_mutex_unlock(&blockif_cache_mtx);
+
+	pthread_mutex_destroy(&bk->bk_mtx);
+	free(bk->bk_pages);
+	free(bk->bk_bufs);
+	free(bk->bk_hash);
+	free(bk->bk_data);
+	free(bk);
+}
+
+static struct blockif_cpage *
+blockif_cache_find(struct blockif_cache *bk, off_t idx)
+{
+	struct blockif_cpage *cp;
+
+	for (cp = bk->bk_hash[((size_t) idx) & bk->bk_hmask]; cp != NULL;
+	     cp = cp->cp_hnext)
+		if (cp->cp_idx == idx)
+			break;
+	return (cp);
+}
+
+/*
+ * Take a page off its queue. A resident page gives its data buffer back.
+ */
+static void
+blockif_cache_unlink(struct blockif_cache *bk, struct blockif_cpage *cp)
+{
+	switch (cp->cp_q) {
+	case BCQ_FREE:
+		TAILQ_REMOVE(&bk->bk_free, cp, cp_link);
+		break;
+	case BCQ_A1IN:
+		TAILQ_REMOVE(&bk->bk_a1in, cp, cp_link);
+		bk->bk_nin--;
+		break;
+	case BCQ_AM:
+		TAILQ_REMOVE(&bk->bk_am, cp, cp_link);
+		break;
+	case BCQ_A1OUT:
+		TAILQ_REMOVE(&bk->bk_a1out, cp, cp_link);
+		bk->bk_nout--;
+		break;
+	}
+	if (cp->cp_data != NULL) {
+		bk->bk_bufs[bk->bk_nbufs++] = cp->cp_data;
+		cp->cp_data = NULL;
+	}
+}
+
+/*
+ * Forget a page entirely, ghost or not.
+ */
+static void
+blockif_cache_release(struct blockif_cache *bk, struct blockif_cpage *cp)
+{
+	struct blockif_cpage **cpp;
+
+	blockif_cache_unlink(bk, cp);
+	for (cpp = &bk->bk_hash[((size_t) cp->cp_idx) & bk->bk_hmask];
+	     *cpp != cp; cpp = &(*cpp)->cp_hnext)
+		;
+	*cpp = cp->cp_hnext;
+	cp->cp_q = BCQ_FREE;
+	TAILQ_INSERT_HEAD(&bk->bk_free, cp, cp_link);
+}
+
+/*
+ * Free up one data buffer. A1in is trimmed while it is over its target
+ * size, with the victim's index remembered on A1out; otherwise the least
+ * recently used page of Am goes.
+ */
+static void
+blockif_cache_evict(struct blockif_cache *bk)
+{
+	struct blockif_cpage *cp;
+
+	if (bk->bk_nin > bk->bk_kin || TAILQ_EMPTY(&bk->bk_am)) {
+		cp = TAILQ_LAST(&bk->bk_a1in, blockif_cpq);
+		blockif_cache_unlink(bk, cp);
+		cp->cp_q = BCQ_A1OUT;
+		TAILQ_INSERT_HEAD(&bk->bk_a1out, cp, cp_link);
+		if (++bk->bk_nout > bk->bk_kout)
+			blockif_cache_release(bk,
+				TAILQ_LAST(&bk->bk_a1out, blockif_cpq));
+	} else
+		blockif_cache_release(bk, TAILQ_LAST(&bk->bk_am, blockif_cpq));
+}
+
+static void
+blockif_cache_insert(struct blockif_cache *bk, off_t idx, const uint8_t *data)
+{
+	struct blockif_cpage *cp;
+
+	cp = blockif_cache_find(bk, idx);
+	if (cp != NULL && cp->cp_data != NULL)
+		return;			/* another reader got here first */
+	if (bk->bk_nbufs == 0) {
+		blockif_cache_evict(bk);
+		/* Eviction may have dropped the ghost of this very page */
+		cp = blockif_cache_find(bk, idx);
+	}
+
+	if (cp != NULL) {
+		blockif_cache_unlink(bk, cp);
+		cp->cp_q = BCQ_AM;
+		TAILQ_INSERT_HEAD(&bk->bk_am, cp, cp_link);
+	} else {
+		cp = TAILQ_FIRST(&bk->bk_free);
+		TAILQ_REMOVE(&bk->bk_free, cp, cp_link);
+		cp->cp_idx = idx;
+		cp->cp_hnext = bk->bk_hash[((size_t) idx) & bk->bk_hmask];
+		bk->bk_hash[((size_t) idx) & bk->bk_hmask] = cp;
+		cp->cp_q = BCQ_A1IN;
+		TAILQ_INSERT_HEAD(&bk->bk_a1in, cp, cp_link);
+		bk->bk_nin++;
+	}
+	cp->cp_data = bk->bk_bufs[--bk->bk_nbufs];
+	memcpy(cp->cp_data, data, BLOCKIF_CACHE_PGSZ);
+}
+
+/*
+ * Drop the cached pages of a byte range that is about to change. Bumping
+ * the generation also keeps any page read before the change from being
+ * inserted afterwards.
+ */
+static void
+blockif_cache_inval(struct blockif_cache *bk, off_t off, off_t len)
+{
+	struct blockif_cpage *cp;
+	off_t idx, first, last;
+	size_t i;
+
+	if (len <= 0)
+		return;
+	first = off >> BLOCKIF_CACHE_PGSHIFT;
+	last = (off + len - 1) >> BLOCKIF_CACHE_PGSHIFT;
+
+	pthread_mutex_lock(&bk->bk_mtx);
+	bk->bk_gen++;
+	if (((size_t) (last - first)) < bk->bk_nnodes) {
+		for (idx = first; idx <= last; idx++) {
+			cp = blockif_cache_find(bk, idx);
+			if (cp != NULL && cp->cp_data != NULL)
+				blockif_cache_release(bk, cp);
+		}
+	} else {
+		for (i = 0; i < bk->bk_nnodes; i++) {
+			cp = &bk->bk_pages[i];
+			if (cp->cp_data != NULL && cp->cp_idx >= first &&
+			    cp->cp_idx <= last)
+				blockif_cache_release(bk, cp);
+		}
+	}
+	pthread_mutex_unlock(&bk->bk_mtx);
+}
+
+/*
+ * Read through the block cache one page at a time. A miss reads the whole
+ * page from the file without the cache lock held.
+ */
+static ssize_t
+blockif_cache_read(struct blockif_ctxt *bc, const struct iovec *iov,
+	int iovcnt, off_t off)
+{
+	struct blockif_cache *bk;
+	struct blockif_cpage *cp;
+	struct iovec piov;
+	uint8_t *pbuf;
+	uint64_t gen;
+	size_t done, len, n, poff;
+	ssize_t ret;
+	off_t idx;
+
+	bk = bc->bc_cache;
+	if (off >= bc->bc_size)
+		return (0);
+	len = MIN(blockif_iov_len(iov, iovcnt), ((size_t) (bc->bc_size - off)));
+	pbuf = NULL;
+	for (done = 0; done < len; done += n) {
+		idx = (off + ((off_t) done)) >> BLOCKIF_CACHE_PGSHIFT;
+		poff = ((size_t) (off + ((off_t) done))) &
+			(BLOCKIF_CACHE_PGSZ - 1);
+		n = MIN(len - done, BLOCKIF_CACHE_PGSZ - poff);
+
+		pthread_mutex_lock(&bk->bk_mtx);
+		cp = blockif_cache_find(bk, idx);
+		if (cp != NULL && cp->cp_data != NULL) {
+			if (cp->cp_q == BCQ_AM) {
+				TAILQ_REMOVE(&bk->bk_am, cp, cp_link);
+				TAILQ_INSERT_HEAD(&bk->bk_am, cp, cp_link);
+			}
+			bk->bk_hits++;
+			blockif_iov_copyin(iov, iovcnt, done, cp->cp_data + poff, n);
+			pthread_mutex_unlock(&bk->bk_mtx);
+			continue;
+		}
+		bk->bk_misses++;
+		gen = bk->bk_gen;
+		pthread_mutex_unlock(&bk->bk_mtx);
+
+		if (pbuf == NULL && (pbuf = malloc(BLOCKIF_CACHE_PGSZ)) == NULL)
+			return (-1);
+		piov.iov_base = pbuf;
+		piov.iov_len = BLOCKIF_CACHE_PGSZ;
+		ret = blockif_file_readv(bc, &piov, 1,
+			idx << BLOCKIF_CACHE_PGSHIFT);
+		if (ret < 0) {
+			free(pbuf);
+			return (-1);
+		}
+		memset(pbuf + ret, 0, ((size_t) (BLOCKIF_CACHE_PGSZ - ret)));
+		blockif_iov_copyin(iov, iovcnt, done, pbuf + poff, n);
+
+		pthread_mutex_lock(&bk->bk_mtx);
+		if (bk->bk_gen == gen)
+			blockif_cache_insert(bk, idx, pbuf);
+		pthread_mutex_unlock(&bk->bk_mtx);
+	}
+	free(pbuf);
+	return ((ssize_t) len);
+}
+
+static ssize_t
+blockif_cached_readv(struct blockif_ctxt *bc, const struct iovec *iov,
+	int iovcnt, off_t off)
+{
+	if (bc->bc_cache != NULL)
+		return (blockif_cache_read(bc, iov, iovcnt, off));
+	return (blockif_file_readv(bc, iov, iovcnt, off));
+}
+
+/*
+ * Write to the backing store, keeping the sparse map and the block cache
+ * in step.
+ */
+static ssize_t
+blockif_store_writev(struct blockif_ctxt *bc, const struct iovec *iov,
+	int iovcnt, off_t off)
+{
+	ssize_t ret;
+	off_t len;
+
+	len = (off_t) blockif_iov_len(iov, iovcnt);
+	blockif_sp_begin(bc, off, len, 1);
+	ret = blockif_bwritev(bc, iov, iovcnt, off);
+	blockif_sp_end(bc, off, len, 1);
+	if (bc->bc_cache != NULL)
+		blockif_cache_inval(bc->bc_cache, off, len);
+	blockif_ra_inval(bc, off, len);
+	return (ret);
+}
+
+static struct blockif_wpage *
+blockif_wb_find(struct blockif_file *bf, off_t idx)
+{
+	struct blockif_wpage *wp;
+
+	for (wp = bf->bf_wb_hash[((size_t) idx) & bf->bf_wb_hmask]; wp != NULL;
+	     wp = wp->wp_hnext)
+		if (wp->wp_idx == idx)
+			break;
+	return (wp);
+}
+
+/*
+ * Take a page out of the write-back cache. Called with bf_wb_mtx held.
+ */
+static void
+blockif_wb_free(struct blockif_file *bf, struct blockif_wpage *wp)
+{
+	struct blockif_wpage **wpp;
+
+	for (wpp = &bf->bf_wb_hash[((size_t) wp->wp_idx) & bf->bf_wb_hmask];
+	     *wpp != wp; wpp = &(*wpp)->wp_hnext)
+		;
+	*wpp = wp->wp_hnext;
+	TAILQ_REMOVE(&bf->bf_wb_pages, wp, wp_link);
+	bf->bf_wb_npages--;
+	bf->bf_wb_seq++;
+	free(wp->wp_data);
+	free(wp);
+}
+
+static int
+blockif_wb_isdirty(const uint64_t *map, size_t s)
+{
+	return ((int) ((map[s / 64] >> (s % 64)) & 1));
+}
+
+/*
+ * Mark sectors [s, e) of a page dirty or clean.
+ */
+static void
+blockif_wb_mark(struct blockif_wpage *wp, size_t s, size_t e, int dirty)
+{
+	for (; s < e; s++) {
+		if (dirty)
+			wp->wp_dirty[s / 64] |= 1ULL << (s % 64);
+		else
+			wp->wp_dirty[s / 64] &= ~(1ULL << (s % 64));
+	}
+}
+
+/*
+ * Write the dirty sectors of a page back to the file. Called with
+ * bf_wb_mtx held, which is dropped around the write; the page is busy
+ * meanwhile, so nobody else writes it back or frees it. Afterwards the
+ * page leaves the cache, unless it was written to again in between.
+ */
+static int
+blockif_wb_page(struct blockif_ctxt *bc, struct blockif_wpage *wp,
+	uint8_t *buf)
+{
+	uint64_t dirty[BLOCKIF_WB_NSECT / 64];
+	struct blockif_wpage *twp;
+	struct blockif_file *bf;
+	struct iovec iov;
+	uint64_t gen, wseq;
+	size_t s, e;
+	ssize_t len;
+	int err;
+
+	bf = bc->bc_file;
+	wp->wp_busy = 1;
+	memcpy(buf, wp->wp_data, BLOCKIF_CACHE_PGSZ);
+	memcpy(dirty, wp->wp_dirty, sizeof(dirty));
+	gen = wp->wp_gen;
+	wseq = bf->bf_wb_wseq;
+	pthread_mutex_unlock(&bf->bf_wb_mtx);
+
+	err = 0;
+	for (s = 0; s < BLOCKIF_WB_NSECT && err == 0; s = e) {
+		for (e = s + 1; e < BLOCKIF_WB_NSECT &&
+		     blockif_wb_isdirty(dirty, e) == blockif_wb_isdirty(dirty, s);
+		     e++)
+			;
+		if (!blockif_wb_isdirty(dirty, s))
+			continue;
+		iov.iov_base = buf + s * BLOCKIF_WB_SECT;
+		iov.iov_len = (e - s) * BLOCKIF_WB_SECT;
+		len = blockif_store_writev(bc, &iov, 1,
+			(wp->wp_idx << BLOCKIF_CACHE_PGSHIFT) +
+			((off_t) (s * BLOCKIF_WB_SECT)));
+		if (len < 0)
+			err = errno;
+		else if (((size_t) len) != iov.iov_len)
+			err = EIO;
+	}
+
+	pthread_mutex_lock(&bf->bf_wb_mtx);
+	wp->wp_busy = 0;
+	pthread_cond_broadcast(&bf->bf_wb_cond);
+	if (err != 0)
+		return (err);
+	bf->bf_wb_nback++;
+	if (wp->wp_gen == gen) {
+		blockif_wb_free(bf, wp);
+		return (0);
+	}
+
+	/*
+	 * Whatever is still dirty was written after the copy was taken.
+	 * Keep the page list in wp_first order.
+	 */
+	wp->wp_first = wseq;
+	TAILQ_REMOVE(&bf->bf_wb_pages, wp, wp_link);
+	for (twp = TAILQ_LAST(&bf->bf_wb_pages, blockif_wpq);
+	     twp != NULL && twp->wp_first > wseq;
+	     twp = TAILQ_PREV(twp, blockif_wpq, wp_link))
+		;
+	if (twp == NULL)
+		TAILQ_INSERT_HEAD(&bf->bf_wb_pages, wp, wp_link);
+	else
+		TAILQ_INSERT_AFTER(&bf->bf_wb_pages, twp, wp, wp_link);
+	return (0);
+}
+
+/*
+ * Write back everything absorbed before write number wseq. Pages someone
+ * else is writing back are waited for if wait is set, and skipped
+ * otherwise. Called with bf_wb_mtx held.
+ */
+static int
+blockif_wb_sync(struct blockif_ctxt *bc, uint64_t wseq, int wait,
+	uint8_t *buf)
+{
+	struct blockif_file *bf;
+	struct blockif_wpage *wp;
+	int busy, err;
+
+	bf = bc->bc_file;
+	for (;;) {
+		busy = 0;
+		for (wp = TAILQ_FIRST(&bf->bf_wb_pages);
+		     wp != NULL && wp->wp_first < wseq;
+		     wp = TAILQ_NEXT(wp, wp_link)) {
+			if (!wp->wp_busy)
+				break;
+			busy = 1;
+		}
+		if (wp == NULL || wp->wp_first >= wseq) {
+			if (!busy || !wait)
+				return (0);
+			pthread_cond_wait(&bf->bf_wb_cond, &bf->bf_wb_mtx);
+			continue;
+		}
+		if ((err = blockif_wb_page(bc, wp, buf)) != 0)
+			return (err);
+	}
+}
+
+/*
+ * Write back a full cache's oldest pages until there is room in it.
+ * Called with bf_wb_mtx held.
+ */
+static int
+blockif_wb_trim(struct blockif_ctxt *bc, uint8_t *buf)
+{
+	struct blockif_file *bf;
+	struct blockif_wpage *wp;
+	int err;
+
+	bf = bc->bc_file;
+	while (bf->bf_wb_npages >= bf->bf_wb_max) {
+		TAILQ_FOREACH(wp, &bf->bf_wb_pages, wp_link)
+			if (!wp->wp_busy)
+				break;
+		if (wp == NULL)
+			break;
+		if ((err = blockif_wb_page(bc, wp, buf)) != 0)
+			return (err);
+	}
+	return (0);
+}
+
+/*
+ * Write back everything the cache holds. Returns 0 or an errno value.
+ */
+static int
+blockif_wb_flush(struct blockif_ctxt *bc)
+{
+	struct blockif_file *bf;
+	uint8_t *buf;
+	int err;
+
+	bf = bc->bc_file;
+	if (bf->bf_wb_hash == NULL)
+		return (0);
+	if ((buf = malloc(BLOCKIF_CACHE_PGSZ)) == NULL)
+		return (ENOMEM);
+	pthread_mutex_lock(&bf->bf_wb_mtx);
+	err = blockif_wb_sync(bc, bf->bf_wb_wseq, 1, buf);
+	pthread_mutex_unlock(&bf->bf_wb_mtx);
+	free(buf);
+	return (err);
+}
+
+/*
+ * When the timed writeback is due, or 0 if nothing is waiting for it.
+ */
+static time_t
+blockif_wb_due(struct blockif_ctxt *bc)
+{
+	struct blockif_file *bf;
+	time_t due;
+
+	bf = bc->bc_file;
+	if (bf->bf_wb_hash == NULL)
+		return (0);
+	pthread_mutex_lock(&bf->bf_wb_mtx);
+	due = bf->bf_wb_timer ? 0 : bf->bf_wb_deadline;
+	pthread_mutex_unlock(&bf->bf_wb_mtx);
+	return (due);
+}
+
+/*
+ * Timed writeback, run by the first i/o thread to find it due.
+ */
+static void
+blockif_wb_timer(struct blockif_ctxt *bc)
+{
+	struct blockif_file *bf;
+	uint8_t *buf;
+	int err;
+
+	bf = bc->bc_file;
+	if ((buf = malloc(BLOCKIF_CACHE_PGSZ)) == NULL)
+		return;
+	pthread_mutex_lock(&bf->bf_wb_mtx);
+	if (!bf->bf_wb_timer && bf->bf_wb_deadline != 0 &&
+	    bf->bf_wb_deadline <= time(NULL)) {
+		bf->bf_wb_timer = 1;
+		bf->bf_wb_deadline = 0;
+		err = blockif_wb_sync(bc, bf->bf_wb_wseq, 0, buf);
+		if (err != 0)
+			fprintf(stderr, "blockif %s: writeback failed: %s\r\n",
+			    bc->bc_ident, strerror(err));
+		bf->bf_wb_timer = 0;
+		if (bf->bf_wb_npages != 0 && bf->bf_wb_deadline == 0)
+			bf->bf_wb_deadline = time(NULL) + BLOCKIF_WB_DELAY;
+	}
+	pthread_mutex_unlock(&bf->bf_wb_mtx);
+	free(buf);
+}
+
+/*
+ * Absorb a write into the write-back cache, once there is room for it.
+ */
+static ssize_t
+blockif_wb_write(struct blockif_ctxt *bc, const struct iovec *iov,
+	int iovcnt, off_t off)
+{
+	struct blockif_file *bf;
+	struct blockif_wpage *wp;
+	size_t done, len, n, poff;
+	uint8_t *buf;
+	off_t idx;
+	int err;
+
+	bf = bc->bc_file;
+	len = blockif_iov_len(iov, iovcnt);
+	/* Dirty data is tracked by the sector */
+	if (((((size_t) off) | len) & (BLOCKIF_WB_SECT - 1)) != 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((buf = malloc(BLOCKIF_CACHE_PGSZ)) == NULL)
+		return (-1);
+
+	pthread_mutex_lock(&bf->bf_wb_mtx);
+	err = blockif_wb_trim(bc, buf);
+	for (done = 0; done < len && err == 0; done += n) {
+		idx = (off + ((off_t) done)) >> BLOCKIF_CACHE_PGSHIFT;
+		poff = ((size_t) (off + ((off_t) done))) &
+			(BLOCKIF_CACHE_PGSZ - 1);
+		n = MIN(len - done, BLOCKIF_CACHE_PGSZ - poff);
+
+		if ((wp = blockif_wb_find(bf, idx)) == NULL) {
+			wp = calloc(1, sizeof(struct blockif_wpage));
+			if (wp == NULL ||
+			    (wp->wp_data = malloc(BLOCKIF_CACHE_PGSZ)) == NULL) {
+				free(wp);
+				err = ENOMEM;
+				break;
+			}
+			wp->wp_idx = idx;
+			wp->wp_first = bf->bf_wb_wseq;
+			wp->wp_hnext =
+				bf->bf_wb_hash[((size_t) idx) & bf->bf_wb_hmask];
+			bf->bf_wb_hash[((size_t) idx) & bf->bf_wb_hmask] = wp;
+			TAILQ_INSERT_TAIL(&bf->bf_wb_pages, wp, wp_link);
+			bf->bf_wb_npages++;
+		}
+		blockif_iov_copyout(iov, iovcnt, done, wp->wp_data + poff, n);
+		blockif_wb_mark(wp, poff / BLOCKIF_WB_SECT,
+			(poff + n) / BLOCKIF_WB_SECT, 1);
+		wp->wp_gen++;
+	}
+	bf->bf_wb_wseq++;
+	if (bf->bf_wb_deadline == 0 && bf->bf_wb_npages != 0)
+		bf->bf_wb_deadline = time(NULL) + BLOCKIF_WB_DELAY;
+	pthread_mutex_unlock(&bf->bf_wb_mtx);
+	free(buf);
+
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+	return ((ssize_t) len);
+}
+
+/*
+ * Read from the file and lay the dirty sectors of the range over what was
+ * read. If dirty data left the cache in between, the file may have
+ * changed after it was read, so the read is retried.
+ */
+static ssize_t
+blockif_wb_read(struct blockif_ctxt *bc, const struct iovec *iov,
+	int iovcnt, off_t off)
+{
+	struct blockif_file *bf;
+	struct blockif_wpage *wp;
+	size_t done, n, poff, s, e, lo, hi;
+	uint64_t seq;
+	ssize_t ret;
+	off_t idx;
+
+	bf = bc->bc_file;
+	for (;;) {
+		pthread_mutex_lock(&bf->bf_wb_mtx);
+		seq = bf->bf_wb_seq;
+		pthread_mutex_unlock(&bf->bf_wb_mtx);
+		if ((ret = blockif_cached_readv(bc, iov, iovcnt, off)) < 0)
+			return (ret);
+		pthread_mutex_lock(&bf->bf_wb_mtx);
+		if (bf->bf_wb_seq == seq)
+			break;
+		pthread_mutex_unlock(&bf->bf_wb_mtx);
+	}
+
+	for (done = 0; done < (size_t) ret && bf->bf_wb_npages != 0;
+	     done += n) {
+		idx = (off + ((off_t) done)) >> BLOCKIF_CACHE_PGSHIFT;
+		poff = ((size_t) (off + ((off_t) done))) &
+			(BLOCKIF_CACHE_PGSZ - 1);
+		n = MIN(((size_t) ret) - done, BLOCKIF_CACHE_PGSZ - poff);
+		if ((wp = blockif_wb_find(bf, idx)) == NULL)
+			continue;
+		for (s = poff / BLOCKIF_WB_SECT; s * BLOCKIF_WB_SECT < poff + n;
+		     s = e) {
+			for (e = s + 1; e < BLOCKIF_WB_NSECT &&
+			     blockif_wb_isdirty(wp->wp_dirty, e) ==
+			     blockif_wb_isdirty(wp->wp_dirty, s); e++)
+				;
+			if (!blockif_wb_isdirty(wp->wp_dirty, s))
+				continue;
+			lo = MAX(s * BLOCKIF_WB_SECT, poff);
+			hi = MIN(e * BLOCKIF_WB_SECT, poff + n);
+			blockif_iov_copyin(iov, iovcnt, done + lo - poff,
+				wp->wp_data + lo, hi - lo);
+		}
+	}
+	pthread_mutex_unlock(&bf->bf_wb_mtx);
+	return (ret);
+}
+
+/*
+ * Clear the dirty sectors of a page that lie entirely within a byte range
+ * and drop the page once it is clean.
+ */
+static void
+blockif_wb_clear(struct blockif_file *bf, struct blockif_wpage *wp,
+	off_t off, off_t len)
+{
+	off_t base;
+	size_t i;
+
+	base = wp->wp_idx << BLOCKIF_CACHE_PGSHIFT;
+	blockif_wb_mark(wp,
+		(size_t) howmany(MAX(off, base) - base, BLOCKIF_WB_SECT),
+		(size_t) ((MIN(off + len, base + BLOCKIF_CACHE_PGSZ) - base) /
+		BLOCKIF_WB_SECT), 0);
+	wp->wp_gen++;
+	for (i = 0; i < nitems(wp->wp_dirty); i++)
+		if (wp->wp_dirty[i] != 0)
+			return;
+	blockif_wb_free(bf, wp);
+}
+
+/*
+ * Forget the dirty data of a range that is about to be written or
+ * discarded past the cache, once any writeback of it has finished.
+ */
+static void
+blockif_wb_drop(struct blockif_ctxt *bc, off_t off, off_t len)
+{
+	struct blockif_file *bf;
+	struct blockif_wpage *wp, *next;
+	off_t idx, first, last;
+
+	bf = bc->bc_file;
+	if (bf->bf_wb_hash == NULL || len <= 0)
+		return;
+	first = off >> BLOCKIF_CACHE_PGSHIFT;
+	last = (off + len - 1) >> BLOCKIF_CACHE_PGSHIFT;
+
+	pthread_mutex_lock(&bf->bf_wb_mtx);
+	if (((size_t) (last - first)) < bf->bf_wb_npages) {
+		for (idx = first; idx <= last; idx++) {
+			while ((wp = blockif_wb_find(bf, idx)) != NULL &&
+			    wp->wp_busy)
+				pthread_cond_wait(&bf->bf_wb_cond,
+				    &bf->bf_wb_mtx);
+			if (wp != NULL)
+				blockif_wb_clear(bf, wp, off, len);
+		}
+	} else {
+		do {
+			for (wp = TAILQ_FIRST(&bf->bf_wb_pages); wp != NULL;
+			     wp = next) {
+				next = TAILQ_NEXT(wp, wp_link);
+				if (wp->wp_idx < first || wp->wp_idx > last)
+					continue;
+				if (wp->wp_busy)
+					break;
+				blockif_wb_clear(bf, wp, off, len);
+			}
+			if (wp != NULL)
+				pthread_cond_wait(&bf->bf_wb_cond,
+				    &bf->bf_wb_mtx);
+		} while (wp != NULL);
+	}
+	bf->bf_wb_seq++;
+	pthread_mutex_unlock(&bf->bf_wb_mtx);
+}
+
+/*
+ * Write out a recorded boot trace, one "offset length" line per range.
+ * Called with bf_tr_mtx held.
+ */
+static void
+blockif_tr_save(struct blockif_file *bf)
+{
+	char tmp[MAXPATHLEN];
+	FILE *f;
+	size_t i;
+
+	bf->bf_tr_rec = 0;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", bf->bf_tr_path);
+	if ((f = fopen(tmp, "w")) == NULL) {
+		perror("Could not save boot trace");
+		return;
+	}
+	for (i = 0; i < bf->bf_tr_n; i++)
+		fprintf(f, "%lld %lld\n", (long long) bf->bf_tr[i].tr_off,
+		    (long long) bf->bf_tr[i].tr_len);
+	if (fclose(f) != 0 || rename(tmp, bf->bf_tr_path) < 0) {
+		perror("Could not save boot trace");
+		unlink(tmp);
+	}
+}
+
+/*
+ * Note a guest read in the boot trace being recorded. Reads that start
+ * within or right after the previous range extend it, so a boot's worth
+ * of reads comes down to a few thousand ranges in the order they were
+ * first needed. The trace is saved once the recording period is over.
+ */
+static void
+blockif_tr_record(struct blockif_ctxt *bc, off_t off, off_t len)
+{
+	struct blockif_file *bf;
+	struct blockif_trange *tr;
+	size_t max;
+
+	bf = bc->bc_file;
+	pthread_mutex_lock(&bf->bf_tr_mtx);
+	if (!bf->bf_tr_rec) {
+		pthread_mutex_unlock(&bf->bf_tr_mtx);
+		return;
+	}
+	if (time(NULL) >= bf->bf_tr_end) {
+		blockif_tr_save(bf);
+		pthread_mutex_unlock(&bf->bf_tr_mtx);
+		return;
+	}
+	tr = bf->bf_tr_n > 0 ? &bf->bf_tr[bf->bf_tr_n - 1] : NULL;
+	if (tr != NULL && off >= tr->tr_off && off <= tr->tr_off + tr->tr_len)
+		tr->tr_len = MAX(tr->tr_len, off + len - tr->tr_off);
+	else {
+		if (bf->bf_tr_n == bf->bf_tr_max) {
+			max = MAX(bf->bf_tr_max * 2, 256);
+			tr = realloc(bf->bf_tr, max * sizeof(struct blockif_trange));
+			if (tr == NULL) {
+				pthread_mutex_unlock(&bf->bf_tr_mtx);
+				return;
+			}
+			bf->bf_tr = tr;
+			bf->bf_tr_max = max;
+		}
+		bf->bf_tr[bf->bf_tr_n].tr_off = off;
+		bf->bf_tr[bf->bf_tr_n].tr_len = len;
+		bf->bf_tr_n++;
+	}
+	pthread_mutex_unlock(&bf->bf_tr_mtx);
+}
+
+static ssize_t
+blockif_readv(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+	off_t off)
+{
+	if (bc->bc_file->bf_tr_rec)
+		blockif_tr_record(bc, off, (off_t) blockif_iov_len(iov, iovcnt));
+	if (bc->bc_file->bf_wb_hash != NULL)
+		return (blockif_wb_read(bc, iov, iovcnt, off));
+	return (blockif_cached_readv(bc, iov, iovcnt, off));
+}
+
+static ssize_t
+blockif_writev(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+	off_t off)
+{
+	struct blockif_file *bf;
+
+	bf = bc->bc_file;
+	if (bf->bf_wb_hash != NULL) {
+		if (bf->bf_wce)
+			return (blockif_wb_write(bc, iov, iovcnt, off));
+		blockif_wb_drop(bc, off, (off_t) blockif_iov_len(iov, iovcnt));
+	}
+	return (blockif_store_writev(bc, iov, iovcnt, off));
+}
+
+static const uint8_t blockif_zeros[64 * 1024];
+
+static int
+blockif_zero_range(struct blockif_ctxt *bc, off_t off, off_t len)
+{
+	struct iovec iov;
+	ssize_t n;
+
+	iov.iov_base = (void *) ((uintptr_t) blockif_zeros);
+	while (len > 0) {
+		iov.iov_len = (size_t) MIN(len, ((off_t) sizeof(blockif_zeros)));
+		n = blockif_bwritev(bc, &iov, 1, off);
+		if (n < 0)
+			return (errno);
+		off += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * Deallocate a byte range of a regular file. Only whole filesystem blocks
+ * can be punched out, so a partial block at either end is zeroed instead.
+ */
+static int
+blockif_punch(struct blockif_ctxt *bc, off_t off, off_t len)
+{
+#ifdef F_PUNCHHOLE
+	fpunchhole_t arg;
+	off_t end, aoff, aend;
+	int err;
+
+	end = MIN(off + len, bc->bc_size);
+	if (off >= end)
+		return (0);
+	aoff = roundup2(off, ((off_t) bc->bc_blksz));
+	aend = end & ~((off_t) bc->bc_blksz - 1);
+	if (aoff >= aend)
+		return (blockif_zero_range(bc, off, end - off));
+
+	memset(&arg, 0, sizeof(arg));
+	arg.fp_offset = aoff;
+	arg.fp_length = aend - aoff;
+	if (fcntl(bc->bc_fd, F_PUNCHHOLE, &arg) < 0)
+		return (errno);
+	if ((err = blockif_zero_range(bc, off, aoff - off)) != 0)
+		return (err);
+	return (blockif_zero_range(bc, aend, end - aend));
+#else
+	(void) bc;
+	(void) off;
+	(void) len;
+	return (EOPNOTSUPP);
+#endif
+}
+
+/*
+ * Whether holes can be punched in fd, which depends on its filesystem.
+ * Tried once at open on the block past the end of the file, which holds
+ * no data either way.
+ */
+static int
+blockif_punch_probe(int fd, off_t size, off_t blksz)
+{
+#ifdef F_PUNCHHOLE
+	fpunchhole_t arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.fp_offset = roundup(size, blksz);
+	arg.fp_length = blksz;
+	if (fcntl(fd, F_PUNCHHOLE, &arg) == 0)
+		return (1);
+	return (errno != ENOTSUP && errno != EOPNOTSUPP && errno != ENOTTY);
+#else
+	(void) fd;
+	(void) size;
+	(void) blksz;
+	return (0);
+#endif
+}
+
+/*
+ * BOP_DELETE discards a range and BOP_ZERO makes it read back as zeroes.
+ * Both are a hole punch where the filesystem supports it, which leaves
+ * the range reading as zeroes; otherwise a discard is refused and zeroing
+ * falls back to writing out zeroes, as it does if the punch fails.
+ */
+static int
+blockif_delete_range(struct blockif_ctxt *bc, enum blockop op,
+	struct blockif_req *br)
+{
+	int err;
+
+	if (bc->bc_rdonly)
+		return (EROFS);
+	blockif_wb_drop(bc, br->br_offset, br->br_resid);
+	blockif_sp_begin(bc, br->br_offset, br->br_resid, 0);
+	if (bc->bc_candelete && bc->bc_be != NULL)
+		err = bc->bc_be->bb_delete(bc->bc_bearg, br->br_offset,
+			br->br_resid);
+	else if (bc->bc_candelete)
+		err = blockif_punch(bc, br->br_offset, br->br_resid);
+	else if (op == BOP_ZERO)
+		err = blockif_zero_range(bc, br->br_offset, br->br_resid);
+	else
+		err = EOPNOTSUPP;
+	if (err != 0 && bc->bc_candelete && op == BOP_ZERO)
+		err = blockif_zero_range(bc, br->br_offset, br->br_resid);
+	blockif_sp_end(bc, br->br_offset, br->br_resid, 0);
+	if (bc->bc_cache != NULL)
+		blockif_cache_inval(bc->bc_cache, br->br_offset, br->br_resid);
+	blockif_ra_inval(bc, br->br_offset, br->br_resid);
+	if (err == 0)
+		br->br_resid = 0;
+	return (err);
+}
+
+static int
+blockif_sync(struct blockif_ctxt *bc)
+{
+	int err;
+
+	if ((err = blockif_wb_flush(bc)) != 0)
+		return (err);
+	if (bc->bc_be != NULL)
+		return (bc->bc_be->bb_flush(bc->bc_bearg));
+	if (bc->bc_ischr)
+		return (ioctl(bc->bc_fd, DKIOCSYNCHRONIZECACHE) ? errno : 0);
+	return (fsync(bc->bc_fd) ? errno : 0);
+}
+
+static uint64_t
+blockif_qos_now(void)
+{
+	return ((mach_absolute_time() * blockif_timebase.numer) /
+	    blockif_timebase.denom);
+}
+
+/*
+ * Take n tokens from a bucket, returning how many ns the caller has to
+ * wait for them. Tokens are taken even when the caller has to wait, so
+ * that requests queue up behind each other in order.
+ */
+static uint64_t
+blockif_qos_take(struct blockif_bucket *tb, uint64_t n, uint64_t now)
+{
+	if (tb->tb_rate == 0 || n == 0)
+		return (0);
+	tb->tb_full = MAX(tb->tb_full, now) + (n * BLOCKIF_NSEC) / tb->tb_rate;
+	if (tb->tb_full <= now + tb->tb_tau)
+		return (0);
+	return (tb->tb_full - now - tb->tb_tau);
+}
+
+/*
+ * Hold a request, with any merged into it, until the disk's iops= and
+ * bps= limits allow it to be issued. Flushes are never held.
+ */
+static void
+blockif_qos_wait(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_file *bf;
+	struct blockif_elem *tbe;
+	struct timespec ts;
+	uint64_t nops, nbytes, now, wait, bwait;
+
+	bf = bc->bc_file;
+	if (bf->bf_qos_iops.tb_rate == 0 && bf->bf_qos_bps.tb_rate == 0)
+		return;
+	nops = nbytes = 0;
+	for (tbe = be; tbe != NULL; tbe = tbe->be_merged) {
+		nops++;
+		if (tbe->be_op == BOP_READ || tbe->be_op == BOP_WRITE)
+			nbytes += (uint64_t) tbe->be_req->br_resid;
+	}
+	now = blockif_qos_now();
+	pthread_mutex_lock(&bf->bf_qos_mtx);
+	wait = blockif_qos_take(&bf->bf_qos_iops, nops, now);
+	bwait = blockif_qos_take(&bf->bf_qos_bps, nbytes, now);
+	wait = MAX(wait, bwait);
+	if (wait != 0) {
+		bf->bf_qos_nthrottled += nops;
+		bf->bf_qos_ns += wait;
+	}
+	pthread_mutex_unlock(&bf->bf_qos_mtx);
+	if (wait == 0)
+		return;
+	ts.tv_sec = (time_t) (wait / BLOCKIF_NSEC);
+	ts.tv_nsec = (long) (wait % BLOCKIF_NSEC);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Set the limits of a file. The first context to ask sets each of them;
+ * a burst of 0 allows one second's worth.
+ */
+static void
+blockif_qos_init(struct blockif_bucket *tb, uint64_t rate, uint64_t burst)
+{
+	if (tb->tb_rate != 0 || rate == 0)
+		return;
+	if (burst == 0)
+		burst = rate;
+	tb->tb_tau = (burst * BLOCKIF_NSEC) / rate;
+	tb->tb_rate = rate;
+}
+
+static void
+blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_req *br;
+	ssize_t len;
+	int err;
+
+	br = be->be_req;
+	err = 0;
+	switch (be->be_op) {
+	case BOP_READ:
+		if ((len = blockif_readv(bc, br->br_iov, br->br_iovcnt,
+		    br->br_offset)) < 0)
+			err = errno;
+		else
+			br->br_resid -= len;
+		break;
+	case BOP_WRITE:
+		if (bc->bc_rdonly)
+			err = EROFS;
+		else if ((len = blockif_writev(bc, br->br_iov, br->br_iovcnt,
+		    br->br_offset)) < 0)
+			err = errno;
+		else
+			br->br_resid -= len;
+		break;
+	case BOP_FLUSH:
+		err = blockif_sync(bc);
+		break;
+	case BOP_DELETE:
+	case BOP_ZERO:
+		err = blockif_delete_range(bc, be->be_op, br);
+		break;
+	}
+
+	be->be_status = BST_DONE;
+
+	(*br->br_callback)(br, err);
+}
+
+static void
+blockif_proc_merged(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct iovec iov[BLOCKIF_MERGE_IOV];
+	struct blockif_elem *tbe;
+	struct blockif_req *br;
+	ssize_t len, clen;
+	int iovcnt, err;
+
+	iovcnt = 0;
+	for (tbe = be; tbe != NULL; tbe = tbe->be_merged) {
+		br = tbe->be_req;
+		memcpy(&iov[iovcnt], br->br_iov,
+			sizeof(struct iovec) * ((size_t) br->br_iovcnt));
+		iovcnt += br->br_iovcnt;
+	}
+
+	err = 0;
+	br = be->be_req;
+	if (be->be_op == BOP_WRITE && bc->bc_rdonly) {
+		err = EROFS;
+		len = 0;
+	} else if (be->be_op == BOP_READ)
+		len = blockif_readv(bc, iov, iovcnt, br->br_offset);
+	else
+		len = blockif_writev(bc, iov, iovcnt, br->br_offset);
+	if (len < 0) {
+		err = errno;
+		len = 0;
+	}
+
+	/* Hand the transferred length back out in request order */
+	for (tbe = be; tbe != NULL; tbe = tbe->be_merged) {
+		br = tbe->be_req;
+		clen = MIN(len, br->br_resid);
+		br->br_resid -= clen;
+		len -= clen;
+		tbe->be_status = BST_DONE;
+		(*br->br_callback)(br, err);
+	}
+}
+
+/*
+ * Group commit. A flush that arrives while an fsync is running cannot
+ * rely on it, since the writes it covers may have finished after that
+ * fsync started, so it is parked instead. When the running fsync is done,
+ * a single fsync serves every flush parked in the meantime. Called and
+ * returns with bc_mtx held.
+ */
+static void
+blockif_flush_group(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_elem *tbe, *last;
+	pthread_t t;
+	int err;
+
+	bc->bc_nflush++;
+	if (bc->bc_flushing) {
+		TAILQ_REMOVE(&bc->bc_busyq, be, be_link);
+		be->be_status = BST_PARK;
+		be->be_tid = 0;
+		TAILQ_INSERT_TAIL(&bc->bc_flushq, be, be_link);
+		return;
+	}
+
+	bc->bc_flushing = 1;
+	t = be->be_tid;
+	while (be != NULL) {
+		bc->bc_nfsync++;
+		pthread_mutex_unlock(&bc->bc_mtx);
+		err = blockif_sync(bc);
+		for (tbe = be; tbe != NULL; tbe = tbe->be_merged) {
+			tbe->be_status = BST_DONE;
+			(*tbe->be_req->br_callback)(tbe->be_req, err);
+		}
+		pthread_mutex_lock(&bc->bc_mtx);
+		while (be != NULL) {
+			tbe = be->be_merged;
+			blockif_complete(bc, be);
+			be = tbe;
+		}
+
+		/* Take every flush that was parked meanwhile */
+		last = NULL;
+		while ((tbe = TAILQ_FIRST(&bc->bc_flushq)) != NULL) {
+			TAILQ_REMOVE(&bc->bc_flushq, tbe, be_link);
+			tbe->be_status = BST_BUSY;
+			tbe->be_tid = t;
+			TAILQ_INSERT_TAIL(&bc->bc_busyq, tbe, be_link);
+			if (last == NULL)
+				be = tbe;
+			else
+				last->be_merged = tbe;
+			last = tbe;
+		}
+	}
+	bc->bc_flushing = 0;
+}
+
+static void *
+blockif_thr(void *arg)
+{
+	struct blockif_ctxt *bc;
+	struct blockif_elem *be, *tbe;
+	struct timespec ts;
+	pthread_t t;
+
+	bc = arg;
+	t = pthread_self();
+
+	pthread_mutex_lock(&bc->bc_mtx);
+	for (;;) {
+		while (blockif_dequeue(bc, t, &be)) {
+			if (be->be_op == BOP_FLUSH) {
+				blockif_flush_group(bc, be);
+				continue;
+			}
+			blockif_merge(bc, be);
+			pthread_mutex_unlock(&bc->bc_mtx);
+			blockif_qos_wait(bc, be);
+			if (be->be_merged != NULL)
+				blockif_proc_merged(bc, be);
+			else
+				blockif_proc(bc, be);
+			pthread_mutex_lock(&bc->bc_mtx);
+			while (be != NULL) {
+				tbe = be->be_merged;
+				blockif_complete(bc, be);
+				be = tbe;
+			}
+			if (bc->bc_file->bf_ra_want != 0) {
+				pthread_mutex_unlock(&bc->bc_mtx);
+				blockif_ra_fill(bc);
+				pthread_mutex_lock(&bc->bc_mtx);
+			}
+		}
+		/* Check ctxt status here to see if exit requested */
+		if (bc->bc_closing)
+			break;
+		/* Idle threads also run the timed writeback */
+		if ((ts.tv_sec = blockif_wb_due(bc)) == 0) {
+			pthread_cond_wait(&bc->bc_cond, &bc->bc_mtx);
+			continue;
+		}
+		ts.tv_nsec = 0;
+		if (pthread_cond_timedwait(&bc->bc_cond, &bc->bc_mtx, &ts) ==
+		    ETIMEDOUT) {
+			pthread_mutex_unlock(&bc->bc_mtx);
+			blockif_wb_timer(bc);
+			pthread_mutex_lock(&bc->bc_mtx);
+		}
+	}
+	pthread_mutex_unlock(&bc->bc_mtx);
+
+	pthread_exit(NULL);
+	return (NULL);
+}
+
+static void
+blockif_aio_submit(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_aio *ba;
+	struct aiocb *cb;
+	int error;
+
+	ba = &bc->bc_aio[be - bc->bc_reqs];
+	while (ba->ba_nsub < ba->ba_ncb) {
+		cb = &ba->ba_cb[ba->ba_nsub].bac_cb;
+		if (be->be_op == BOP_FLUSH)
+			error = aio_fsync(O_SYNC, cb);
+		else if (be->be_op == BOP_READ)
+			error = aio_read(cb);
+		else
+			error = aio_write(cb);
+		if (error) {
+			if (errno == EAGAIN) {
+				/*
+				 * There may be nothing in flight whose SIGIO
+				 * would get us here again; have the aio
+				 * thread retry.
+				 */
+				if (!bc->bc_aio_stalled) {
+					bc->bc_aio_stalled = 1;
+					pthread_cond_broadcast(&bc->bc_cond);
+				}
+				return;
+			}
+			/* Stop here and let the submitted ones drain */
+			ba->ba_err = errno;
+			ba->ba_ncb = ba->ba_nsub;
+			break;
+		}
+		ba->ba_nsub++;
+	}
+	if (ba->ba_ncb == 0 && !ba->ba_sync) {
+		/*
+		 * Nothing went to the kernel. Have the mevent thread pick up
+		 * the completion so the callback never runs in the context
+		 * of the submitter.
+		 */
+		kill(getpid(), SIGIO);
+	}
+}
+
+static void
+blockif_aio_prepare(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_aio *ba;
+	struct blockif_req *br;
+	struct aiocb *cb;
+	off_t off;
+	int i, ncb;
+
+	ba = &bc->bc_aio[be - bc->bc_reqs];
+	br = be->be_req;
+	memset(ba, 0, sizeof(*ba));
+
+	switch (be->be_op) {
+	case BOP_READ:
+	case BOP_WRITE:
+	case BOP_FLUSH:
+		if (be->be_op == BOP_WRITE && bc->bc_rdonly) {
+			ba->ba_err = EROFS;
+			break;
+		}
+		ncb = be->be_op == BOP_FLUSH ? 1 : br->br_iovcnt;
+		ba->ba_cb = calloc(((size_t) ncb), sizeof(struct blockif_aiocb));
+		if (ba->ba_cb == NULL) {
+			ba->ba_err = ENOMEM;
+			break;
+		}
+		if (be->be_op == BOP_FLUSH) {
+			cb = &ba->ba_cb[0].bac_cb;
+			cb->aio_fildes = bc->bc_fd;
+			cb->aio_sigevent.sigev_notify = SIGEV_SIGNAL;
+			cb->aio_sigevent.sigev_signo = SIGIO;
+			ba->ba_ncb = 1;
+			break;
+		}
+		off = br->br_offset;
+		for (i = 0; i < ncb; i++) {
+			cb = &ba->ba_cb[i].bac_cb;
+			cb->aio_fildes = bc->bc_fd;
+			cb->aio_offset = off;
+			cb->aio_buf = br->br_iov[i].iov_base;
+			cb->aio_nbytes = br->br_iov[i].iov_len;
+			cb->aio_sigevent.sigev_notify = SIGEV_SIGNAL;
+			cb->aio_sigevent.sigev_signo = SIGIO;
+			off += (off_t) br->br_iov[i].iov_len;
+		}
+		ba->ba_ncb = ncb;
+		break;
+	case BOP_DELETE:
+	case BOP_ZERO:
+		/* May write out zeroes; leave it to the aio thread */
+		ba->ba_sync = 1;
+		pthread_cond_broadcast(&bc->bc_cond);
+		break;
+	}
+}
+
+/*
+ * Submit every request that has become runnable. Called with bc_mtx held.
+ */
+static void
+blockif_aio_start(struct blockif_ctxt *bc)
+{
+	struct blockif_elem *be;
+
+	TAILQ_FOREACH(be, &bc->bc_busyq, be_link) {
+		if (be->be_status == BST_BUSY &&
+		    bc->bc_aio[be - bc->bc_reqs].ba_nsub <
+		    bc->bc_aio[be - bc->bc_reqs].ba_ncb)
+			blockif_aio_submit(bc, be);
+	}
+	while (blockif_dequeue(bc, 0, &be)) {
+		blockif_aio_prepare(bc, be);
+		blockif_aio_submit(bc, be);
+	}
+}
+
+static int
+blockif_aio_done(struct blockif_aio *ba)
+{
+	struct blockif_aiocb *bac;
+	int error, i;
+	ssize_t len;
+
+	if (ba->ba_sync)
+		return (ba->ba_syncdone);
+	for (i = 0; i < ba->ba_nsub; i++) {
+		bac = &ba->ba_cb[i];
+		if (bac->bac_reaped)
+			continue;
+		error = aio_error(&bac->bac_cb);
+		if (error == EINPROGRESS)
+			continue;
+		len = aio_return(&bac->bac_cb);
+		bac->bac_reaped = 1;
+		ba->ba_nreap++;
+		if (error != 0 && ba->ba_err == 0)
+			ba->ba_err = error;
+		else if (len > 0)
+			ba->ba_len += len;
+	}
+	return (ba->ba_nreap == ba->ba_ncb);
+}
+
+static void
+blockif_aio_reap(struct blockif_ctxt *bc)
+{
+	struct blockif_elem *be, *done, **tail;
+	struct blockif_aio *ba;
+	struct blockif_req *br;
+
+	done = NULL;
+	tail = &done;
+	pthread_mutex_lock(&bc->bc_mtx);
+	TAILQ_FOREACH(be, &bc->bc_busyq, be_link) {
+		ba = &bc->bc_aio[be - bc->bc_reqs];
+		if (be->be_status == BST_BUSY && blockif_aio_done(ba)) {
+			be->be_status = BST_DONE;
+			be->be_reaped = NULL;
+			*tail = be;
+			tail = &be->be_reaped;
+		}
+	}
+	pthread_mutex_unlock(&bc->bc_mtx);
+
+	for (be = done; be != NULL; be = be->be_reaped) {
+		ba = &bc->bc_aio[be - bc->bc_reqs];
+		br = be->be_req;
+		if (be->be_op == BOP_READ || be->be_op == BOP_WRITE)
+			br->br_resid -= ba->ba_len;
+		(*br->br_callback)(br, ba->ba_err);
+	}
+
+	pthread_mutex_lock(&bc->bc_mtx);
+	while ((be = done) != NULL) {
+		done = be->be_reaped;
+		ba = &bc->bc_aio[be - bc->bc_reqs];
+		free(ba->ba_cb);
+		ba->ba_cb = NULL;
+		blockif_complete(bc, be);
+	}
+	blockif_aio_start(bc);
+	if (bc->bc_closing)
+		pthread_cond_broadcast(&bc->bc_cond);
+	pthread_mutex_unlock(&bc->bc_mtx);
+}
+
+/*
+ * Helper thread of an aio context. It runs discards and zeroing, which
+ * may take long enough that they should stay off the vCPU and mevent
+ * threads, and retries submissions the kernel refused with EAGAIN.
+ * Completions are still reported through SIGIO.
+ */
+static void *
+blockif_aio_thr(void *arg)
+{
+	struct blockif_ctxt *bc;
+	struct blockif_elem *be;
+	struct blockif_aio *ba;
+	struct timespec ts;
+	struct timeval tv;
+	int err;
+
+	bc = arg;
+
+	pthread_mutex_lock(&bc->bc_mtx);
+	for (;;) {
+		TAILQ_FOREACH(be, &bc->bc_busyq, be_link) {
+			ba = &bc->bc_aio[be - bc->bc_reqs];
+			if (be->be_status == BST_BUSY && ba->ba_sync &&
+			    !ba->ba_syncdone)
+				break;
+		}
+		if (be != NULL) {
+			pthread_mutex_unlock(&bc->bc_mtx);
+			err = blockif_delete_range(bc, be->be_op, be->be_req);
+			pthread_mutex_lock(&bc->bc_mtx);
+			ba = &bc->bc_aio[be - bc->bc_reqs];
+			ba->ba_err = err;
+			ba->ba_syncdone = 1;
+			kill(getpid(), SIGIO);
+			continue;
+		}
+		/* Leave once blockif_close has seen everything drain */
+		if (bc->bc_closing && TAILQ_EMPTY(&bc->bc_busyq))
+			break;
+		if (!bc->bc_aio_stalled) {
+			pthread_cond_wait(&bc->bc_cond, &bc->bc_mtx);
+			continue;
+		}
+		gettimeofday(&tv, NULL);
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = ((long) tv.tv_usec) * 1000 +
+		    BLOCKIF_AIO_RETRY * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		/* An early wakeup only means an early retry */
+		pthread_cond_timedwait(&bc->bc_cond, &bc->bc_mtx, &ts);
+		bc->bc_aio_stalled = 0;
+		blockif_aio_start(bc);
+	}
+	pthread_mutex_unlock(&bc->bc_mtx);
+
+	pthread_exit(NULL);
+	return (NULL);
+}
+
+static void
+blockif_sigio_handler(UNUSED int signal, UNUSED enum ev_type type,
+	UNUSED void *arg)
+{
+	struct blockif_ctxt *bc;
+
+	pthread_mutex_lock(&blockif_aio_mtx);
+	for (bc = blockif_aio_head; bc != NULL; bc = bc->bc_aio_next)
+		blockif_aio_reap(bc);
+	pthread_mutex_unlock(&blockif_aio_mtx);
+}
+
+static void
+blockif_sigcont_handler(UNUSED int signal, UNUSED enum ev_type type,
+	UNUSED void *arg)
+{
+	struct blockif_sig_elem *bse;
+
+	for (;;) {
+		/*
+		 * Process the entire list even if not intended for
+		 * this thread.
+		 */
+		do {
+			bse = blockif_bse_head;
+			if (bse == NULL)
+				return;
+		} while (!atomic_cmpset_ptr((uintptr_t *)&blockif_bse_head,
+					    (uintptr_t)bse,
+					    (uintptr_t)bse->bse_next));
+
+		pthread_mutex_lock(&bse->bse_mtx);
+		bse->bse_pending = 0;
+		pthread_cond_signal(&bse->bse_cond);
+		pthread_mutex_unlock(&bse->bse_mtx);
+	}
+}
+
+/*
+ * Report per-disk statistics, e.g. after kill -INFO.
+ */
+static void
+blockif_siginfo_handler(UNUSED int signal, UNUSED enum ev_type type,
+	UNUSED void *arg)
+{
+	struct blockif_ctxt *bc;
+	struct blockif_cache *bk;
+	struct blockif_file *bf;
+	uint64_t nflush, nfsync;
+	size_t trdone;
+
+	pthread_mutex_lock(&blockif_list_mtx);
+	for (bc = blockif_list_head; bc != NULL; bc = bc->bc_next) {
+		pthread_mutex_lock(&bc->bc_mtx);
+		nflush = bc->bc_nflush;
+		nfsync = bc->bc_nfsync;
+		trdone = bc->bc_tr_done;
+		pthread_mutex_unlock(&bc->bc_mtx);
+		if (nflush != 0)
+			fprintf(stderr, "blockif %s: %llu flushes in %llu "
+			    "fsyncs\r\n", bc->bc_ident, nflush, nfsync);
+		bf = bc->bc_file;
+		if (bf->bf_wb_hash != NULL) {
+			pthread_mutex_lock(&bf->bf_wb_mtx);
+			fprintf(stderr, "blockif %s: write-back %s, %zu/%zu "
+			    "pages dirty, %llu written back\r\n", bc->bc_ident,
+			    bf->bf_wce ? "on" : "off", bf->bf_wb_npages,
+			    bf->bf_wb_max, bf->bf_wb_nback);
+			pthread_mutex_unlock(&bf->bf_wb_mtx);
+		}
+		if (bf->bf_ra_max != 0) {
+			pthread_mutex_lock(&bf->bf_ra_mtx);
+			fprintf(stderr, "blockif %s: readahead %llu fills, "
+			    "%llu hits\r\n", bc->bc_ident, bf->bf_ra_fills,
+			    bf->bf_ra_hits);
+			pthread_mutex_unlock(&bf->bf_ra_mtx);
+		}
+		if (bc->bc_tr != NULL)
+			fprintf(stderr, "blockif %s: boot trace %zu/%zu ranges "
+			    "prefetched\r\n", bc->bc_ident, trdone,
+			    bc->bc_tr_n);
+		if (bf->bf_qos_nthrottled != 0) {
+			pthread_mutex_lock(&bf->bf_qos_mtx);
+			fprintf(stderr, "blockif %s: %llu requests throttled for "
+			    "%llu ms\r\n", bc->bc_ident, bf->bf_qos_nthrottled,
+			    bf->bf_qos_ns / 1000000);
+			pthread_mutex_unlock(&bf->bf_qos_mtx);
+		}
+		if ((bk = bc->bc_cache) == NULL)
+			continue;
+		pthread_mutex_lock(&bk->bk_mtx);
+		fprintf(stderr, "blockif %s: cache %zu/%zu pages%s, "
+		    "%llu hits, %llu misses\r\n", bc->bc_ident,
+		    bk->bk_npages - bk->bk_nbufs, bk->bk_npages,
+		    bk->bk_refs > 1 ? " (shared)" : "", bk->bk_hits,
+		    bk->bk_misses);
+		pthread_mutex_unlock(&bk->bk_mtx);
+	}
+	pthread_mutex_unlock(&blockif_list_mtx);
+}
+
+/* Image formats chosen with format=, and images that are not files */
+static const struct blockif_backend *blockif_formats[] = {
+	&blockif_overlay_backend,
+	&blockif_bgzf_backend,
+	&blockif_stripe_backend,
+	&blockif_nbd_backend,
+	&blockif_ram_backend
+};
+
+/*
+ * The backend for an image that is not a file, such as a disk on a
+ * network server, or NULL if path names a file.
+ */
+static const struct blockif_backend *
+blockif_match(const char *path)
+{
+	size_t i;
+
+	for (i = 0; i < nitems(blockif_formats); i++)
+		if (blockif_formats[i]->bb_match != NULL &&
+		    blockif_formats[i]->bb_match(path))
+			return (blockif_formats[i]);
+	return (NULL);
+}
+
+/*
+ * The backend for a file format, or NULL if there is none of that name.
+ * Files are raw unless the user says otherwise: a guest can write the
+ * header of any format into its raw disk, so formats are never guessed
+ * from the contents.
+ */
+static const struct blockif_backend *
+blockif_format(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < nitems(blockif_formats); i++)
+		if (blockif_formats[i]->bb_probe != NULL &&
+		    strcmp(blockif_formats[i]->bb_name, name) == 0)
+			return (blockif_formats[i]);
+	return (NULL);
+}
+
+/*
+ * Images that are not files have no device and inode to tell them apart
+ * in the file and cache lists. Give each name an inode number of its own
+ * on a device that does not exist.
+ */
+static int
+blockif_name_stat(const char *path, struct stat *sbuf)
+{
+	static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+	static char **names;
+	static size_t nnames;
+	char **nnew;
+	size_t i;
+
+	pthread_mutex_lock(&mtx);
+	for (i = 0; i < nnames && strcmp(names[i], path) != 0; i++)
+		;
+	if (i == nnames) {
+		nnew = realloc(names, (nnames + 1) * sizeof(char *));
+		if (nnew == NULL || (nnew[i] = strdup(path)) == NULL) {
+			if (nnew != NULL)
+				names = nnew;
+			pthread_mutex_unlock(&mtx);
+			return (ENOMEM);
+		}
+		names = nnew;
+		nnames++;
+	}
+	pthread_mutex_unlock(&mtx);
+
+	memset(sbuf, 0, sizeof(*sbuf));
+	sbuf->st_dev = (dev_t) -1;
+	sbuf->st_ino = (ino_t) (i + 1);
+	sbuf->st_mode = S_IFREG;
+	sbuf->st_blksize = 4096;
+	return (0);
+}
+
+/*
+ * Data absorbed by a write-back cache exists only in this process. Write
+ * it back before the process goes away.
+ */
+static void
+blockif_atexit(void)
+{
+	struct blockif_ctxt *bc;
+
+	pthread_mutex_lock(&blockif_list_mtx);
+	for (bc = blockif_list_head; bc != NULL; bc = bc->bc_next)
+		(void) blockif_wb_flush(bc);
+	pthread_mutex_unlock(&blockif_list_mtx);
+}
+
+/*
+ * Find the shared state of the file open on fd, or set it up. The first
+ * context to open an image with backend be opens the backend; later ones
+ * share that instance, have fd closed, and get bi as the backend left it.
+ * The sparse map is kept if the first context asks for it, and dropped
+ * once a context that cannot keep it up to date opens the file.
+ * Returns NULL, with a message printed, on failure.
+ */
+static struct blockif_file *
+blockif_file_get(const char *path, int fd, const struct stat *sbuf,
+	const struct blockif_backend *be, struct blockif_binfo *bi,
+	int sparse, int cansparse)
+{
+	struct blockif_file *bf;
+	int ro;
+
+	pthread_mutex_lock(&blockif_file_mtx);
+	for (bf = blockif_file_head; bf != NULL; bf = bf->bf_next)
+		if (bf->bf_dev == sbuf->st_dev && bf->bf_ino == sbuf->st_ino)
+			break;
+	if (bf != NULL && bf->bf_be != be) {
+		fprintf(stderr, "%s: already open in another format\n", path);
+		goto err;
+	}
+	if (bf != NULL) {
+		bf->bf_refs++;
+		if (!cansparse) {
+			/* The aio engine writes behind the sparse map's back */
+			pthread_mutex_lock(&bf->bf_sp_mtx);
+			bf->bf_sparse = 0;
+			pthread_mutex_unlock(&bf->bf_sp_mtx);
+		}
+		if (bf->bf_be != NULL) {
+			ro = bi->bi_rdonly;
+			*bi = bf->bf_bi;
+			bi->bi_rdonly |= ro;
+			if (fd >= 0)
+				close(fd);
+		}
+		pthread_mutex_unlock(&blockif_file_mtx);
+		return (bf);
+	}
+
+	bf = calloc(1, sizeof(struct blockif_file));
+	if (bf == NULL) {
+		perror("calloc");
+		goto err;
+	}
+	if ((bf->bf_be = be) != NULL) {
+		if (be->bb_probe != NULL && !be->bb_probe(fd)) {
+			fprintf(stderr, "%s: not in %s format\n", path,
+			    be->bb_name);
+			free(bf);
+			goto err;
+		}
+		if ((bf->bf_bearg = be->bb_open(path, fd, bi)) == NULL) {
+			free(bf);
+			goto err;
+		}
+		bf->bf_bi = *bi;
+	} else if (sparse && cansparse) {
+		/* Backends are not probed for holes */
+		bf->bf_sp_ext = calloc(BLOCKIF_SPARSE_MAX,
+			sizeof(struct blockif_extent));
+		bf->bf_sparse = (bf->bf_sp_ext != NULL);
+	}
+	pthread_mutex_init(&bf->bf_sp_mtx, NULL);
+	pthread_mutex_init(&bf->bf_wb_mtx, NULL);
+	pthread_mutex_init(&bf->bf_ra_mtx, NULL);
+	pthread_mutex_init(&bf->bf_qos_mtx, NULL);
+	pthread_mutex_init(&bf->bf_tr_mtx, NULL);
+	pthread_cond_init(&bf->bf_wb_cond, NULL);
+	TAILQ_INIT(&bf->bf_wb_pages);
+	bf->bf_refs = 1;
+	bf->bf_dev = sbuf->st_dev;
+	bf->bf_ino = sbuf->st_ino;
+	bf->bf_next = blockif_file_head;
+	blockif_file_head = bf;
+	pthread_mutex_unlock(&blockif_file_mtx);
+	return (bf);
+err:
+	pthread_mutex_unlock(&blockif_file_mtx);
+	return (NULL);
+}
+
+static void
+blockif_file_put(struct blockif_file *bf)
+{
+	struct blockif_file **bfp;
+	int i;
+
+	pthread_mutex_lock(&blockif_file_mtx);
+	if (--bf->bf_refs > 0) {
+		pthread_mutex_unlock(&blockif_file_mtx);
+		return;
+	}
+	for (bfp = &blockif_file_head; *bfp != bf; bfp = &(*bfp)->bf_next)
+		;
+	*bfp = bf->bf_next;
+	pthread_mutex_unlock(&blockif_file_mtx);
+
+	if (bf->bf_wb_npages != 0)
+		fprintf(stderr, "blockif: %zu pages of cached writes lost\n",
+		    bf->bf_wb_npages);
+	while (!TAILQ_EMPTY(&bf->bf_wb_pages))
+		blockif_wb_free(bf, TAILQ_FIRST(&bf->bf_wb_pages));
+	free(bf->bf_wb_hash);
+	free(bf->bf_sp_ext);
+	for (i = 0; i < BLOCKIF_RA_STREAMS; i++)
+		free(bf->bf_ra[i].ra_buf);
+	/* A VM that stops early still leaves a trace of what it read */
+	if (bf->bf_tr_rec)
+		blockif_tr_save(bf);
+	free(bf->bf_tr);
+	free(bf->bf_tr_path);
+	if (bf->bf_be != NULL)
+		bf->bf_be->bb_close(bf->bf_bearg);
+	pthread_cond_destroy(&bf->bf_wb_cond);
+	pthread_mutex_destroy(&bf->bf_wb_mtx);
+	pthread_mutex_destroy(&bf->bf_sp_mtx);
+	pthread_mutex_destroy(&bf->bf_ra_mtx);
+	pthread_mutex_destroy(&bf->bf_qos_mtx);
+	pthread_mutex_destroy(&bf->bf_tr_mtx);
+	free(bf);
+}
+
+/*
+ * Give a file a write-back cache of mb MiB, unless it already has one.
+ */
+static int
+blockif_wb_init(struct blockif_file *bf, int mb)
+{
+	struct blockif_wpage **hash;
+	size_t hsize, max;
+
+	pthread_mutex_lock(&bf->bf_wb_mtx);
+	if (bf->bf_wb_hash == NULL) {
+		max = ((size_t) mb) << (20 - BLOCKIF_CACHE_PGSHIFT);
+		for (hsize = 1; hsize < max; hsize <<= 1)
+			;
+		if ((hash = calloc(hsize, sizeof(struct blockif_wpage *))) ==
+		    NULL) {
+			pthread_mutex_unlock(&bf->bf_wb_mtx);
+			return (ENOMEM);
+		}
+		bf->bf_wb_max = max;
+		bf->bf_wb_hmask = hsize - 1;
+		bf->bf_wb_hash = hash;
+		bf->bf_wce = 1;
+	}
+	pthread_mutex_unlock(&bf->bf_wb_mtx);
+	return (0);
+}
+
+/*
+ * Turn on readahead for a file. As with the write-back cache, the first
+ * context to ask picks the window size; stream buffers are allocated when
+ * a stream is first filled.
+ */
+static void
+blockif_ra_init(struct blockif_file *bf, int kb)
+{
+	pthread_mutex_lock(&bf->bf_ra_mtx);
+	if (bf->bf_ra_max == 0)
+		bf->bf_ra_max = ((size_t) kb) << 10;
+	pthread_mutex_unlock(&bf->bf_ra_mtx);
+}
+
+/*
+ * Claim the boot trace of a file for the first context opened with
+ * trace=. If the trace file exists its ranges are returned in *trp for
+ * the caller to replay; otherwise recording starts. Later contexts of the
+ * same file get neither. Returns 0 or an errno value.
+ */
+static int
+blockif_tr_init(struct blockif_file *bf, const char *path, int secs,
+	struct blockif_trange **trp, size_t *np)
 {
-	struct blockif_req *br;
-	// off_t arg[2];
-	ssize_t clen, len, off, boff, voff;
-	int i, err;
+	struct blockif_trange *tr, *ntr;
+	long long off, len;
+	size_t n, max;
+	FILE *f;
+	int err;
 
-	br = be->be_req;
-	if (br->br_iovcnt <= 1)
-		buf = NULL;
+	*trp = NULL;
+	*np = 0;
+	pthread_mutex_lock(&bf->bf_tr_mtx);
+	if (bf->bf_tr_path != NULL) {
+		pthread_mutex_unlock(&bf->bf_tr_mtx);
+		return (0);
+	}
+	if ((bf->bf_tr_path = strdup(path)) == NULL) {
+		pthread_mutex_unlock(&bf->bf_tr_mtx);
+		return (ENOMEM);
+	}
+	pthread_mutex_unlock(&bf->bf_tr_mtx);
+
+	if ((f = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT)
+			return (errno);
+		pthread_mutex_lock(&bf->bf_tr_mtx);
+		bf->bf_tr_end = time(NULL) + secs;
+		bf->bf_tr_rec = 1;
+		pthread_mutex_unlock(&bf->bf_tr_mtx);
+		return (0);
+	}
+	tr = NULL;
+	n = max = 0;
 	err = 0;
-	switch (be->be_op) {
-	case BOP_READ:
-		if (buf == NULL) {
-			if ((len = preadv(bc->bc_fd, br->br_iov, br->br_iovcnt,
-				   br->br_offset)) < 0)
-				err = errno;
-			else
-				br->br_resid -= len;
-			break;
-		}
-		i = 0;
-		off = voff = 0;
-		while (br->br_resid > 0) {
-			len = MIN(br->br_resid, MAXPHYS);
-			if (pread(bc->bc_fd, buf, ((size_t) len), br->br_offset + off) < 0)
-			{
-				err = errno;
-				break;
-			}
-			boff = 0;
-			do {
-				clen = MIN((len - boff),
-					(((ssize_t) br->br_iov[i].iov_len) - voff));
-				memcpy(((void *) (((uintptr_t) br->br_iov[i].iov_base) +
-					((size_t) voff))), buf + boff, clen);
-				if (clen < (((ssize_t) br->br_iov[i].iov_len) - voff))
-					voff += clen;
-				else {
-					i++;
-					voff = 0;
-				}
-				boff += clen;
-			} while (boff < len);
-			off += len;
-			br->br_resid -= len;
-		}
-		break;
-	case BOP_WRITE:
-		if (bc->bc_rdonly) {
-			err = EROFS;
-			break;
-		}
-		if (buf == NULL) {
-			if ((len = pwritev(bc->bc_fd, br->br_iov, br->br_iovcnt,
-				    br->br_offset)) < 0)
-				err = errno;
-			else
-				br->br_resid -= len;
+	while (fscanf(f, "%lld %lld", &off, &len) == 2) {
+		if (off < 0 || len <= 0) {
+			err = EINVAL;
 			break;
 		}
-		i = 0;
-		off = voff = 0;
-		while (br->br_resid > 0) {
-			len = MIN(br->br_resid, MAXPHYS);
-			boff = 0;
-			do {
-				clen = MIN((len - boff),
-					(((ssize_t) br->br_iov[i].iov_len) - voff));
-				memcpy((buf + boff),
-					((void *) (((uintptr_t) br->br_iov[i].iov_base) +
-						((size_t) voff))), clen);
-				if (clen < (((ssize_t) br->br_iov[i].iov_len) - voff))
-					voff += clen;
-				else {
-					i++;
-					voff = 0;
-				}
-				boff += clen;
-			} while (boff < len);
-			if (pwrite(bc->bc_fd, buf, ((size_t) len), br->br_offset +
-			    off) < 0) {
-				err = errno;
+		if (n == max) {
+			max = MAX(max * 2, 256);
+			ntr = realloc(tr, max * sizeof(struct blockif_trange));
+			if (ntr == NULL) {
+				err = ENOMEM;
 				break;
 			}
-			off += len;
-			br->br_resid -= len;
-		}
-		break;
-	case BOP_FLUSH:
-		if (bc->bc_ischr) {
-			if (ioctl(bc->bc_fd, DKIOCSYNCHRONIZECACHE))
-				err = errno;
-		} else if (fsync(bc->bc_fd))
-			err = errno;
-		break;
-	case BOP_DELETE:
-		if (!bc->bc_candelete) {
-			err = EOPNOTSUPP;
-		// } else if (bc->bc_rdonly) {
-		// 	err = EROFS;
-		// } else if (bc->bc_ischr) {
-		// 	arg[0] = br->br_offset;
-		// 	arg[1] = br->br_resid;
-		// 	if (ioctl(bc->bc_fd, DIOCGDELETE, arg)) {
-		// 		err = errno;
-		// 	} else {
-		// 		br->br_resid = 0;
-		// 	}
-		} else {
-			err = EOPNOTSUPP;
+			tr = ntr;
 		}
-		break;
+		tr[n].tr_off = (off_t) off;
+		tr[n].tr_len = (off_t) len;
+		n++;
 	}
-
-	be->be_status = BST_DONE;
-
-	(*br->br_callback)(br, err);
+	if (err == 0 && !feof(f))
+		err = EINVAL;
+	fclose(f);
+	if (err != 0) {
+		free(tr);
+		return (err);
+	}
+	*trp = tr;
+	*np = n;
+	return (0);
 }
 
+/*
+ * Replay a boot trace by reading its ranges, in order, through the block
+ * cache, while the guest boots. Stops once the cache is full, since
+ * anything read after that would only push out what was prefetched.
+ */
 static void *
-blockif_thr(void *arg)
+blockif_tr_thr(void *arg)
 {
 	struct blockif_ctxt *bc;
-	struct blockif_elem *be;
-	pthread_t t;
+	struct iovec iov;
 	uint8_t *buf;
+	size_t budget, i;
+	off_t off, end;
+	int closing;
 
 	bc = arg;
-	if (bc->bc_isgeom)
-		buf = malloc(MAXPHYS);
-	else
-		buf = NULL;
-	t = pthread_self();
-
-	pthread_mutex_lock(&bc->bc_mtx);
-	for (;;) {
-		while (blockif_dequeue(bc, t, &be)) {
-			pthread_mutex_unlock(&bc->bc_mtx);
-			blockif_proc(bc, be, buf);
+	if ((buf = malloc(BLOCKIF_TRACE_IOSZ)) == NULL)
+		return (NULL);
+	budget = bc->bc_cache->bk_npages * BLOCKIF_CACHE_PGSZ;
+	for (i = 0; i < bc->bc_tr_n; i++) {
+		off = bc->bc_tr[i].tr_off;
+		end = MIN(off + bc->bc_tr[i].tr_len, bc->bc_size);
+		for (; off < end; off += (off_t) iov.iov_len) {
 			pthread_mutex_lock(&bc->bc_mtx);
-			blockif_complete(bc, be);
+			closing = bc->bc_closing;
+			pthread_mutex_unlock(&bc->bc_mtx);
+			if (closing)
+				goto done;
+			iov.iov_base = buf;
+			iov.iov_len = (size_t) MIN(end - off, BLOCKIF_TRACE_IOSZ);
+			if (iov.iov_len > budget ||
+			    blockif_cache_read(bc, &iov, 1, off) < 0)
+				goto done;
+			budget -= iov.iov_len;
 		}
-		/* Check ctxt status here to see if exit requested */
-		if (bc->bc_closing)
-			break;
-		pthread_cond_wait(&bc->bc_cond, &bc->bc_mtx);
+		pthread_mutex_lock(&bc->bc_mtx);
+		bc->bc_tr_done = i + 1;
+		pthread_mutex_unlock(&bc->bc_mtx);
 	}
-	pthread_mutex_unlock(&bc->bc_mtx);
-
-	if (buf)
-		free(buf);
-	pthread_exit(NULL);
+done:
+	free(buf);
 	return (NULL);
 }
 
-static void
-blockif_sigcont_handler(UNUSED int signal, UNUSED enum ev_type type,
-	UNUSED void *arg)
-{
-	struct blockif_sig_elem *bse;
-
-	for (;;) {
-		/*
-		 * Process the entire list even if not intended for
-		 * this thread.
-		 */
-		do {
-			bse = blockif_bse_head;
-			if (bse == NULL)
-				return;
-		} while (!atomic_cmpset_ptr((uintptr_t *)&blockif_bse_head,
-					    (uintptr_t)bse,
-					    (uintptr_t)bse->bse_next));
-
-		pthread_mutex_lock(&bse->bse_mtx);
-		bse->bse_pending = 0;
-		pthread_cond_signal(&bse->bse_cond);
-		pthread_mutex_unlock(&bse->bse_mtx);
-	}
-}
-
 static void
 blockif_init(void)
 {
 	mevent_add(SIGCONT, EVF_SIGNAL, blockif_sigcont_handler, NULL);
 	(void) signal(SIGCONT, SIG_IGN);
+	mevent_add(SIGIO, EVF_SIGNAL, blockif_sigio_handler, NULL);
+	(void) signal(SIGIO, SIG_IGN);
+	mevent_add(SIGINFO, EVF_SIGNAL, blockif_siginfo_handler, NULL);
+	(void) signal(SIGINFO, SIG_IGN);
+	atexit(blockif_atexit);
+	mach_timebase_info(&blockif_timebase);
 }
 
 struct blockif_ctxt *
-blockif_open(const char *optstr, UNUSED const char *ident)
+blockif_open(const char *optstr, const char *ident)
 {
 	// char name[MAXPATHLEN];
-	char *nopt, *xopts, *cp;
+	char *nopt, *xopts, *cp, *backing, *format, *trace;
+	const struct blockif_backend *be;
+	struct blockif_trange *tr;
+	size_t ntr;
+	struct blockif_binfo bi;
+	struct blockif_file *bf;
 	struct blockif_ctxt *bc;
 	struct stat sbuf;
 	// struct diocgattr_arg arg;
 	off_t size, psectsz, psectoff;
 	int extra, fd, i, sectsz;
-	int nocache, sync, ro, candelete, geom, ssopt, pssopt;
+	int nocache, sync, ro, candelete, ssopt, pssopt, numthr, qdepth;
+	int sparse;
+	int cachemb, cacheexact, writeback, wbmb, rakb, tracesecs;
+	uint64_t iops, iopsburst, bps, bpsburst;
+	enum blockengine engine;
 
 	pthread_once(&blockif_once, blockif_init);
 
 	fd = -1;
+	bf = NULL;
+	be = NULL;
+	backing = NULL;
+	format = NULL;
+	trace = NULL;
+	tracesecs = BLOCKIF_TRACE_DEFSECS;
+	tr = NULL;
+	ntr = 0;
 	ssopt = 0;
 	nocache = 0;
+	sparse = 0;
 	sync = 0;
 	ro = 0;
+	numthr = BLOCKIF_NUMTHR;
+	qdepth = 0;
+	cachemb = 0;
+	cacheexact = 0;
+	writeback = 0;
+	wbmb = BLOCKIF_WB_DEFMB;
+	rakb = 0;
+	iops = iopsburst = bps = bpsburst = 0;
+	engine = BENG_THREAD;
 
 	pssopt = 0;
 	/*
@@ -446,6 +3407,8 @@ blockif_open(const char *optstr, UNUSED const char *ident)
 			continue;
 		else if (!strcmp(cp, "nocache"))
 			nocache = 1;
+		else if (!strcmp(cp, "sparse"))
+			sparse = 1;
 		else if (!strcmp(cp, "sync") || !strcmp(cp, "direct"))
 			sync = 1;
 		else if (!strcmp(cp, "ro"))
@@ -454,36 +3417,136 @@ blockif_open(const char *optstr, UNUSED const char *ident)
 			;
 		else if (sscanf(cp, "sectorsize=%d", &ssopt) == 1)
 			pssopt = ssopt;
+		else if (sscanf(cp, "workers=%d", &numthr) == 1) {
+			if (numthr < 1 || numthr > BLOCKIF_MAXTHR) {
+				fprintf(stderr, "Invalid number of workers %d\n",
+				    numthr);
+				goto err;
+			}
+		} else if (sscanf(cp, "qdepth=%d", &qdepth) == 1) {
+			if (qdepth < 1 || qdepth > BLOCKIF_MAXQDEPTH) {
+				fprintf(stderr, "Invalid queue depth %d\n",
+				    qdepth);
+				goto err;
+			}
+		} else if (sscanf(cp, "bcache=%d", &cachemb) == 1) {
+			if (cachemb < 1 || cachemb > BLOCKIF_CACHE_MAXMB) {
+				fprintf(stderr, "Invalid cache size %d\n",
+				    cachemb);
+				goto err;
+			}
+			cacheexact = 1;
+		} else if (!strcmp(cp, "cache=writeback"))
+			writeback = 1;
+		else if (!strcmp(cp, "cache=writethrough"))
+			writeback = 0;
+		else if (sscanf(cp, "wbmax=%d", &wbmb) == 1) {
+			if (wbmb < 1 || wbmb > BLOCKIF_CACHE_MAXMB) {
+				fprintf(stderr, "Invalid write-back cache size "
+				    "%d\n", wbmb);
+				goto err;
+			}
+		} else if (sscanf(cp, "readahead=%d", &rakb) == 1) {
+			if (rakb < 0 || rakb > BLOCKIF_RA_MAXKB ||
+			    (rakb != 0 && rakb < BLOCKIF_RA_MIN >> 10)) {
+				fprintf(stderr, "Invalid readahead window %d\n",
+				    rakb);
+				goto err;
+			}
+		} else if (sscanf(cp, "iops=%llu/%llu", &iops, &iopsburst) == 2)
+			;
+		else if (sscanf(cp, "iops=%llu", &iops) == 1)
+			iopsburst = 0;
+		else if (sscanf(cp, "bps=%llu/%llu", &bps, &bpsburst) == 2)
+			;
+		else if (sscanf(cp, "bps=%llu", &bps) == 1)
+			bpsburst = 0;
+		else if (!strncmp(cp, "trace=", 6))
+			trace = cp + 6;
+		else if (sscanf(cp, "tracesecs=%d", &tracesecs) == 1) {
+			if (tracesecs < 1) {
+				fprintf(stderr, "Invalid trace period %d\n",
+				    tracesecs);
+				goto err;
+			}
+		} else if (!strncmp(cp, "backing=", 8))
+			backing = cp + 8;
+		else if (!strncmp(cp, "format=", 7))
+			format = cp + 7;
+		else if (!strcmp(cp, "engine=thread"))
+			engine = BENG_THREAD;
+		else if (!strcmp(cp, "engine=aio"))
+			engine = BENG_AIO;
 		else {
 			fprintf(stderr, "Invalid device option \"%s\"\n", cp);
 			goto err;
 		}
 	}
 
-	extra = 0;
-	if (nocache) {
-		perror("xhyve: nocache support unimplemented");
+	/* Keep burst * BLOCKIF_NSEC within 64 bits */
+	if (MAX(MAX(iops, iopsburst), MAX(bps, bpsburst)) >
+	    UINT64_MAX / BLOCKIF_NSEC) {
+		fprintf(stderr, "Invalid I/O limit\n");
 		goto err;
-		// extra |= O_DIRECT;
 	}
-	if (sync)
-		extra |= O_SYNC;
 
-	fd = open(nopt, (ro ? O_RDONLY : O_RDWR) | extra);
-	if (fd < 0 && !ro) {
-		/* Attempt a r/w fail with a r/o open */
-		fd = open(nopt, O_RDONLY | extra);
-		ro = 1;
+	/* The aio engine could not bounce unaligned requests */
+	if (nocache && engine != BENG_THREAD) {
+		fprintf(stderr, "nocache needs the thread engine\n");
+		goto err;
 	}
 
-	if (fd < 0) {
-		perror("Could not open backing file");
+	extra = 0;
+	if (sync)
+		extra |= O_SYNC;
+
+	/* backing= makes an overlay, and a new one has no other format */
+	if (backing != NULL && format == NULL)
+		format = "overlay";
+	if (backing != NULL && strcmp(format, "overlay") != 0) {
+		fprintf(stderr, "backing= needs format=overlay\n");
 		goto err;
 	}
 
-	if (fstat(fd, &sbuf) < 0) {
-		perror("Could not stat backing file");
-		goto err;
+	if ((be = blockif_match(nopt)) != NULL) {
+		/* Opened by the backend, in blockif_file_get() */
+		if (backing != NULL || format != NULL) {
+			fprintf(stderr, "%s= needs a file\n",
+			    backing != NULL ? "backing" : "format");
+			goto err;
+		}
+		if ((errno = blockif_name_stat(nopt, &sbuf)) != 0) {
+			perror("Could not open backing image");
+			goto err;
+		}
+	} else {
+		if (format != NULL && strcmp(format, "raw") != 0 &&
+		    (be = blockif_format(format)) == NULL) {
+			fprintf(stderr, "Invalid image format \"%s\"\n", format);
+			goto err;
+		}
+		if (backing != NULL && access(nopt, F_OK) < 0 &&
+		    (errno = blockif_overlay_create(nopt, backing)) != 0) {
+			perror("Could not create overlay");
+			goto err;
+		}
+
+		fd = open(nopt, (ro ? O_RDONLY : O_RDWR) | extra);
+		if (fd < 0 && !ro) {
+			/* Attempt a r/w fail with a r/o open */
+			fd = open(nopt, O_RDONLY | extra);
+			ro = 1;
+		}
+
+		if (fd < 0) {
+			perror("Could not open backing file");
+			goto err;
+		}
+
+		if (fstat(fd, &sbuf) < 0) {
+			perror("Could not stat backing file");
+			goto err;
+		}
 	}
 
     /*
@@ -492,7 +3555,7 @@ blockif_open(const char *optstr, UNUSED const char *ident)
 	size = sbuf.st_size;
 	sectsz = DEV_BSIZE;
 	psectsz = psectoff = 0;
-	candelete = geom = 0;
+	candelete = 0;
 	if (S_ISCHR(sbuf.st_mode)) {
 		perror("xhyve: raw device support unimplemented");
 		goto err;		
@@ -512,8 +3575,95 @@ blockif_open(const char *optstr, UNUSED const char *ident)
 		// 	candelete = arg.value.i;
 		// if (ioctl(fd, DIOCGPROVIDERNAME, name) == 0)
 		// 	geom = 1;
-	} else
+	} else {
 		psectsz = sbuf.st_blksize;
+		memset(&bi, 0, sizeof(bi));
+		bi.bi_size = size;
+		bi.bi_rdonly = ro;
+		bi.bi_blksz = (int) psectsz;
+		/*
+		 * The aio engine bypasses blockif_readv/blockif_writev, so only
+		 * the threaded engine keeps a sparse map.
+		 */
+		if (sparse && engine != BENG_THREAD) {
+			fprintf(stderr, "sparse needs the thread engine\n");
+			goto err;
+		}
+		bf = blockif_file_get(nopt, fd, &sbuf, be, &bi, sparse,
+			engine == BENG_THREAD);
+		if (bf == NULL)
+			goto err;
+		if (bf->bf_be != NULL) {
+			/* The backend owns the descriptor now */
+			fd = -1;
+			size = bi.bi_size;
+			ro = bi.bi_rdonly;
+			candelete = bi.bi_candelete;
+			psectsz = bi.bi_blksz;
+			if (engine == BENG_AIO) {
+				fprintf(stderr, "%s images need the thread "
+				    "engine\n", bf->bf_be->bb_name);
+				goto err;
+			}
+			if (nocache || sparse) {
+				fprintf(stderr, "%s does not apply to %s "
+				    "images\n", nocache ? "nocache" : "sparse",
+				    bf->bf_be->bb_name);
+				goto err;
+			}
+		} else
+			candelete = !ro && blockif_punch_probe(fd, size, psectsz);
+		/* macOS has no O_DIRECT; F_NOCACHE has the same effect */
+		if (nocache && fcntl(fd, F_NOCACHE, 1) < 0) {
+			perror("Could not disable caching of backing file");
+			goto err;
+		}
+		if (writeback && !ro) {
+			if (engine != BENG_THREAD) {
+				fprintf(stderr, "cache=writeback needs the "
+				    "thread engine\n");
+				goto err;
+			}
+			if ((errno = blockif_wb_init(bf, wbmb)) != 0) {
+				perror("Could not allocate write-back cache");
+				goto err;
+			}
+		}
+		if (rakb != 0) {
+			if (engine != BENG_THREAD) {
+				fprintf(stderr, "readahead needs the thread "
+				    "engine\n");
+				goto err;
+			}
+			blockif_ra_init(bf, rakb);
+		}
+		if (iops != 0 || bps != 0) {
+			if (engine != BENG_THREAD) {
+				fprintf(stderr, "iops= and bps= need the thread "
+				    "engine\n");
+				goto err;
+			}
+			pthread_mutex_lock(&bf->bf_qos_mtx);
+			blockif_qos_init(&bf->bf_qos_iops, iops, iopsburst);
+			blockif_qos_init(&bf->bf_qos_bps, bps, bpsburst);
+			pthread_mutex_unlock(&bf->bf_qos_mtx);
+		}
+		if (trace != NULL) {
+			/* Replay prefetches into the block cache */
+			if (engine != BENG_THREAD) {
+				fprintf(stderr, "trace= needs the thread "
+				    "engine\n");
+				goto err;
+			}
+			if (cachemb == 0)
+				cachemb = BLOCKIF_TRACE_DEFMB;
+			if ((errno = blockif_tr_init(bf, trace, tracesecs, &tr,
+			    &ntr)) != 0) {
+				perror("Could not read boot trace");
+				goto err;
+			}
+		}
+	}
 
 	if (ssopt != 0) {
 		if (!powerof2(ssopt) || !powerof2(pssopt) || ssopt < 512 ||
@@ -552,41 +3702,181 @@ blockif_open(const char *optstr, UNUSED const char *ident)
 
 	bc->bc_magic = (int) BLOCKIF_SIG;
 	bc->bc_fd = fd;
+	bc->bc_file = bf;
+	bc->bc_be = bf->bf_be;
+	bc->bc_bearg = bf->bf_bearg;
 	bc->bc_ischr = S_ISCHR(sbuf.st_mode);
-	bc->bc_isgeom = geom;
 	bc->bc_candelete = candelete;
+	bc->bc_blksz = (int) sbuf.st_blksize;
+	if (cachemb != 0) {
+		if (bc->bc_ischr || engine != BENG_THREAD) {
+			fprintf(stderr, "bcache needs a regular file and the "
+			    "thread engine\n");
+			free(bc);
+			goto err;
+		}
+		bc->bc_cache = blockif_cache_get(&sbuf, cachemb, cacheexact);
+		if (bc->bc_cache == NULL) {
+			if (errno != EEXIST)
+				perror("Could not allocate block cache");
+			free(bc);
+			goto err;
+		}
+	}
+	if (nocache) {
+		bc->bc_bounce = calloc(((size_t) numthr), sizeof(uint8_t *));
+		if (bc->bc_bounce == NULL) {
+			perror("calloc");
+			if (bc->bc_cache != NULL)
+				blockif_cache_put(bc->bc_cache);
+			free(bc);
+			goto err;
+		}
+		/*
+		 * Direct i/o wants whole physical sectors, and never less than
+		 * the emulated sector size.
+		 */
+		bc->bc_nocache = 1;
+		bc->bc_dalign = (size_t) MAX(psectsz, sectsz);
+		if (!powerof2(bc->bc_dalign) ||
+		    bc->bc_dalign > BLOCKIF_BOUNCE_SZ)
+			bc->bc_dalign = (size_t) getpagesize();
+		pthread_mutex_init(&bc->bc_bounce_mtx, NULL);
+	}
+	bc->bc_ident = strdup(ident);
 	bc->bc_rdonly = ro;
 	bc->bc_size = size;
 	bc->bc_sectsz = sectsz;
 	bc->bc_psectsz = (int) psectsz;
 	bc->bc_psectoff = (int) psectoff;
+	bc->bc_numthr = numthr;
+	/*
+	 * One element is kept spare, so a queue depth of N lets callers have
+	 * N requests outstanding.
+	 */
+	bc->bc_maxreq = qdepth ? qdepth + 1 : 64 + numthr;
+	bc->bc_engine = engine;
+	bc->bc_caninline = engine == BENG_THREAD && bf->bf_be != NULL &&
+		bf->bf_bi.bi_inline && bf->bf_wb_hash == NULL &&
+		bf->bf_ra_max == 0 && bf->bf_qos_iops.tb_rate == 0 &&
+		bf->bf_qos_bps.tb_rate == 0 && !bf->bf_tr_rec &&
+		bc->bc_cache == NULL;
+	bc->bc_reqs = calloc(((size_t) bc->bc_maxreq),
+		sizeof(struct blockif_elem));
+	if (bc->bc_reqs == NULL) {
+		perror("calloc");
+		if (bc->bc_cache != NULL)
+			blockif_cache_put(bc->bc_cache);
+		free(bc->bc_bounce);
+		free(bc->bc_ident);
+		free(bc);
+		goto err;
+	}
 	pthread_mutex_init(&bc->bc_mtx, NULL);
 	pthread_cond_init(&bc->bc_cond, NULL);
 	TAILQ_INIT(&bc->bc_freeq);
+	TAILQ_INIT(&bc->bc_blockq);
 	TAILQ_INIT(&bc->bc_pendq);
 	TAILQ_INIT(&bc->bc_busyq);
-	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
+	TAILQ_INIT(&bc->bc_flushq);
+	RB_INIT(&bc->bc_rbq);
+	for (i = 0; i < bc->bc_maxreq; i++) {
 		bc->bc_reqs[i].be_status = BST_FREE;
 		TAILQ_INSERT_HEAD(&bc->bc_freeq, &bc->bc_reqs[i], be_link);
 	}
 
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
-		pthread_create(&bc->bc_btid[i], NULL, blockif_thr, bc);
+	if (engine == BENG_AIO) {
+		bc->bc_aio = calloc(((size_t) bc->bc_maxreq),
+			sizeof(struct blockif_aio));
+		if (bc->bc_aio == NULL) {
+			perror("calloc");
+			free(bc->bc_reqs);
+			free(bc->bc_bounce);
+			free(bc->bc_ident);
+			free(bc);
+			goto err;
+		}
+		pthread_mutex_lock(&blockif_aio_mtx);
+		bc->bc_aio_next = blockif_aio_head;
+		blockif_aio_head = bc;
+		pthread_mutex_unlock(&blockif_aio_mtx);
+		pthread_create(&bc->bc_btid[0], NULL, blockif_aio_thr, bc);
+	} else {
+		for (i = 0; i < bc->bc_numthr; i++)
+			pthread_create(&bc->bc_btid[i], NULL, blockif_thr, bc);
 	}
+	if (tr != NULL) {
+		bc->bc_tr = tr;
+		bc->bc_tr_n = ntr;
+		pthread_create(&bc->bc_tr_tid, NULL, blockif_tr_thr, bc);
+	}
+
+	pthread_mutex_lock(&blockif_list_mtx);
+	bc->bc_next = blockif_list_head;
+	blockif_list_head = bc;
+	pthread_mutex_unlock(&blockif_list_mtx);
 
 	return (bc);
 err:
+	free(tr);
+	if (bf != NULL)
+		blockif_file_put(bf);
 	if (fd >= 0)
 		close(fd);
 	return (NULL);
 }
 
+/*
+ * Run a request to completion in the submitter's thread. The callback is
+ * made before this returns.
+ */
+static void
+blockif_inline_proc(struct blockif_ctxt *bc, struct blockif_req *br,
+	enum blockop op)
+{
+	ssize_t len;
+	int err;
+
+	err = 0;
+	switch (op) {
+	case BOP_READ:
+		if ((len = blockif_readv(bc, br->br_iov, br->br_iovcnt,
+		    br->br_offset)) < 0)
+			err = errno;
+		else
+			br->br_resid -= len;
+		break;
+	case BOP_WRITE:
+		if (bc->bc_rdonly)
+			err = EROFS;
+		else if ((len = blockif_writev(bc, br->br_iov, br->br_iovcnt,
+		    br->br_offset)) < 0)
+			err = errno;
+		else
+			br->br_resid -= len;
+		break;
+	case BOP_FLUSH:
+		err = blockif_sync(bc);
+		break;
+	case BOP_DELETE:
+	case BOP_ZERO:
+		err = blockif_delete_range(bc, op, br);
+		break;
+	}
+	(*br->br_callback)(br, err);
+}
+
 static int
 blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
 {
 	int err;
 
+	if (bc->bc_inline) {
+		blockif_inline_proc(bc, breq, op);
+		return (0);
+	}
+
 	err = 0;
 
 	pthread_mutex_lock(&bc->bc_mtx);
@@ -595,8 +3885,12 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		 * Enqueue and inform the block i/o thread
 		 * that there is work available
 		 */
-		if (blockif_enqueue(bc, breq, op))
-			pthread_cond_signal(&bc->bc_cond);
+		if (blockif_enqueue(bc, breq, op)) {
+			if (bc->bc_engine == BENG_AIO)
+				blockif_aio_start(bc);
+			else
+				pthread_cond_signal(&bc->bc_cond);
+		}
 	} else {
 		/*
 		 * Callers are not allowed to enqueue more than
@@ -639,10 +3933,18 @@ blockif_delete(struct blockif_ctxt *bc, struct blockif_req *breq)
 	return (blockif_request(bc, breq, BOP_DELETE));
 }
 
+int
+blockif_zero(struct blockif_ctxt *bc, struct blockif_req *breq)
+{
+	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
+	return (blockif_request(bc, breq, BOP_ZERO));
+}
+
 int
 blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
 	struct blockif_elem *be;
+	int i;
 
 	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
 
@@ -654,6 +3956,18 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		if (be->be_req == breq)
 			break;
 	}
+	if (be == NULL) {
+		TAILQ_FOREACH(be, &bc->bc_blockq, be_link) {
+			if (be->be_req == breq)
+				break;
+		}
+	}
+	if (be == NULL) {
+		TAILQ_FOREACH(be, &bc->bc_flushq, be_link) {
+			if (be->be_req == breq)
+				break;
+		}
+	}
 	if (be != NULL) {
 		/*
 		 * Found it.
@@ -679,6 +3993,23 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		return (EINVAL);
 	}
 
+	/*
+	 * The aio engine has no thread to interrupt; ask the kernel to
+	 * cancel whatever is outstanding. The request completes through
+	 * the SIGIO handler either way.
+	 */
+	if (bc->bc_engine == BENG_AIO) {
+		struct blockif_aio *ba;
+
+		ba = &bc->bc_aio[be - bc->bc_reqs];
+		for (i = 0; i < ba->ba_nsub; i++) {
+			if (!ba->ba_cb[i].bac_reaped)
+				aio_cancel(bc->bc_fd, &ba->ba_cb[i].bac_cb);
+		}
+		pthread_mutex_unlock(&bc->bc_mtx);
+		return (EBUSY);
+	}
+
 	/*
 	 * Interrupt the processing thread to force it return
 	 * prematurely via it's normal callback path.
@@ -718,11 +4049,10 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 int
 blockif_close(struct blockif_ctxt *bc)
 {
+	struct blockif_ctxt **bcp;
 	void *jval;
 	int err, i;
 
-	err = 0;
-
 	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
 
 	/*
@@ -732,19 +4062,63 @@ blockif_close(struct blockif_ctxt *bc)
 	bc->bc_closing = 1;
 	pthread_mutex_unlock(&bc->bc_mtx);
 	pthread_cond_broadcast(&bc->bc_cond);
-	for (i = 0; i < BLOCKIF_NUMTHR; i++)
+	for (i = 0; i < bc->bc_numthr && bc->bc_engine == BENG_THREAD; i++)
 		pthread_join(bc->bc_btid[i], &jval);
+	if (bc->bc_tr != NULL) {
+		pthread_join(bc->bc_tr_tid, &jval);
+		free(bc->bc_tr);
+	}
+
+	if (bc->bc_engine == BENG_AIO) {
+		/*
+		 * Drain in-flight operations before the elements go away.
+		 * They complete on the mevent thread, which wakes us up.
+		 */
+		pthread_mutex_lock(&bc->bc_mtx);
+		while (!TAILQ_EMPTY(&bc->bc_busyq))
+			pthread_cond_wait(&bc->bc_cond, &bc->bc_mtx);
+		pthread_mutex_unlock(&bc->bc_mtx);
+		pthread_cond_broadcast(&bc->bc_cond);
+		pthread_join(bc->bc_btid[0], &jval);
+
+		pthread_mutex_lock(&blockif_aio_mtx);
+		for (bcp = &blockif_aio_head; *bcp != bc;
+		     bcp = &(*bcp)->bc_aio_next)
+			;
+		*bcp = bc->bc_aio_next;
+		pthread_mutex_unlock(&blockif_aio_mtx);
+		free(bc->bc_aio);
+	}
 
 	/* XXX Cancel queued i/o's ??? */
 
+	if ((err = blockif_wb_flush(bc)) != 0)
+		fprintf(stderr, "blockif %s: could not write back cached "
+		    "data: %s\n", bc->bc_ident, strerror(err));
+
+	pthread_mutex_lock(&blockif_list_mtx);
+	for (bcp = &blockif_list_head; *bcp != bc; bcp = &(*bcp)->bc_next)
+		;
+	*bcp = bc->bc_next;
+	pthread_mutex_unlock(&blockif_list_mtx);
+	if (bc->bc_cache != NULL)
+		blockif_cache_put(bc->bc_cache);
+
 	/*
 	 * Release resources
 	 */
 	bc->bc_magic = 0;
-	close(bc->bc_fd);
+	if (bc->bc_fd >= 0)
+		close(bc->bc_fd);
+	blockif_file_put(bc->bc_file);
+	while (bc->bc_nbounce > 0)
+		free(bc->bc_bounce[--bc->bc_nbounce]);
+	free(bc->bc_bounce);
+	free(bc->bc_ident);
+	free(bc->bc_reqs);
 	free(bc);
 
-	return (0);
+	return (err);
 }
 
 /*
@@ -825,7 +4199,7 @@ int
 blockif_queuesz(struct blockif_ctxt *bc)
 {
 	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
-	return (BLOCKIF_MAXREQ - 1);
+	return (bc->bc_maxreq - 1);
 }
 
 int
@@ -841,3 +4215,52 @@ blockif_candelete(struct blockif_ctxt *bc)
 	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
 	return (bc->bc_candelete);
 }
+
+int
+blockif_get_wce(struct blockif_ctxt *bc)
+{
+	struct blockif_file *bf;
+	int wce;
+
+	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
+	bf = bc->bc_file;
+	pthread_mutex_lock(&bf->bf_wb_mtx);
+	wce = bf->bf_wce;
+	pthread_mutex_unlock(&bf->bf_wb_mtx);
+	return (wce);
+}
+
+/*
+ * Turn the write-back cache of a disk opened with cache=writeback on or
+ * off. Every context open on the file is affected. Turning it off writes
+ * back what the cache holds.
+ */
+void
+blockif_set_wce(struct blockif_ctxt *bc, int wce)
+{
+	struct blockif_file *bf;
+
+	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
+	bf = bc->bc_file;
+	if (bf->bf_wb_hash == NULL)
+		return;
+	pthread_mutex_lock(&bf->bf_wb_mtx);
+	bf->bf_wce = (wce != 0);
+	pthread_mutex_unlock(&bf->bf_wb_mtx);
+	if (!wce)
+		(void) blockif_wb_flush(bc);
+}
+
+/*
+ * Ask for requests to be run in the submitter's thread, which a disk whose
+ * backend never blocks allows. Returns non-zero if they will be: the
+ * completion callback is then made before blockif_read() and friends
+ * return, with whatever locks the caller holds. Call before issuing i/o.
+ */
+int
+blockif_inline(struct blockif_ctxt *bc)
+{
+	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
+	bc->bc_inline = bc->bc_caninline;
+	return (bc->bc_inline);
+}
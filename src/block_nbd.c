@@ -0,0 +1,660 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Disks served by a Network Block Device server, named as
+ *
+ *	nbd://host[:port][/export]
+ *	nbd+unix://[/export]?socket=path
+ *
+ * The client negotiates the fixed newstyle handshake and selects the
+ * export with NBD_OPT_EXPORT_NAME, which every server understands. Each
+ * i/o thread sends its request on the one connection and sleeps; a
+ * receiver thread matches replies to requests by handle, the index of the
+ * request's slot, so the server may complete them in any order. The
+ * connection is not re-established once lost: all i/o then fails with EIO.
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_backend.h>
+
+#define NBD_DEFPORT "10809"
+#define NBD_NREQ 64			/* requests in flight */
+#define NBD_MAXIO (4 * 1024 * 1024)	/* largest request sent */
+
+#define NBD_MAGIC 0x4e42444d41474943ULL		/* "NBDMAGIC" */
+#define NBD_OPTMAGIC 0x49484156454f5054ULL	/* "IHAVEOPT" */
+#define NBD_REQMAGIC 0x25609513U
+#define NBD_REPMAGIC 0x67446698U
+
+/* Handshake flags, ours and the server's */
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+#define NBD_OPT_EXPORT_NAME 1
+
+/* Transmission flags */
+#define NBD_FLAG_HAS_FLAGS (1 << 0)
+#define NBD_FLAG_READ_ONLY (1 << 1)
+#define NBD_FLAG_SEND_FLUSH (1 << 2)
+#define NBD_FLAG_SEND_TRIM (1 << 5)
+
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+#define NBD_CMD_TRIM 4
+
+#define NBD_REQSZ 28
+#define NBD_REPSZ 16
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct nbd_req {
+	int nr_busy;
+	int nr_done;
+	int nr_err;
+	const struct iovec *nr_iov;	/* where read data goes */
+	int nr_iovcnt;
+	pthread_cond_t nr_cond;
+};
+
+struct nbd {
+	int nb_fd;
+	off_t nb_size;
+	uint16_t nb_flags;		/* transmission flags */
+	pthread_t nb_tid;		/* receiver */
+	pthread_mutex_t nb_wmtx;	/* held while sending a request */
+	pthread_mutex_t nb_mtx;		/* slots and nb_dead */
+	pthread_cond_t nb_cond;		/* a slot was freed */
+	int nb_dead;
+	struct nbd_req nb_req[NBD_NREQ];
+};
+#pragma clang diagnostic pop
+
+static void
+nbd_enc16(uint8_t *p, uint16_t v)
+{
+	p[0] = (uint8_t) (v >> 8);
+	p[1] = (uint8_t) v;
+}
+
+static void
+nbd_enc32(uint8_t *p, uint32_t v)
+{
+	nbd_enc16(p, (uint16_t) (v >> 16));
+	nbd_enc16(p + 2, (uint16_t) v);
+}
+
+static void
+nbd_enc64(uint8_t *p, uint64_t v)
+{
+	nbd_enc32(p, (uint32_t) (v >> 32));
+	nbd_enc32(p + 4, (uint32_t) v);
+}
+
+static uint16_t
+nbd_dec16(const uint8_t *p)
+{
+	return ((uint16_t) ((p[0] << 8) | p[1]));
+}
+
+static uint32_t
+nbd_dec32(const uint8_t *p)
+{
+	return ((((uint32_t) nbd_dec16(p)) << 16) | nbd_dec16(p + 2));
+}
+
+static uint64_t
+nbd_dec64(const uint8_t *p)
+{
+	return ((((uint64_t) nbd_dec32(p)) << 32) | nbd_dec32(p + 4));
+}
+
+/*
+ * Transfer all of an iovec array, whatever the socket takes or gives at a
+ * time. Returns 0, or -1 with errno set; end of file is EPIPE.
+ */
+static int
+nbd_xfer(int fd, const struct iovec *iov, int iovcnt, int wr)
+{
+	struct iovec siov[BLOCKIF_BACKEND_IOV + 1];
+	struct iovec *v;
+	ssize_t n;
+
+	assert(iovcnt <= BLOCKIF_BACKEND_IOV + 1);
+	memcpy(siov, iov, ((size_t) iovcnt) * sizeof(struct iovec));
+	for (v = siov; iovcnt > 0;) {
+		/* An empty transfer would look like end of file */
+		if (v->iov_len == 0) {
+			v++;
+			iovcnt--;
+			continue;
+		}
+		if (wr)
+			n = writev(fd, v, iovcnt);
+		else
+			n = readv(fd, v, iovcnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EPIPE;
+			return (-1);
+		}
+		for (; iovcnt > 0 && ((size_t) n) >= v->iov_len; v++, iovcnt--)
+			n -= (ssize_t) v->iov_len;
+		if (iovcnt > 0) {
+			v->iov_base = ((uint8_t *) v->iov_base) + n;
+			v->iov_len -= (size_t) n;
+		}
+	}
+	return (0);
+}
+
+static int
+nbd_read(int fd, void *buf, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	return (nbd_xfer(fd, &iov, 1, 0));
+}
+
+static int
+nbd_write(int fd, const void *buf, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *) (uintptr_t) buf;
+	iov.iov_len = len;
+	return (nbd_xfer(fd, &iov, 1, 1));
+}
+
+/*
+ * NBD errors are Linux errno values.
+ */
+static int
+nbd_errno(uint32_t err)
+{
+	switch (err) {
+	case 1:
+		return (EPERM);
+	case 12:
+		return (ENOMEM);
+	case 22:
+		return (EINVAL);
+	case 28:
+		return (ENOSPC);
+	case 75:
+		return (EOVERFLOW);
+	case 95:
+		return (ENOTSUP);
+	case 108:
+		return (ESHUTDOWN);
+	default:
+		return (EIO);
+	}
+}
+
+/*
+ * Fail every request in flight once the connection is gone. Called with
+ * nb_mtx held.
+ */
+static void
+nbd_kill(struct nbd *nb)
+{
+	int i;
+
+	nb->nb_dead = 1;
+	for (i = 0; i < NBD_NREQ; i++) {
+		if (nb->nb_req[i].nr_busy && !nb->nb_req[i].nr_done) {
+			nb->nb_req[i].nr_err = EIO;
+			nb->nb_req[i].nr_done = 1;
+			pthread_cond_signal(&nb->nb_req[i].nr_cond);
+		}
+	}
+	pthread_cond_broadcast(&nb->nb_cond);
+}
+
+static void *
+nbd_thr(void *arg)
+{
+	uint8_t rep[NBD_REPSZ];
+	struct nbd_req *nr;
+	struct nbd *nb;
+	uint64_t handle;
+	uint32_t err;
+
+	nb = arg;
+	for (;;) {
+		if (nbd_read(nb->nb_fd, rep, sizeof(rep)) < 0)
+			break;
+		handle = nbd_dec64(rep + 8);
+		if (nbd_dec32(rep) != NBD_REPMAGIC || handle >= NBD_NREQ) {
+			fprintf(stderr, "nbd: bad reply from server\n");
+			break;
+		}
+		nr = &nb->nb_req[handle];
+		pthread_mutex_lock(&nb->nb_mtx);
+		if (!nr->nr_busy || nr->nr_done) {
+			pthread_mutex_unlock(&nb->nb_mtx);
+			fprintf(stderr, "nbd: reply to no request\n");
+			break;
+		}
+		pthread_mutex_unlock(&nb->nb_mtx);
+		/* Only the receiver touches a busy slot's data until done */
+		err = nbd_dec32(rep + 4);
+		if (err == 0 && nr->nr_iov != NULL &&
+		    nbd_xfer(nb->nb_fd, nr->nr_iov, nr->nr_iovcnt, 0) < 0)
+			break;
+		pthread_mutex_lock(&nb->nb_mtx);
+		nr->nr_err = err == 0 ? 0 : nbd_errno(err);
+		nr->nr_done = 1;
+		pthread_cond_signal(&nr->nr_cond);
+		pthread_mutex_unlock(&nb->nb_mtx);
+	}
+
+	pthread_mutex_lock(&nb->nb_mtx);
+	if (!nb->nb_dead)
+		fprintf(stderr, "nbd: connection to server lost\n");
+	nbd_kill(nb);
+	pthread_mutex_unlock(&nb->nb_mtx);
+	return (NULL);
+}
+
+/*
+ * Send one command and wait for its reply. For reads, iov receives the
+ * data; for writes it holds it. Returns 0 or an errno value.
+ */
+static int
+nbd_cmd(struct nbd *nb, uint16_t type, off_t off, size_t len,
+	const struct iovec *iov, int iovcnt)
+{
+	struct iovec siov[BLOCKIF_BACKEND_IOV + 1];
+	uint8_t req[NBD_REQSZ];
+	struct nbd_req *nr;
+	int err, i;
+
+	pthread_mutex_lock(&nb->nb_mtx);
+	for (;;) {
+		if (nb->nb_dead) {
+			pthread_mutex_unlock(&nb->nb_mtx);
+			return (EIO);
+		}
+		for (i = 0; i < NBD_NREQ && nb->nb_req[i].nr_busy; i++)
+			;
+		if (i < NBD_NREQ)
+			break;
+		pthread_cond_wait(&nb->nb_cond, &nb->nb_mtx);
+	}
+	nr = &nb->nb_req[i];
+	nr->nr_busy = 1;
+	nr->nr_done = 0;
+	nr->nr_err = 0;
+	nr->nr_iov = type == NBD_CMD_READ ? iov : NULL;
+	nr->nr_iovcnt = iovcnt;
+	pthread_mutex_unlock(&nb->nb_mtx);
+
+	nbd_enc32(req, NBD_REQMAGIC);
+	nbd_enc16(req + 4, 0);
+	nbd_enc16(req + 6, type);
+	nbd_enc64(req + 8, (uint64_t) i);
+	nbd_enc64(req + 16, (uint64_t) off);
+	nbd_enc32(req + 24, (uint32_t) len);
+	siov[0].iov_base = req;
+	siov[0].iov_len = sizeof(req);
+	if (type == NBD_CMD_WRITE)
+		memcpy(&siov[1], iov, ((size_t) iovcnt) * sizeof(struct iovec));
+	else
+		iovcnt = 0;
+	pthread_mutex_lock(&nb->nb_wmtx);
+	if (nbd_xfer(nb->nb_fd, siov, iovcnt + 1, 1) < 0) {
+		/* The receiver notices too, and fails what is in flight */
+		shutdown(nb->nb_fd, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&nb->nb_wmtx);
+
+	pthread_mutex_lock(&nb->nb_mtx);
+	while (!nr->nr_done)
+		pthread_cond_wait(&nr->nr_cond, &nb->nb_mtx);
+	err = nr->nr_err;
+	nr->nr_busy = 0;
+	pthread_cond_signal(&nb->nb_cond);
+	pthread_mutex_unlock(&nb->nb_mtx);
+	return (err);
+}
+
+static ssize_t
+nbd_rw(struct nbd *nb, const struct iovec *iov, int iovcnt, off_t off,
+	uint16_t type)
+{
+	struct iovec siov[BLOCKIF_BACKEND_IOV];
+	size_t done, len, n;
+	int err, scnt;
+
+	if (off >= nb->nb_size)
+		return (0);
+	len = MIN(blockif_iov_len(iov, iovcnt), (size_t) (nb->nb_size - off));
+	for (done = 0; done < len; done += n) {
+		n = MIN(len - done, NBD_MAXIO);
+		scnt = blockif_iov_slice(iov, iovcnt, done, n, siov);
+		if ((err = nbd_cmd(nb, type, off + ((off_t) done), n, siov,
+		    scnt)) != 0) {
+			errno = err;
+			return (-1);
+		}
+	}
+	return ((ssize_t) len);
+}
+
+static ssize_t
+nbd_preadv(void *arg, const struct iovec *iov, int iovcnt, off_t off)
+{
+	return (nbd_rw(arg, iov, iovcnt, off, NBD_CMD_READ));
+}
+
+static ssize_t
+nbd_pwritev(void *arg, const struct iovec *iov, int iovcnt, off_t off)
+{
+	struct nbd *nb;
+
+	nb = arg;
+	if (nb->nb_flags & NBD_FLAG_READ_ONLY) {
+		errno = EROFS;
+		return (-1);
+	}
+	return (nbd_rw(nb, iov, iovcnt, off, NBD_CMD_WRITE));
+}
+
+static int
+nbd_flush(void *arg)
+{
+	struct nbd *nb;
+
+	nb = arg;
+	if (!(nb->nb_flags & NBD_FLAG_SEND_FLUSH))
+		return (0);
+	return (nbd_cmd(nb, NBD_CMD_FLUSH, 0, 0, NULL, 0));
+}
+
+static int
+nbd_delete(void *arg, off_t off, off_t len)
+{
+	struct nbd *nb;
+	off_t n;
+	int err;
+
+	nb = arg;
+	for (; len > 0; off += n, len -= n) {
+		n = MIN(len, (off_t) (UINT32_MAX & ~0xfffU));
+		if ((err = nbd_cmd(nb, NBD_CMD_TRIM, off, (size_t) n, NULL,
+		    0)) != 0)
+			return (err);
+	}
+	return (0);
+}
+
+static int
+nbd_match(const char *path)
+{
+	return (strncmp(path, "nbd://", 6) == 0 ||
+	    strncmp(path, "nbd+unix://", 11) == 0);
+}
+
+/*
+ * Connect to the server named by path, and point *export at the export
+ * name within it. Returns the socket, or -1 with a message printed.
+ */
+static int
+nbd_connect(const char *path, char *buf, size_t buflen, const char **export)
+{
+	struct addrinfo hints, *ai, *res;
+	struct sockaddr_un sun;
+	char *host, *port, *sock;
+	int fd, err, one;
+
+	strlcpy(buf, path, buflen);
+	if (strncmp(buf, "nbd+unix://", 11) == 0) {
+		host = buf + 11;
+		if ((sock = strstr(host, "?socket=")) == NULL) {
+			fprintf(stderr, "%s: no socket given\n", path);
+			return (-1);
+		}
+		*sock = '\0';
+		sock += 8;
+		*export = *host == '/' ? host + 1 : host;
+		if (strlen(sock) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "%s: socket path too long\n", path);
+			return (-1);
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strlcpy(sun.sun_path, sock, sizeof(sun.sun_path));
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		    connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			if (fd >= 0)
+				close(fd);
+			return (-1);
+		}
+		return (fd);
+	}
+
+	host = buf + 6;
+	*export = "";
+	if ((sock = strchr(host, '/')) != NULL) {
+		*sock = '\0';
+		*export = sock + 1;
+	}
+	if (*host == '[' && (port = strchr(host, ']')) != NULL) {
+		/* [v6 address] */
+		*port++ = '\0';
+		host++;
+		port = *port == ':' ? port + 1 : NULL;
+	} else if ((port = strrchr(host, ':')) != NULL)
+		*port++ = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((err = getaddrinfo(host, port != NULL ? port : NBD_DEFPORT, &hints,
+	    &res)) != 0) {
+		fprintf(stderr, "%s: %s\n", path, gai_strerror(err));
+		return (-1);
+	}
+	fd = -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+		    ai->ai_protocol)) < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		err = errno;
+		close(fd);
+		fd = -1;
+		errno = err;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return (-1);
+	}
+	/* Requests are small and latency bound */
+	one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return (fd);
+}
+
+/*
+ * The fixed newstyle handshake. Returns 0, or -1 with a message printed.
+ */
+static int
+nbd_handshake(struct nbd *nb, const char *path, const char *export)
+{
+	uint8_t buf[128];
+	uint16_t hflags;
+	uint32_t cflags;
+	size_t len;
+
+	if (nbd_read(nb->nb_fd, buf, 18) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return (-1);
+	}
+	if (nbd_dec64(buf) != NBD_MAGIC || nbd_dec64(buf + 8) != NBD_OPTMAGIC) {
+		fprintf(stderr, "%s: not a newstyle NBD server\n", path);
+		return (-1);
+	}
+	hflags = nbd_dec16(buf + 16);
+	cflags = hflags & (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+
+	len = strlen(export);
+	nbd_enc32(buf, cflags);
+	nbd_enc64(buf + 4, NBD_OPTMAGIC);
+	nbd_enc32(buf + 12, NBD_OPT_EXPORT_NAME);
+	nbd_enc32(buf + 16, (uint32_t) len);
+	if (nbd_write(nb->nb_fd, buf, 20) < 0 ||
+	    nbd_write(nb->nb_fd, export, len) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return (-1);
+	}
+
+	/* The server hangs up on an unknown export */
+	if (nbd_read(nb->nb_fd, buf, 10) < 0) {
+		fprintf(stderr, "%s: export \"%s\" refused\n", path, export);
+		return (-1);
+	}
+	nb->nb_size = (off_t) nbd_dec64(buf);
+	nb->nb_flags = nbd_dec16(buf + 8);
+	if (!(nb->nb_flags & NBD_FLAG_HAS_FLAGS))
+		nb->nb_flags = 0;
+	if (!(cflags & NBD_FLAG_NO_ZEROES) && nbd_read(nb->nb_fd, buf, 124) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return (-1);
+	}
+	return (0);
+}
+
+static void *
+nbd_open(const char *path, UNUSED int fd, struct blockif_binfo *bi)
+{
+	char buf[MAXPATHLEN];
+	const char *export;
+	struct nbd *nb;
+	int i;
+
+	nb = calloc(1, sizeof(struct nbd));
+	if (nb == NULL) {
+		perror("calloc");
+		return (NULL);
+	}
+	if ((nb->nb_fd = nbd_connect(path, buf, sizeof(buf), &export)) < 0) {
+		free(nb);
+		return (NULL);
+	}
+#ifdef SO_NOSIGPIPE
+	i = 1;
+	setsockopt(nb->nb_fd, SOL_SOCKET, SO_NOSIGPIPE, &i, sizeof(i));
+#endif
+	if (nbd_handshake(nb, path, export) != 0) {
+		close(nb->nb_fd);
+		free(nb);
+		return (NULL);
+	}
+
+	pthread_mutex_init(&nb->nb_wmtx, NULL);
+	pthread_mutex_init(&nb->nb_mtx, NULL);
+	pthread_cond_init(&nb->nb_cond, NULL);
+	for (i = 0; i < NBD_NREQ; i++)
+		pthread_cond_init(&nb->nb_req[i].nr_cond, NULL);
+	pthread_create(&nb->nb_tid, NULL, nbd_thr, nb);
+
+	bi->bi_size = nb->nb_size;
+	if (nb->nb_flags & NBD_FLAG_READ_ONLY)
+		bi->bi_rdonly = 1;
+	bi->bi_candelete = !bi->bi_rdonly &&
+		(nb->nb_flags & NBD_FLAG_SEND_TRIM) != 0;
+	bi->bi_blksz = 4096;
+	return (nb);
+}
+
+static void
+nbd_close(void *arg)
+{
+	uint8_t req[NBD_REQSZ];
+	struct nbd *nb;
+	int i;
+
+	nb = arg;
+	pthread_mutex_lock(&nb->nb_mtx);
+	nb->nb_dead = 1;
+	pthread_mutex_unlock(&nb->nb_mtx);
+	memset(req, 0, sizeof(req));
+	nbd_enc32(req, NBD_REQMAGIC);
+	nbd_enc16(req + 6, NBD_CMD_DISC);
+	pthread_mutex_lock(&nb->nb_wmtx);
+	(void) nbd_write(nb->nb_fd, req, sizeof(req));
+	pthread_mutex_unlock(&nb->nb_wmtx);
+	shutdown(nb->nb_fd, SHUT_RDWR);
+	pthread_join(nb->nb_tid, NULL);
+	close(nb->nb_fd);
+	for (i = 0; i < NBD_NREQ; i++)
+		pthread_cond_destroy(&nb->nb_req[i].nr_cond);
+	pthread_cond_destroy(&nb->nb_cond);
+	pthread_mutex_destroy(&nb->nb_mtx);
+	pthread_mutex_destroy(&nb->nb_wmtx);
+	free(nb);
+}
+
+const struct blockif_backend blockif_nbd_backend = {
+	.bb_name = "nbd",
+	.bb_match = nbd_match,
+	.bb_probe = NULL,
+	.bb_open = nbd_open,
+	.bb_preadv = nbd_preadv,
+	.bb_pwritev = nbd_pwritev,
+	.bb_flush = nbd_flush,
+	.bb_delete = nbd_delete,
+	.bb_close = nbd_close
+};
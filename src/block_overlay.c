@@ -0,0 +1,662 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Copy-on-write overlay images.
+ *
+ * An overlay starts with a header naming a read-only backing image, which
+ * may itself be an overlay. Whether it is one is found out once, when the
+ * overlay is created, and recorded in the header: a raw backing image is
+ * never probed, since its first sector could hold anything. The header is
+ * followed by a cluster table with one little-endian 64-bit entry per
+ * cluster of the virtual disk: zero if the cluster still lives in the
+ * backing image, otherwise the offset of its data in the overlay file. A
+ * cluster is appended to the overlay on its first write, so a new overlay
+ * costs a header and a sparse table whatever the size of the disk.
+ *
+ * A newly allocated cluster is only entered in the in-core table when it
+ * is written. Its on-disk entry is written at the next flush, after the
+ * cluster data has been synced, and is synced in turn before the flush
+ * completes. A crash can leak a cluster or lose writes that were never
+ * flushed, but never expose a cluster whose data did not reach the disk.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_backend.h>
+
+#define OVL_MAGIC "XHYVEOVL"
+#define OVL_VERSION 2
+#define OVL_HDRSZ 4096
+#define OVL_PATHLEN 1024
+#define OVL_CSHIFT 16		/* 64 KiB clusters */
+#define OVL_MINCSHIFT 12
+#define OVL_MAXCSHIFT 24
+#define OVL_MAXDEPTH 16		/* longest chain of backing overlays */
+#define OVL_PENDING 1		/* in-core entry of a cluster being copied */
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpacked"
+struct ovl_header {
+	char oh_magic[8];
+	uint32_t oh_version;
+	uint32_t oh_cshift;			/* log2 of the cluster size */
+	uint64_t oh_size;			/* virtual disk size */
+	uint64_t oh_table;			/* file offset of the table */
+	char oh_backing[OVL_PATHLEN];		/* empty for a blank disk */
+	uint32_t oh_flags;			/* OVL_F_* */
+} __packed;
+
+#define OVL_F_BACKOVL 0x1		/* the backing is an overlay */
+#pragma clang diagnostic pop
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct ovl {
+	int ov_fd;
+	int ov_rdonly;
+	off_t ov_size;
+	unsigned ov_cshift;
+	off_t ov_csize;
+	uint64_t ov_nclust;
+	uint64_t *ov_table;
+	off_t ov_tableoff;
+	off_t ov_end;			/* where the next cluster goes */
+	pthread_mutex_t ov_mtx;		/* table, ov_end and ov_unpub */
+	pthread_cond_t ov_cond;		/* a pending cluster was copied */
+	uint64_t *ov_unpub;		/* clusters not yet in the file's table */
+	size_t ov_nunpub;
+	size_t ov_maxunpub;
+	pthread_mutex_t ov_flmtx;	/* one flush at a time */
+	struct ovl *ov_parent;		/* backing overlay */
+	int ov_bfd;			/* or backing raw image */
+	off_t ov_bsize;
+};
+#pragma clang diagnostic pop
+
+static ssize_t ovl_preadv(void *arg, const struct iovec *iov, int iovcnt,
+	off_t off);
+
+static int
+ovl_probe(int fd)
+{
+	char magic[8];
+
+	return (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+	    memcmp(magic, OVL_MAGIC, sizeof(magic)) == 0);
+}
+
+static void
+ovl_free(struct ovl *ov)
+{
+	if (ov->ov_parent != NULL)
+		ovl_free(ov->ov_parent);
+	if (ov->ov_bfd >= 0)
+		close(ov->ov_bfd);
+	if (ov->ov_fd >= 0)
+		close(ov->ov_fd);
+	pthread_cond_destroy(&ov->ov_cond);
+	pthread_mutex_destroy(&ov->ov_flmtx);
+	pthread_mutex_destroy(&ov->ov_mtx);
+	free(ov->ov_unpub);
+	free(ov->ov_table);
+	free(ov);
+}
+
+static struct ovl *
+ovl_load(const char *path, int fd, int ro, int depth)
+{
+	struct ovl_header oh;
+	char bpath[MAXPATHLEN], dir[MAXPATHLEN];
+	struct stat sbuf;
+	struct ovl *ov;
+	uint64_t ci;
+	size_t tlen;
+	int bfd;
+
+	if (pread(fd, &oh, sizeof(oh), 0) != sizeof(oh) ||
+	    memcmp(oh.oh_magic, OVL_MAGIC, sizeof(oh.oh_magic)) != 0) {
+		fprintf(stderr, "%s: not an overlay image\n", path);
+		return (NULL);
+	}
+	if (oh.oh_version != OVL_VERSION) {
+		fprintf(stderr, "%s: unsupported overlay version %u\n", path,
+		    oh.oh_version);
+		return (NULL);
+	}
+	if (oh.oh_cshift < OVL_MINCSHIFT || oh.oh_cshift > OVL_MAXCSHIFT) {
+		fprintf(stderr, "%s: unsupported cluster size 2^%u\n", path,
+		    oh.oh_cshift);
+		return (NULL);
+	}
+	oh.oh_backing[OVL_PATHLEN - 1] = '\0';
+
+	ov = calloc(1, sizeof(struct ovl));
+	if (ov == NULL) {
+		perror("calloc");
+		return (NULL);
+	}
+	pthread_mutex_init(&ov->ov_mtx, NULL);
+	pthread_mutex_init(&ov->ov_flmtx, NULL);
+	pthread_cond_init(&ov->ov_cond, NULL);
+	ov->ov_fd = fd;
+	ov->ov_bfd = -1;
+	ov->ov_rdonly = ro;
+	ov->ov_size = (off_t) oh.oh_size;
+	ov->ov_cshift = oh.oh_cshift;
+	ov->ov_csize = ((off_t) 1) << oh.oh_cshift;
+	ov->ov_nclust = (oh.oh_size + ((uint64_t) ov->ov_csize) - 1) >>
+		oh.oh_cshift;
+	ov->ov_tableoff = (off_t) oh.oh_table;
+
+	tlen = ((size_t) ov->ov_nclust) * sizeof(uint64_t);
+	ov->ov_table = malloc(tlen);
+	if (ov->ov_table == NULL) {
+		perror("malloc");
+		goto fail;
+	}
+	if (pread(fd, ov->ov_table, tlen, ov->ov_tableoff) != (ssize_t) tlen) {
+		fprintf(stderr, "%s: truncated cluster table\n", path);
+		goto fail;
+	}
+	for (ci = 0; ci < ov->ov_nclust; ci++)
+		if ((ov->ov_table[ci] & ((uint64_t) ov->ov_csize - 1)) != 0) {
+			fprintf(stderr, "%s: corrupt cluster table\n", path);
+			goto fail;
+		}
+	if (fstat(fd, &sbuf) < 0) {
+		perror("fstat");
+		goto fail;
+	}
+	ov->ov_end = roundup2(MAX(sbuf.st_size,
+		ov->ov_tableoff + ((off_t) tlen)), ov->ov_csize);
+
+	if (oh.oh_backing[0] == '\0')
+		return (ov);
+	if (oh.oh_backing[0] == '/')
+		strlcpy(bpath, oh.oh_backing, sizeof(bpath));
+	else {
+		/* Relative to the directory of the overlay */
+		strlcpy(dir, path, sizeof(dir));
+		snprintf(bpath, sizeof(bpath), "%s/%s", dirname(dir),
+		    oh.oh_backing);
+	}
+	if ((bfd = open(bpath, O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: cannot open backing image %s: %s\n", path,
+		    bpath, strerror(errno));
+		goto fail;
+	}
+	if (oh.oh_flags & OVL_F_BACKOVL) {
+		if (depth >= OVL_MAXDEPTH) {
+			fprintf(stderr, "%s: too many backing images\n", path);
+			close(bfd);
+			goto fail;
+		}
+		ov->ov_parent = ovl_load(bpath, bfd, 1, depth + 1);
+		if (ov->ov_parent == NULL) {
+			close(bfd);
+			goto fail;
+		}
+	} else {
+		if (fstat(bfd, &sbuf) < 0) {
+			perror("fstat");
+			close(bfd);
+			goto fail;
+		}
+		ov->ov_bfd = bfd;
+		ov->ov_bsize = sbuf.st_size;
+	}
+	return (ov);
+
+fail:
+	/* The descriptor still belongs to the caller */
+	ov->ov_fd = -1;
+	ovl_free(ov);
+	return (NULL);
+}
+
+/*
+ * Zero an iovec array from skip bytes in to its end.
+ */
+static void
+ovl_iov_zero(const struct iovec *iov, int iovcnt, size_t skip)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		memset(((uint8_t *) iov[i].iov_base) + skip, 0,
+			iov[i].iov_len - skip);
+		skip = 0;
+	}
+}
+
+/*
+ * Read from the backing image. Whatever lies past its end reads as zeroes,
+ * as does everything if there is no backing image.
+ */
+static ssize_t
+ovl_backing_readv(struct ovl *ov, const struct iovec *iov, int iovcnt,
+	off_t off)
+{
+	ssize_t n;
+
+	if (ov->ov_parent != NULL)
+		n = ovl_preadv(ov->ov_parent, iov, iovcnt, off);
+	else if (ov->ov_bfd >= 0 && off < ov->ov_bsize)
+		n = blockif_preadv(ov->ov_bfd, iov, iovcnt, off);
+	else
+		n = 0;
+	if (n < 0)
+		return (-1);
+	ovl_iov_zero(iov, iovcnt, (size_t) n);
+	return ((ssize_t) blockif_iov_len(iov, iovcnt));
+}
+
+/*
+ * The table entry of cluster ci. A cluster still being copied lives in the
+ * backing image until its copy is written.
+ */
+static inline uint64_t
+ovl_entry(struct ovl *ov, uint64_t ci)
+{
+	uint64_t ent;
+
+	ent = ov->ov_table[ci];
+	return (ent == OVL_PENDING ? 0 : ent);
+}
+
+/*
+ * Map off to the overlay file. *len is trimmed to the run of clusters that
+ * are either all unallocated or stored back to back in the file. Returns
+ * the file offset, or 0 for unallocated clusters.
+ */
+static off_t
+ovl_map(struct ovl *ov, off_t off, size_t *len)
+{
+	uint64_t ci, next, ent;
+	off_t coff, n;
+
+	ci = ((uint64_t) off) >> ov->ov_cshift;
+	coff = off & (ov->ov_csize - 1);
+	n = ov->ov_csize - coff;
+
+	pthread_mutex_lock(&ov->ov_mtx);
+	ent = ovl_entry(ov, ci);
+	for (next = ci + 1; n < (off_t) *len && next < ov->ov_nclust; next++) {
+		if (ovl_entry(ov, next) != (ent == 0 ? 0 :
+		    ent + ((next - ci) << ov->ov_cshift)))
+			break;
+		n += ov->ov_csize;
+	}
+	pthread_mutex_unlock(&ov->ov_mtx);
+
+	*len = MIN(*len, (size_t) n);
+	return (ent == 0 ? 0 : ((off_t) ent) + coff);
+}
+
+static ssize_t
+ovl_preadv(void *arg, const struct iovec *iov, int iovcnt, off_t off)
+{
+	struct iovec siov[BLOCKIF_BACKEND_IOV];
+	struct ovl *ov;
+	size_t done, len, n;
+	ssize_t ret;
+	off_t pos;
+	int scnt;
+
+	ov = arg;
+	if (off >= ov->ov_size)
+		return (0);
+	len = MIN(blockif_iov_len(iov, iovcnt), (size_t) (ov->ov_size - off));
+	for (done = 0; done < len; done += n) {
+		n = len - done;
+		pos = ovl_map(ov, off + ((off_t) done), &n);
+		scnt = blockif_iov_slice(iov, iovcnt, done, n, siov);
+		if (pos == 0)
+			ret = ovl_backing_readv(ov, siov, scnt,
+				off + ((off_t) done));
+		else
+			ret = blockif_preadv(ov->ov_fd, siov, scnt, pos);
+		if (ret < 0)
+			return (-1);
+		ovl_iov_zero(siov, scnt, (size_t) ret);
+	}
+	return ((ssize_t) len);
+}
+
+/*
+ * Remember that cluster ci has to be entered in the file's table at the
+ * next flush. Called with ov_mtx held.
+ */
+static int
+ovl_unpub_add(struct ovl *ov, uint64_t ci)
+{
+	uint64_t *unpub;
+	size_t max;
+
+	if (ov->ov_nunpub == ov->ov_maxunpub) {
+		max = MAX(ov->ov_maxunpub * 2, 64);
+		unpub = realloc(ov->ov_unpub, max * sizeof(uint64_t));
+		if (unpub == NULL)
+			return (ENOMEM);
+		ov->ov_unpub = unpub;
+		ov->ov_maxunpub = max;
+	}
+	ov->ov_unpub[ov->ov_nunpub++] = ci;
+	return (0);
+}
+
+/*
+ * First write to an unallocated cluster. The cluster is assembled from the
+ * backing image and the new data, appended to the overlay, and entered in
+ * the in-core table; ovl_flush() writes the entry out. ov_mtx is only held
+ * to claim the cluster and to publish it: other writes to the cluster wait
+ * on ov_cond meanwhile, and everything else goes on.
+ */
+static ssize_t
+ovl_cow(struct ovl *ov, off_t off, const struct iovec *iov, int iovcnt,
+	size_t len)
+{
+	struct iovec biov;
+	uint64_t ci, ent;
+	off_t base, coff, pos;
+	uint8_t *buf;
+	size_t boff;
+	ssize_t ret;
+	int err, i;
+
+	ci = ((uint64_t) off) >> ov->ov_cshift;
+	base = (off_t) (ci << ov->ov_cshift);
+	coff = off - base;
+
+	pthread_mutex_lock(&ov->ov_mtx);
+	while (ov->ov_table[ci] == OVL_PENDING)
+		pthread_cond_wait(&ov->ov_cond, &ov->ov_mtx);
+	if ((ent = ov->ov_table[ci]) != 0) {
+		/* A write to another part of the cluster got here first */
+		pthread_mutex_unlock(&ov->ov_mtx);
+		return (blockif_pwritev(ov->ov_fd, iov, iovcnt,
+			((off_t) ent) + coff));
+	}
+	ov->ov_table[ci] = OVL_PENDING;
+	pos = ov->ov_end;
+	ov->ov_end += ov->ov_csize;
+	pthread_mutex_unlock(&ov->ov_mtx);
+
+	ent = 0;
+	if ((buf = malloc((size_t) ov->ov_csize)) == NULL)
+		goto done;
+	biov.iov_base = buf;
+	biov.iov_len = (size_t) ov->ov_csize;
+	if (coff != 0 || ((off_t) len) != ov->ov_csize) {
+		if (ovl_backing_readv(ov, &biov, 1, base) < 0)
+			goto done;
+	}
+	for (i = 0, boff = (size_t) coff; i < iovcnt; i++) {
+		memcpy(buf + boff, iov[i].iov_base, iov[i].iov_len);
+		boff += iov[i].iov_len;
+	}
+
+	ret = blockif_pwritev(ov->ov_fd, &biov, 1, pos);
+	if (ret != (ssize_t) ov->ov_csize) {
+		if (ret >= 0)
+			errno = EIO;
+		goto done;
+	}
+	ent = (uint64_t) pos;
+
+done:
+	/* On failure the cluster is leaked, and the next write retries */
+	err = errno;
+	free(buf);
+	pthread_mutex_lock(&ov->ov_mtx);
+	if (ent != 0 && (err = ovl_unpub_add(ov, ci)) != 0)
+		ent = 0;
+	ov->ov_table[ci] = ent;
+	pthread_mutex_unlock(&ov->ov_mtx);
+	pthread_cond_broadcast(&ov->ov_cond);
+	if (ent == 0) {
+		errno = err;
+		return (-1);
+	}
+	return ((ssize_t) len);
+}
+
+static ssize_t
+ovl_pwritev(void *arg, const struct iovec *iov, int iovcnt, off_t off)
+{
+	struct iovec siov[BLOCKIF_BACKEND_IOV];
+	struct ovl *ov;
+	size_t done, len, n;
+	ssize_t ret;
+	off_t pos;
+	int scnt;
+
+	ov = arg;
+	if (ov->ov_rdonly) {
+		errno = EROFS;
+		return (-1);
+	}
+	if (off >= ov->ov_size)
+		return (0);
+	len = MIN(blockif_iov_len(iov, iovcnt), (size_t) (ov->ov_size - off));
+	for (done = 0; done < len; done += n) {
+		n = len - done;
+		pos = ovl_map(ov, off + ((off_t) done), &n);
+		if (pos == 0)
+			n = MIN(n, (size_t) (ov->ov_csize -
+				((off + ((off_t) done)) & (ov->ov_csize - 1))));
+		scnt = blockif_iov_slice(iov, iovcnt, done, n, siov);
+		if (pos == 0)
+			ret = ovl_cow(ov, off + ((off_t) done), siov, scnt, n);
+		else
+			ret = blockif_pwritev(ov->ov_fd, siov, scnt, pos);
+		if (ret < 0)
+			return (-1);
+		if ((size_t) ret != n) {
+			errno = EIO;
+			return (-1);
+		}
+	}
+	return ((ssize_t) len);
+}
+
+/*
+ * Sync the data of the clusters allocated since the last flush, then
+ * write their table entries and sync those. Entries that could not be
+ * written stay queued for the next flush.
+ */
+static int
+ovl_flush(void *arg)
+{
+	struct ovl *ov;
+	uint64_t *unpub, ent;
+	size_t i, n, max;
+	ssize_t ret;
+	int err;
+
+	ov = arg;
+	pthread_mutex_lock(&ov->ov_flmtx);
+	pthread_mutex_lock(&ov->ov_mtx);
+	unpub = ov->ov_unpub;
+	n = ov->ov_nunpub;
+	max = ov->ov_maxunpub;
+	ov->ov_unpub = NULL;
+	ov->ov_nunpub = ov->ov_maxunpub = 0;
+	pthread_mutex_unlock(&ov->ov_mtx);
+
+	err = fsync(ov->ov_fd) < 0 ? errno : 0;
+	for (i = 0; i < n && err == 0; i++) {
+		/* Allocated entries never change */
+		pthread_mutex_lock(&ov->ov_mtx);
+		ent = ov->ov_table[unpub[i]];
+		pthread_mutex_unlock(&ov->ov_mtx);
+		ret = pwrite(ov->ov_fd, &ent, sizeof(ent), ov->ov_tableoff +
+		    ((off_t) (unpub[i] * sizeof(ent))));
+		if (ret != sizeof(ent))
+			err = ret < 0 ? errno : EIO;
+	}
+	if (n > 0 && err == 0 && fsync(ov->ov_fd) < 0)
+		err = errno;
+
+	if (err != 0) {
+		/* Rewriting entries that did make it is harmless */
+		pthread_mutex_lock(&ov->ov_mtx);
+		if (ov->ov_unpub == NULL) {
+			ov->ov_unpub = unpub;
+			ov->ov_nunpub = n;
+			ov->ov_maxunpub = max;
+			unpub = NULL;
+		} else {
+			for (i = 0; i < n; i++)
+				if (ovl_unpub_add(ov, unpub[i]) != 0)
+					break;
+		}
+		pthread_mutex_unlock(&ov->ov_mtx);
+	}
+	free(unpub);
+	pthread_mutex_unlock(&ov->ov_flmtx);
+	return (err);
+}
+
+static void *
+ovl_open(const char *path, int fd, struct blockif_binfo *bi)
+{
+	struct ovl *ov;
+
+	ov = ovl_load(path, fd, bi->bi_rdonly, 0);
+	if (ov == NULL)
+		return (NULL);
+	bi->bi_size = ov->ov_size;
+	bi->bi_candelete = 0;
+	return (ov);
+}
+
+static void
+ovl_close(void *arg)
+{
+	struct ovl *ov;
+	int err;
+
+	ov = arg;
+	if (!ov->ov_rdonly && (err = ovl_flush(ov)) != 0)
+		fprintf(stderr, "overlay: could not write the cluster table: "
+		    "%s\n", strerror(err));
+	ovl_free(ov);
+}
+
+/*
+ * Create an overlay at path on top of backing. The cluster table is left
+ * as a hole, so this takes the same time for any size of disk. The user
+ * named the backing image, so this is where it is probed for being an
+ * overlay itself.
+ */
+int
+blockif_overlay_create(const char *path, const char *backing)
+{
+	struct ovl_header oh;
+	char bpath[MAXPATHLEN];
+	struct stat sbuf;
+	uint64_t size;
+	uint32_t flags;
+	off_t tlen;
+	int err, fd;
+
+	if (realpath(backing, bpath) == NULL)
+		return (errno);
+	if (strlen(bpath) >= OVL_PATHLEN)
+		return (ENAMETOOLONG);
+	if ((fd = open(bpath, O_RDONLY)) < 0)
+		return (errno);
+	flags = 0;
+	if (ovl_probe(fd)) {
+		if (pread(fd, &oh, sizeof(oh), 0) != sizeof(oh)) {
+			close(fd);
+			return (EINVAL);
+		}
+		size = oh.oh_size;
+		flags = OVL_F_BACKOVL;
+	} else if (fstat(fd, &sbuf) == 0)
+		size = (uint64_t) sbuf.st_size;
+	else {
+		err = errno;
+		close(fd);
+		return (err);
+	}
+	close(fd);
+
+	memset(&oh, 0, sizeof(oh));
+	memcpy(oh.oh_magic, OVL_MAGIC, sizeof(oh.oh_magic));
+	oh.oh_version = OVL_VERSION;
+	oh.oh_cshift = OVL_CSHIFT;
+	oh.oh_size = size;
+	oh.oh_table = OVL_HDRSZ;
+	strlcpy(oh.oh_backing, bpath, sizeof(oh.oh_backing));
+	oh.oh_flags = flags;
+	tlen = (off_t) (((size + (1 << OVL_CSHIFT) - 1) >> OVL_CSHIFT) *
+		sizeof(uint64_t));
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+		return (errno);
+	if (pwrite(fd, &oh, sizeof(oh), 0) != sizeof(oh) ||
+	    ftruncate(fd, OVL_HDRSZ + tlen) < 0 || fsync(fd) < 0) {
+		err = errno;
+		close(fd);
+		unlink(path);
+		return (err);
+	}
+	close(fd);
+	return (0);
+}
+
+const struct blockif_backend blockif_overlay_backend = {
+	.bb_name = "overlay",
+	.bb_match = NULL,
+	.bb_probe = ovl_probe,
+	.bb_open = ovl_open,
+	.bb_preadv = ovl_preadv,
+	.bb_pwritev = ovl_pwritev,
+	.bb_flush = ovl_flush,
+	.bb_delete = NULL,
+	.bb_close = ovl_close
+};
@@ -0,0 +1,285 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Scratch disks held in memory, named as
+ *
+ *	ram:size[:tag]
+ *
+ * where size takes a k, m, g or t suffix and the tag tells apart disks of
+ * the same size. The disk starts out zeroed and its contents are lost when
+ * xhyve exits.
+ *
+ * The disk is one anonymous mapping, backed by 2 MiB superpages when the
+ * kernel can supply them, which are allocated up front and stay resident,
+ * and otherwise by ordinary pages, allocated as they are first written.
+ * Requests are a memcpy and never block, so blockif may run them in the
+ * submitter's thread.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mach/vm_statistics.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_backend.h>
+
+#define RAM_PREFIX "ram:"
+#define RAM_SUPERPAGE (2 * 1024 * 1024)
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct ram {
+	uint8_t *rd_base;
+	size_t rd_maplen;
+	off_t rd_size;
+	int rd_super;		/* superpages, which are never given back */
+};
+#pragma clang diagnostic pop
+
+/*
+ * Parse the size of a ram: path. Returns it, or 0 if it is not a whole
+ * number of sectors.
+ */
+static off_t
+ram_size(const char *path)
+{
+	unsigned long long n;
+	char *end;
+	int shift;
+
+	errno = 0;
+	n = strtoull(path + strlen(RAM_PREFIX), &end, 0);
+	if (errno != 0 || end == path + strlen(RAM_PREFIX))
+		return (0);
+	switch (*end) {
+	case 't': case 'T':
+		shift = 40;
+		break;
+	case 'g': case 'G':
+		shift = 30;
+		break;
+	case 'm': case 'M':
+		shift = 20;
+		break;
+	case 'k': case 'K':
+		shift = 10;
+		break;
+	default:
+		shift = 0;
+		break;
+	}
+	if (shift != 0)
+		end++;
+	if (*end != '\0' && *end != ':')
+		return (0);
+	if (n == 0 || n > (((unsigned long long) INT64_MAX) >> shift))
+		return (0);
+	n <<= shift;
+	if (n % 512 != 0)
+		return (0);
+	return ((off_t) n);
+}
+
+/*
+ * Clip a transfer to the end of the disk. Returns the bytes to move, or
+ * -1 with errno set.
+ */
+static ssize_t
+ram_clip(struct ram *rd, const struct iovec *iov, int iovcnt, off_t off)
+{
+	size_t len;
+
+	if (off < 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (off >= rd->rd_size)
+		return (0);
+	len = blockif_iov_len(iov, iovcnt);
+	return ((ssize_t) MIN(len, (size_t) (rd->rd_size - off)));
+}
+
+static ssize_t
+ram_preadv(void *arg, const struct iovec *iov, int iovcnt, off_t off)
+{
+	struct ram *rd;
+	const uint8_t *p;
+	ssize_t len;
+	size_t n, left;
+	int i;
+
+	rd = arg;
+	if ((len = ram_clip(rd, iov, iovcnt, off)) <= 0)
+		return (len);
+	p = rd->rd_base + off;
+	left = (size_t) len;
+	for (i = 0; i < iovcnt && left > 0; i++) {
+		n = MIN(iov[i].iov_len, left);
+		memcpy(iov[i].iov_base, p, n);
+		p += n;
+		left -= n;
+	}
+	return (len);
+}
+
+static ssize_t
+ram_pwritev(void *arg, const struct iovec *iov, int iovcnt, off_t off)
+{
+	struct ram *rd;
+	uint8_t *p;
+	ssize_t len;
+	size_t n, left;
+	int i;
+
+	rd = arg;
+	if ((len = ram_clip(rd, iov, iovcnt, off)) <= 0)
+		return (len);
+	p = rd->rd_base + off;
+	left = (size_t) len;
+	for (i = 0; i < iovcnt && left > 0; i++) {
+		n = MIN(iov[i].iov_len, left);
+		memcpy(p, iov[i].iov_base, n);
+		p += n;
+		left -= n;
+	}
+	return (len);
+}
+
+static int
+ram_flush(UNUSED void *arg)
+{
+	return (0);
+}
+
+/*
+ * Zero a range. Whole ordinary pages are replaced with fresh ones, which
+ * also gives the memory back; anything else is cleared in place.
+ */
+static int
+ram_delete(void *arg, off_t off, off_t len)
+{
+	struct ram *rd;
+	size_t pgsz;
+	off_t end, aoff, aend;
+
+	rd = arg;
+	end = MIN(off + len, rd->rd_size);
+	if (off >= end)
+		return (0);
+	pgsz = (size_t) getpagesize();
+	aoff = roundup2(off, (off_t) pgsz);
+	aend = end & ~((off_t) pgsz - 1);
+	if (rd->rd_super || aoff >= aend ||
+	    mmap(rd->rd_base + aoff, (size_t) (aend - aoff),
+	    PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_FIXED, -1,
+	    0) == MAP_FAILED) {
+		memset(rd->rd_base + off, 0, (size_t) (end - off));
+		return (0);
+	}
+	memset(rd->rd_base + off, 0, (size_t) (aoff - off));
+	memset(rd->rd_base + aend, 0, (size_t) (end - aend));
+	return (0);
+}
+
+static int
+ram_match(const char *path)
+{
+	return (strncmp(path, RAM_PREFIX, strlen(RAM_PREFIX)) == 0);
+}
+
+static void *
+ram_open(const char *path, UNUSED int fd, struct blockif_binfo *bi)
+{
+	struct ram *rd;
+	void *base;
+
+	rd = calloc(1, sizeof(struct ram));
+	if (rd == NULL) {
+		perror("calloc");
+		return (NULL);
+	}
+	if ((rd->rd_size = ram_size(path)) == 0) {
+		fprintf(stderr, "%s: size must be a non-zero multiple of "
+		    "512 bytes\n", path);
+		free(rd);
+		return (NULL);
+	}
+	rd->rd_maplen = roundup2((size_t) rd->rd_size, RAM_SUPERPAGE);
+	base = MAP_FAILED;
+#ifdef VM_FLAGS_SUPERPAGE_SIZE_2MB
+	/* On macOS the descriptor argument of an anonymous mapping is flags */
+	base = mmap(NULL, rd->rd_maplen, PROT_READ | PROT_WRITE,
+		MAP_ANON | MAP_PRIVATE, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+	rd->rd_super = (base != MAP_FAILED);
+#endif
+	if (base == MAP_FAILED)
+		base = mmap(NULL, rd->rd_maplen, PROT_READ | PROT_WRITE,
+			MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		free(rd);
+		return (NULL);
+	}
+	rd->rd_base = base;
+
+	bi->bi_size = rd->rd_size;
+	bi->bi_candelete = !bi->bi_rdonly;
+	bi->bi_blksz = getpagesize();
+	bi->bi_inline = 1;
+	return (rd);
+}
+
+static void
+ram_close(void *arg)
+{
+	struct ram *rd;
+
+	rd = arg;
+	munmap(rd->rd_base, rd->rd_maplen);
+	free(rd);
+}
+
+const struct blockif_backend blockif_ram_backend = {
+	.bb_name = "ram",
+	.bb_match = ram_match,
+	.bb_probe = NULL,
+	.bb_open = ram_open,
+	.bb_preadv = ram_preadv,
+	.bb_pwritev = ram_pwritev,
+	.bb_flush = ram_flush,
+	.bb_delete = ram_delete,
+	.bb_close = ram_close
+};
@@ -0,0 +1,440 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Disks striped across several raw files, typically on different volumes,
+ * named as
+ *
+ *	stripe:descriptor
+ *
+ * where the descriptor is a small text file:
+ *
+ *	xhyve-stripe 131072
+ *	/Volumes/a/disk.0
+ *	/Volumes/b/disk.1
+ *
+ * The number on the first line is the stripe size in bytes. Stripe i of
+ * the disk is stripe i / n of file i % n, and the disk is n times the size
+ * of the smallest file, rounded down to whole stripes. Relative paths are
+ * taken from the directory of the descriptor. The files are opened for
+ * writing, so a descriptor is only ever read when the user names it with
+ * the prefix, never recognized by its contents.
+ *
+ * A request is split into one part per file, each a single preadv/pwritev
+ * since consecutive stripes of one file are contiguous in it. The calling
+ * thread issues one part itself and hands the others to a pool of helper
+ * threads, then waits for all of them.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_backend.h>
+
+#define STRIPE_PREFIX "stripe:"
+#define STRIPE_MAGIC "xhyve-stripe"
+#define STRIPE_MAXFILES 16
+#define STRIPE_MINSIZE 4096
+#define STRIPE_THREADS 4	/* helper threads per file */
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+/* The i/o for one call, and what is left of it */
+struct stripe_io {
+	int si_pending;
+	int si_err;
+	pthread_cond_t si_cond;
+};
+
+/* The slice of a call that falls on one file */
+struct stripe_part {
+	TAILQ_ENTRY(stripe_part) sp_link;
+	struct stripe_io *sp_io;
+	int sp_fd;
+	int sp_wr;
+	off_t sp_off;
+	size_t sp_len;
+	int sp_iovcnt;
+	struct iovec sp_iov[BLOCKIF_BACKEND_IOV];
+};
+
+struct stripe {
+	int st_nfiles;
+	int st_fd[STRIPE_MAXFILES];
+	int st_rdonly;
+	unsigned st_shift;		/* log2 of the stripe size */
+	off_t st_size;
+	int st_nthr;
+	pthread_t st_tid[STRIPE_MAXFILES * STRIPE_THREADS];
+	pthread_mutex_t st_mtx;
+	pthread_cond_t st_cond;		/* parts queued, or closing */
+	TAILQ_HEAD(, stripe_part) st_queue;
+	int st_closing;
+};
+#pragma clang diagnostic pop
+
+/*
+ * Issue a part. Returns 0 or an errno value; a short transfer is an error
+ * since every part lies within its file.
+ */
+static int
+stripe_part_io(struct stripe_part *sp)
+{
+	ssize_t ret;
+
+	if (sp->sp_wr)
+		ret = blockif_pwritev(sp->sp_fd, sp->sp_iov, sp->sp_iovcnt,
+			sp->sp_off);
+	else
+		ret = blockif_preadv(sp->sp_fd, sp->sp_iov, sp->sp_iovcnt,
+			sp->sp_off);
+	if (ret < 0)
+		return (errno);
+	return ((size_t) ret == sp->sp_len ? 0 : EIO);
+}
+
+static void
+stripe_part_done(struct stripe *st, struct stripe_part *sp, int err)
+{
+	struct stripe_io *si;
+
+	si = sp->sp_io;
+	pthread_mutex_lock(&st->st_mtx);
+	if (err != 0 && si->si_err == 0)
+		si->si_err = err;
+	if (--si->si_pending == 0)
+		pthread_cond_signal(&si->si_cond);
+	pthread_mutex_unlock(&st->st_mtx);
+}
+
+static void *
+stripe_thr(void *arg)
+{
+	struct stripe_part *sp;
+	struct stripe *st;
+
+	st = arg;
+	pthread_mutex_lock(&st->st_mtx);
+	for (;;) {
+		while (TAILQ_EMPTY(&st->st_queue) && !st->st_closing)
+			pthread_cond_wait(&st->st_cond, &st->st_mtx);
+		if ((sp = TAILQ_FIRST(&st->st_queue)) == NULL)
+			break;
+		TAILQ_REMOVE(&st->st_queue, sp, sp_link);
+		pthread_mutex_unlock(&st->st_mtx);
+		stripe_part_done(st, sp, stripe_part_io(sp));
+		pthread_mutex_lock(&st->st_mtx);
+	}
+	pthread_mutex_unlock(&st->st_mtx);
+	return (NULL);
+}
+
+/*
+ * Issue the parts that have been gathered, in parallel, and wait for them.
+ * Returns 0 or the first error.
+ */
+static int
+stripe_issue(struct stripe *st, struct stripe_part *parts)
+{
+	struct stripe_part *mine;
+	struct stripe_io si;
+	int i;
+
+	si.si_pending = 0;
+	si.si_err = 0;
+	pthread_cond_init(&si.si_cond, NULL);
+	mine = NULL;
+	pthread_mutex_lock(&st->st_mtx);
+	for (i = 0; i < st->st_nfiles; i++) {
+		if (parts[i].sp_len == 0)
+			continue;
+		parts[i].sp_io = &si;
+		si.si_pending++;
+		if (mine == NULL)
+			mine = &parts[i];
+		else
+			TAILQ_INSERT_TAIL(&st->st_queue, &parts[i], sp_link);
+	}
+	pthread_mutex_unlock(&st->st_mtx);
+	if (si.si_pending > 1)
+		pthread_cond_broadcast(&st->st_cond);
+	if (mine != NULL)
+		stripe_part_done(st, mine, stripe_part_io(mine));
+
+	pthread_mutex_lock(&st->st_mtx);
+	while (si.si_pending > 0)
+		pthread_cond_wait(&si.si_cond, &st->st_mtx);
+	pthread_mutex_unlock(&st->st_mtx);
+	pthread_cond_destroy(&si.si_cond);
+
+	for (i = 0; i < st->st_nfiles; i++) {
+		parts[i].sp_len = 0;
+		parts[i].sp_iovcnt = 0;
+	}
+	return (si.si_err);
+}
+
+static ssize_t
+stripe_rw(struct stripe *st, const struct iovec *iov, int iovcnt, off_t off,
+	int wr)
+{
+	struct iovec siov[BLOCKIF_BACKEND_IOV];
+	struct stripe_part *parts, *sp;
+	size_t done, len, n;
+	off_t pos, ssize, idx;
+	int err, scnt;
+
+	if (wr && st->st_rdonly) {
+		errno = EROFS;
+		return (-1);
+	}
+	if (off >= st->st_size)
+		return (0);
+	len = MIN(blockif_iov_len(iov, iovcnt), (size_t) (st->st_size - off));
+	parts = calloc((size_t) st->st_nfiles, sizeof(struct stripe_part));
+	if (parts == NULL)
+		return (-1);
+
+	ssize = ((off_t) 1) << st->st_shift;
+	err = 0;
+	for (done = 0; done < len; done += n) {
+		pos = off + ((off_t) done);
+		idx = pos >> st->st_shift;
+		n = MIN(len - done, (size_t) (ssize - (pos & (ssize - 1))));
+		scnt = blockif_iov_slice(iov, iovcnt, done, n, siov);
+		sp = &parts[idx % st->st_nfiles];
+		/* Out of room for this file: issue what we have first */
+		if (sp->sp_iovcnt + scnt > BLOCKIF_BACKEND_IOV &&
+		    (err = stripe_issue(st, parts)) != 0)
+			break;
+		if (sp->sp_len == 0) {
+			sp->sp_fd = st->st_fd[idx % st->st_nfiles];
+			sp->sp_wr = wr;
+			sp->sp_off = ((idx / st->st_nfiles) << st->st_shift) +
+				(pos & (ssize - 1));
+		}
+		memcpy(&sp->sp_iov[sp->sp_iovcnt], siov,
+		    ((size_t) scnt) * sizeof(struct iovec));
+		sp->sp_iovcnt += scnt;
+		sp->sp_len += n;
+	}
+	if (err == 0)
+		err = stripe_issue(st, parts);
+	free(parts);
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+	return ((ssize_t) len);
+}
+
+static ssize_t
+stripe_preadv(void *arg, const struct iovec *iov, int iovcnt, off_t off)
+{
+	return (stripe_rw(arg, iov, iovcnt, off, 0));
+}
+
+static ssize_t
+stripe_pwritev(void *arg, const struct iovec *iov, int iovcnt, off_t off)
+{
+	return (stripe_rw(arg, iov, iovcnt, off, 1));
+}
+
+static int
+stripe_flush(void *arg)
+{
+	struct stripe *st;
+	int err, i;
+
+	st = arg;
+	err = 0;
+	for (i = 0; i < st->st_nfiles; i++)
+		if (fsync(st->st_fd[i]) < 0 && err == 0)
+			err = errno;
+	return (err);
+}
+
+static void
+stripe_free(struct stripe *st)
+{
+	int i;
+
+	pthread_mutex_lock(&st->st_mtx);
+	st->st_closing = 1;
+	pthread_mutex_unlock(&st->st_mtx);
+	pthread_cond_broadcast(&st->st_cond);
+	for (i = 0; i < st->st_nthr; i++)
+		pthread_join(st->st_tid[i], NULL);
+	for (i = 0; i < st->st_nfiles; i++)
+		close(st->st_fd[i]);
+	pthread_cond_destroy(&st->st_cond);
+	pthread_mutex_destroy(&st->st_mtx);
+	free(st);
+}
+
+/*
+ * Open one of the files named by the descriptor, trimming *size to the
+ * whole stripes it holds.
+ */
+static int
+stripe_add(struct stripe *st, const char *path, const char *name, off_t *size)
+{
+	char fpath[MAXPATHLEN], dir[MAXPATHLEN];
+	struct stat sbuf;
+	int fd;
+
+	if (st->st_nfiles == STRIPE_MAXFILES) {
+		fprintf(stderr, "%s: more than %d files\n", path,
+		    STRIPE_MAXFILES);
+		return (-1);
+	}
+	if (name[0] == '/')
+		strlcpy(fpath, name, sizeof(fpath));
+	else {
+		strlcpy(dir, path, sizeof(dir));
+		snprintf(fpath, sizeof(fpath), "%s/%s", dirname(dir), name);
+	}
+	if ((fd = open(fpath, st->st_rdonly ? O_RDONLY : O_RDWR)) < 0) {
+		fprintf(stderr, "%s: cannot open %s: %s\n", path, fpath,
+		    strerror(errno));
+		return (-1);
+	}
+	if (fstat(fd, &sbuf) < 0) {
+		perror("fstat");
+		close(fd);
+		return (-1);
+	}
+	st->st_fd[st->st_nfiles++] = fd;
+	sbuf.st_size &= ~((((off_t) 1) << st->st_shift) - 1);
+	if (st->st_nfiles == 1 || sbuf.st_size < *size)
+		*size = sbuf.st_size;
+	return (0);
+}
+
+static int
+stripe_match(const char *path)
+{
+	return (strncmp(path, STRIPE_PREFIX, strlen(STRIPE_PREFIX)) == 0);
+}
+
+static void *
+stripe_open(const char *path, UNUSED int fd, struct blockif_binfo *bi)
+{
+	char line[MAXPATHLEN], *cp;
+	struct stripe *st;
+	long long ssize;
+	off_t fsize;
+	FILE *f;
+	int i;
+
+	path += strlen(STRIPE_PREFIX);
+	if ((f = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return (NULL);
+	}
+	st = calloc(1, sizeof(struct stripe));
+	if (st == NULL) {
+		perror("calloc");
+		goto fail;
+	}
+	st->st_rdonly = bi->bi_rdonly;
+	if (fgets(line, sizeof(line), f) == NULL ||
+	    sscanf(line, STRIPE_MAGIC " %lld", &ssize) != 1 ||
+	    ssize < STRIPE_MINSIZE || !powerof2(ssize)) {
+		fprintf(stderr, "%s: invalid stripe size\n", path);
+		goto fail;
+	}
+	for (st->st_shift = 0; (1LL << st->st_shift) < ssize; st->st_shift++)
+		;
+	fsize = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		for (cp = line; *cp == ' ' || *cp == '\t'; cp++)
+			;
+		if (*cp == '\0' || *cp == '#')
+			continue;
+		if (stripe_add(st, path, cp, &fsize) != 0)
+			goto fail;
+	}
+	if (st->st_nfiles == 0 || fsize == 0) {
+		fprintf(stderr, "%s: no stripes\n", path);
+		goto fail;
+	}
+	st->st_size = fsize * st->st_nfiles;
+
+	pthread_mutex_init(&st->st_mtx, NULL);
+	pthread_cond_init(&st->st_cond, NULL);
+	TAILQ_INIT(&st->st_queue);
+	/* The thread that takes a request issues one of its parts itself */
+	st->st_nthr = (st->st_nfiles - 1) * STRIPE_THREADS;
+	for (i = 0; i < st->st_nthr; i++)
+		pthread_create(&st->st_tid[i], NULL, stripe_thr, st);
+	fclose(f);
+
+	bi->bi_size = st->st_size;
+	bi->bi_candelete = 0;
+	return (st);
+
+fail:
+	if (st != NULL) {
+		for (i = 0; i < st->st_nfiles; i++)
+			close(st->st_fd[i]);
+		free(st);
+	}
+	fclose(f);
+	return (NULL);
+}
+
+static void
+stripe_close(void *arg)
+{
+	stripe_free(arg);
+}
+
+const struct blockif_backend blockif_stripe_backend = {
+	.bb_name = "striped",
+	.bb_match = stripe_match,
+	.bb_probe = NULL,
+	.bb_open = stripe_open,
+	.bb_preadv = stripe_preadv,
+	.bb_pwritev = stripe_pwritev,
+	.bb_flush = stripe_flush,
+	.bb_delete = NULL,
+	.bb_close = stripe_close
+};
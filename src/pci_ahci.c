@@ -40,13 +40,15 @@
 #include <assert.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <sys/disk.h>
 #include <sys/queue.h>
-// #include <sys/endian.h>
 #include <xhyve/support/misc.h>
+#include <xhyve/support/atomic.h>
 #include <xhyve/support/ata.h>
+#include <xhyve/support/endian.h>
 #include <xhyve/support/linker_set.h>
 #include <xhyve/support/md5.h>
 #include <xhyve/xhyve.h>
@@ -55,6 +57,8 @@
 #include <xhyve/ahci.h>
 
 #define	MAX_PORTS	6	/* Intel ICH8 AHCI supports 6 ports */
+#define	AHCI_NCQ_WORKERS 32	/* block i/o workers, one per NCQ tag */
+#define	AHCI_CCC_INT	MAX_PORTS	/* IS bit of the coalescing interrupt */
 
 #define	PxSIG_ATA	0x00000101 /* ATA drive */
 #define	PxSIG_ATAPI	0xeb140101 /* ATAPI drive */
@@ -148,6 +152,14 @@ struct ahci_port {
 	uint8_t asc;
 	u_int ccs;
 	uint32_t pending;
+	/*
+	 * NCQ completions are reported in batches: sdb_done collects the
+	 * slots finished but not yet in a Set Device Bits FIS, and ncq_cbs
+	 * counts the callbacks that are running or waiting for the lock.
+	 * The last of them to leave writes the FIS.
+	 */
+	uint32_t sdb_done;
+	volatile u_int ncq_cbs;
 
 	uint32_t clb;
 	uint32_t clbu;
@@ -208,6 +220,19 @@ struct pci_ahci_softc {
 	uint32_t bohc;
 	uint32_t lintr;
 	struct ahci_port port[MAX_PORTS];
+	/*
+	 * Command completion coalescing: completions on the ports in
+	 * ccc_pts are counted in ccc_count, and raise one interrupt on
+	 * IS bit AHCI_CCC_INT once CCC_CTL.CC of them have been seen or
+	 * CCC_CTL.TV ms after the first, whichever comes sooner. The timer
+	 * thread waits for ccc_due; ccc_gen changes whenever the count is
+	 * restarted, so that it can tell a stale deadline.
+	 */
+	pthread_t ccc_tid;
+	pthread_cond_t ccc_cond;
+	struct timespec ccc_due;
+	u_int ccc_count;
+	u_int ccc_gen;
 };
 
 #pragma clang diagnostic pop
@@ -236,8 +261,13 @@ ahci_generate_intr(struct pci_ahci_softc *sc)
 
 	for (i = 0; i < sc->ports; i++) {
 		struct ahci_port *pr;
+		uint32_t ie;
 		pr = &sc->port[i];
-		if (pr->is & pr->ie)
+		ie = pr->ie;
+		/* Completions on coalesced ports are reported by the CCC bit */
+		if ((sc->ccc_ctl & AHCI_CCCC_EN) && (sc->ccc_pts & (1U << i)))
+			ie &= ~((uint32_t) (AHCI_P_IX_DHR | AHCI_P_IX_SDB));
+		if (pr->is & ie)
 			sc->is |= (1 << i);
 	}
 
@@ -267,9 +297,71 @@ ahci_generate_intr(struct pci_ahci_softc *sc)
 	}
 }
 
+/*
+ * Raise the coalescing interrupt and start counting afresh.
+ */
+static void
+ahci_ccc_intr(struct pci_ahci_softc *sc)
+{
+	sc->ccc_count = 0;
+	sc->ccc_gen++;
+	sc->is |= (1U << AHCI_CCC_INT);
+	ahci_generate_intr(sc);
+}
+
+/*
+ * Account for n commands completed on a coalesced port. The first of a
+ * batch starts the timer.
+ */
+static void
+ahci_ccc_complete(struct pci_ahci_softc *sc, u_int n)
+{
+	struct timeval tv;
+	u_int cc, tv_ms;
+
+	cc = (sc->ccc_ctl & AHCI_CCCC_CC_MASK) >> AHCI_CCCC_CC_SHIFT;
+	tv_ms = (sc->ccc_ctl & AHCI_CCCC_TV_MASK) >> AHCI_CCCC_TV_SHIFT;
+	if (sc->ccc_count == 0 && tv_ms != 0) {
+		gettimeofday(&tv, NULL);
+		sc->ccc_due.tv_sec = tv.tv_sec + tv_ms / 1000;
+		sc->ccc_due.tv_nsec = (long) tv.tv_usec * 1000 +
+		    (long) (tv_ms % 1000) * 1000000;
+		if (sc->ccc_due.tv_nsec >= 1000000000) {
+			sc->ccc_due.tv_sec++;
+			sc->ccc_due.tv_nsec -= 1000000000;
+		}
+		pthread_cond_signal(&sc->ccc_cond);
+	}
+	sc->ccc_count += n;
+	if (cc != 0 && sc->ccc_count >= cc)
+		ahci_ccc_intr(sc);
+}
+
+static void *
+ahci_ccc_thr(void *arg)
+{
+	struct pci_ahci_softc *sc;
+	u_int gen;
+
+	sc = arg;
+	pthread_mutex_lock(&sc->mtx);
+	for (;;) {
+		if (sc->ccc_count == 0 || !(sc->ccc_ctl & AHCI_CCCC_TV_MASK)) {
+			pthread_cond_wait(&sc->ccc_cond, &sc->mtx);
+			continue;
+		}
+		gen = sc->ccc_gen;
+		if (pthread_cond_timedwait(&sc->ccc_cond, &sc->mtx,
+		    &sc->ccc_due) == ETIMEDOUT && sc->ccc_gen == gen)
+			ahci_ccc_intr(sc);
+	}
+	return (NULL);
+}
+
 static void
 ahci_write_fis(struct ahci_port *p, enum sata_fis_type ft, uint8_t *fis)
 {
+	struct pci_ahci_softc *sc;
 	int offset, len, irq;
 
 	if (p->rfis == NULL || !(p->cmd & AHCI_P_CMD_FRE))
@@ -306,7 +398,16 @@ ahci_write_fis(struct ahci_port *p, enum sata_fis_type ft, uint8_t *fis)
 	memcpy(p->rfis + offset, fis, len);
 	if (irq) {
 		p->is |= ((unsigned) irq);
-		ahci_generate_intr(p->pr_sc);
+		sc = p->pr_sc;
+		if ((sc->ccc_ctl & AHCI_CCCC_EN) &&
+		    (sc->ccc_pts & (1U << (p - sc->port))) &&
+		    !(irq & AHCI_P_IX_TFE) && ft != FIS_TYPE_PIOSETUP) {
+			/* A Set Device Bits FIS may finish several commands */
+			ahci_ccc_complete(sc, ft == FIS_TYPE_SETDEVBITS ?
+			    (u_int) __builtin_popcount(
+			    *(uint32_t *)((void *) (fis + 4))) : 1);
+		} else
+			ahci_generate_intr(sc);
 	}
 }
 
@@ -347,6 +448,32 @@ ahci_write_fis_sdb(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 	ahci_write_fis(p, FIS_TYPE_SETDEVBITS, fis);
 }
 
+/*
+ * Report every NCQ command collected in sdb_done as complete, with a single
+ * Set Device Bits FIS and interrupt.
+ */
+static void
+ahci_write_fis_sdb_done(struct ahci_port *p)
+{
+	uint8_t fis[8];
+	uint32_t done;
+
+	/* Slots cancelled by a port stop in the meantime are gone */
+	done = p->sdb_done & p->sact;
+	p->sdb_done = 0;
+	if (done == 0)
+		return;
+	memset(fis, 0, sizeof(fis));
+	fis[0] = FIS_TYPE_SETDEVBITS;
+	fis[1] = (1 << 6);
+	fis[2] = ATA_S_READY | ATA_S_DSC;
+	*(uint32_t *)((void *) (fis + 4)) = done;
+	p->sact &= ~done;
+	p->tfd &= ~((unsigned) 0x77);
+	p->tfd |= ATA_S_READY | ATA_S_DSC;
+	ahci_write_fis(p, FIS_TYPE_SETDEVBITS, fis);
+}
+
 static void
 ahci_write_fis_d2h(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 {
@@ -488,6 +615,7 @@ ahci_port_reset(struct ahci_port *pr)
 {
 	pr->serr = 0;
 	pr->sact = 0;
+	pr->sdb_done = 0;
 	pr->xfermode = ATA_UDMA6;
 	pr->mult_sectors = 128;
 
@@ -518,6 +646,11 @@ ahci_reset(struct pci_ahci_softc *sc)
 
 	sc->ghc = AHCI_GHC_AE;
 	sc->is = 0;
+	sc->ccc_ctl = (1U << AHCI_CCCC_TV_SHIFT) | (1U << AHCI_CCCC_CC_SHIFT) |
+	    (AHCI_CCC_INT << AHCI_CCCC_INT_SHIFT);
+	sc->ccc_pts = 0;
+	sc->ccc_count = 0;
+	sc->ccc_gen++;
 
 	if (sc->lintr) {
 		pci_lintr_deassert(sc->asc_pi);
@@ -1110,44 +1243,6 @@ atapi_inquiry(struct ahci_port *p, int slot, uint8_t *cfis)
 	ahci_write_fis_d2h(p, slot, cfis, ATA_S_READY | ATA_S_DSC);
 }
 
-static __inline void
-be16enc(void *pp, uint16_t u)
-{
-	unsigned char *p = (unsigned char *)pp;
-
-	p[0] = (u >> 8) & 0xff;
-	p[1] = u & 0xff;
-}
-
-static __inline uint16_t
-be16dec(const void *pp)
-{
-	unsigned char const *p = (unsigned char const *)pp;
-
-	return ((uint16_t) ((((uint32_t) p[0]) << 8) | ((uint32_t) p[1])));
-}
-
-static __inline void
-be32enc(void *pp, uint32_t u)
-{
-	unsigned char *p = (unsigned char *)pp;
-
-	p[0] = (u >> 24) & 0xff;
-	p[1] = (u >> 16) & 0xff;
-	p[2] = (u >> 8) & 0xff;
-	p[3] = u & 0xff;
-}
-
-static __inline uint32_t
-be32dec(const void *pp)
-{
-	unsigned char const *p = (unsigned char const *)pp;
-
-	return (uint32_t) ((((uint64_t) p[0]) << 24) | 
-		(((uint64_t) p[1]) << 16) | (((uint64_t) p[2]) << 8) |
-			((uint64_t) p[3]));
-}
-
 static void
 atapi_read_capacity(struct ahci_port *p, int slot, uint8_t *cfis)
 {
@@ -1660,6 +1755,9 @@ ahci_handle_cmd(struct ahci_port *p, int slot, uint8_t *cfis)
 			break;
 		case ATA_SF_ENAB_WCACHE:
 		case ATA_SF_DIS_WCACHE:
+			blockif_set_wce(p->bctx, cfis[3] == ATA_SF_ENAB_WCACHE);
+			p->tfd = ATA_S_DSC | ATA_S_READY;
+			break;
 		case ATA_SF_ENAB_RCACHE:
 		case ATA_SF_DIS_RCACHE:
 			p->tfd = ATA_S_DSC | ATA_S_READY;
@@ -1876,6 +1974,9 @@ ata_ioreq_cb(struct blockif_req *br, int err)
 	     (cfis[13] & 0x1f) == ATA_SFPDMA_DSM))
 		dsm = 1;
 
+	/* Announce this completion before queueing for the lock */
+	if (ncq)
+		atomic_add_int(&p->ncq_cbs, 1);
 	pthread_mutex_lock(&sc->mtx);
 
 	/*
@@ -1903,9 +2004,13 @@ ata_ioreq_cb(struct blockif_req *br, int err)
 		tfd = ATA_S_READY | ATA_S_DSC;
 	else
 		tfd = (ATA_E_ABORT << 8) | ATA_S_READY | ATA_S_ERROR;
-	if (ncq)
+	if (ncq && !err && (p->cmd & AHCI_P_CMD_ST))
+		p->sdb_done |= 1U << slot;
+	else if (ncq) {
+		/* Report those collected so far first */
+		ahci_write_fis_sdb_done(p);
 		ahci_write_fis_sdb(p, slot, cfis, tfd);
-	else
+	} else
 		ahci_write_fis_d2h(p, slot, cfis, tfd);
 
 	/*
@@ -1916,6 +2021,12 @@ ata_ioreq_cb(struct blockif_req *br, int err)
 	ahci_check_stopped(p);
 	ahci_handle_port(p);
 out:
+	/*
+	 * Completions still waiting for the lock will be reported with
+	 * this one; the last callback out writes the FIS for them all.
+	 */
+	if (ncq && atomic_fetchadd_int(&p->ncq_cbs, (u_int) -1) == 1)
+		ahci_write_fis_sdb_done(p);
 	pthread_mutex_unlock(&sc->mtx);
 	DPRINTF("%s exit\n", __func__);
 }
@@ -2138,6 +2249,31 @@ pci_ahci_host_write(struct pci_ahci_softc *sc, uint64_t offset, uint64_t value)
 		sc->is &= ~value;
 		ahci_generate_intr(sc);
 		break;
+	case AHCI_CCCC:
+	{
+		uint32_t old;
+
+		/* TV and CC are only writable while coalescing is off */
+		old = sc->ccc_ctl;
+		if (old & AHCI_CCCC_EN)
+			value = (value & AHCI_CCCC_EN) |
+			    (old & (AHCI_CCCC_TV_MASK | AHCI_CCCC_CC_MASK));
+		else
+			value &= AHCI_CCCC_TV_MASK | AHCI_CCCC_CC_MASK |
+			    AHCI_CCCC_EN;
+		sc->ccc_ctl = (old & AHCI_CCCC_INT_MASK) | (uint32_t) value;
+		if (old & ~sc->ccc_ctl & AHCI_CCCC_EN) {
+			/* Report whatever was held back on the ports */
+			sc->ccc_count = 0;
+			sc->ccc_gen++;
+			ahci_generate_intr(sc);
+		}
+		break;
+	}
+	case AHCI_CCCP:
+		if (!(sc->ccc_ctl & AHCI_CCCC_EN))
+			sc->ccc_pts = (uint32_t) value & sc->pi;
+		break;
 	default:
 		break;
 	}
@@ -2269,12 +2405,38 @@ pci_ahci_read(UNUSED int vcpu, struct pci_devinst *pi, int baridx,
 	return (value);
 }
 
+/*
+ * Options for blockif_open. Unless a number of workers is given, a disk
+ * gets one per NCQ tag, so all 32 queued commands can be in flight.
+ */
+static char *
+pci_ahci_opts(const char *opts, int atapi)
+{
+	char *bopts, *xopts, *nopt, *cp;
+	int workers;
+
+	nopt = xopts = strdup(opts);
+	if (nopt == NULL)
+		return (NULL);
+	workers = atapi;
+	while ((cp = strsep(&xopts, ",")) != NULL)
+		if (cp != nopt && !strncmp(cp, "workers=", 8))
+			workers = 1;
+	free(nopt);
+	if (workers)
+		return (strdup(opts));
+	if (asprintf(&bopts, "%s,workers=%d", opts, AHCI_NCQ_WORKERS) < 0)
+		return (NULL);
+	return (bopts);
+}
+
 static int
 pci_ahci_init(struct pci_devinst *pi, char *opts, int atapi)
 {
 	char bident[sizeof("XX:X:X")];
 	struct blockif_ctxt *bctxt;
 	struct pci_ahci_softc *sc;
+	char *bopts;
 	int ret, slots;
 	MD5_CTX mdctx;
 	u_char digest[16];
@@ -2306,7 +2468,9 @@ pci_ahci_init(struct pci_devinst *pi, char *opts, int atapi)
 	 * slot/func for the identifier string.
 	 */
 	snprintf(bident, sizeof(bident), "%d:%d", pi->pi_slot, pi->pi_func);
-	bctxt = blockif_open(opts, bident);
+	bopts = pci_ahci_opts(opts, atapi);
+	bctxt = bopts != NULL ? blockif_open(bopts, bident) : NULL;
+	free(bopts);
 	if (bctxt == NULL) {       	
 		ret = 1;
 		goto open_fail;
@@ -2331,6 +2495,7 @@ pci_ahci_init(struct pci_devinst *pi, char *opts, int atapi)
 	pci_ahci_ioreq_init(&sc->port[0]);
 
 	pthread_mutex_init(&sc->mtx, NULL);
+	pthread_cond_init(&sc->ccc_cond, NULL);
 
 	/* Intel ICH8 AHCI */
 	slots = sc->port[0].ioqsz;
@@ -2338,7 +2503,7 @@ pci_ahci_init(struct pci_devinst *pi, char *opts, int atapi)
 		slots = 32;
 	--slots;
 	sc->cap = AHCI_CAP_64BIT | AHCI_CAP_SNCQ | AHCI_CAP_SSNTF |
-	    AHCI_CAP_SMPS | AHCI_CAP_SSS | AHCI_CAP_SALP |
+	    AHCI_CAP_SMPS | AHCI_CAP_SSS | AHCI_CAP_SALP | AHCI_CAP_CCCS |
 	    AHCI_CAP_SAL | AHCI_CAP_SCLO | (0x3 << AHCI_CAP_ISS_SHIFT)|
 	    AHCI_CAP_PMD | AHCI_CAP_SSC | AHCI_CAP_PSC |
 	    (((unsigned) slots) << AHCI_CAP_NCS_SHIFT) | AHCI_CAP_SXS |
@@ -2361,6 +2526,8 @@ pci_ahci_init(struct pci_devinst *pi, char *opts, int atapi)
 
 	pci_lintr_request(pi);
 
+	pthread_create(&sc->ccc_tid, NULL, ahci_ccc_thr, sc);
+
 open_fail:
 	if (ret) {
 		if (sc->port[0].bctx != NULL)
@@ -27,6 +27,7 @@
  * $FreeBSD$
  */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -42,7 +43,9 @@
 #include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <sys/disk.h>
+#include <mach/mach_time.h>
 #include <xhyve/support/misc.h>
+#include <xhyve/support/atomic.h>
 #include <xhyve/support/linker_set.h>
 #include <xhyve/support/md5.h>
 #include <xhyve/xhyve.h>
@@ -51,6 +54,8 @@
 #include <xhyve/block_if.h>
 
 #define VTBLK_RINGSZ 64
+#define VTBLK_MAXRINGSZ 32768
+#define VTBLK_MAXQUEUES 32
 
 #define VTBLK_S_OK 0
 #define VTBLK_S_IOERR 1
@@ -63,6 +68,16 @@
 #define	VTBLK_F_BLK_SIZE (1 << 6) /* cfg block size valid */
 #define	VTBLK_F_FLUSH (1 << 9) /* Cache flush support */
 #define	VTBLK_F_TOPOLOGY (1 << 10) /* Optimal I/O alignment */
+#define	VTBLK_F_CONFIG_WCE (1 << 11) /* Writeback mode in config */
+#define	VTBLK_F_MQ (1 << 12) /* Multiple request queues */
+#define	VTBLK_F_DISCARD (1 << 13) /* Discard support */
+#define	VTBLK_F_WRITE_ZEROES (1 << 14) /* Write zeroes support */
+
+/* Longest busy-polling window, in microseconds */
+#define	VTBLK_MAXPOLL 1000000
+
+/* Largest discard/write zeroes request, in 512-byte sectors */
+#define	VTBLK_MAX_DISCARD_SECT (1 << 23)
 
 /*
  * Host capabilities
@@ -96,6 +111,15 @@ struct vtblk_config {
 		uint32_t opt_io_size;
 	} vbc_topology;
 	uint8_t vbc_writeback;
+	uint8_t vbc_unused0;
+	uint16_t vbc_num_queues;
+	uint32_t vbc_max_discard_sectors;
+	uint32_t vbc_max_discard_seg;
+	uint32_t vbc_discard_sector_alignment;
+	uint32_t vbc_max_write_zeroes_sectors;
+	uint32_t vbc_max_write_zeroes_seg;
+	uint8_t vbc_write_zeroes_may_unmap;
+	uint8_t vbc_unused1[3];
 } __packed;
 
 /*
@@ -107,12 +131,24 @@ struct virtio_blk_hdr {
 #define	VBH_OP_FLUSH		4
 #define	VBH_OP_FLUSH_OUT	5
 #define	VBH_OP_IDENT		8		
+#define	VBH_OP_DISCARD		11
+#define	VBH_OP_WRITE_ZEROES	13
 #define	VBH_FLAG_BARRIER	0x80000000	/* OR'ed into vbh_type */
 	uint32_t vbh_type;
 	uint32_t vbh_ioprio;
 	uint64_t vbh_sector;
 } __packed;
 
+/*
+ * Payload of discard and write zeroes requests
+ */
+struct virtio_blk_discard {
+	uint64_t vbd_sector;
+	uint32_t vbd_num_sectors;
+#define	VBD_FLAG_UNMAP		0x1
+	uint32_t vbd_flags;
+} __packed;
+
 #pragma clang diagnostic pop
 
 /*
@@ -126,21 +162,51 @@ static int pci_vtblk_debug;
 struct pci_vtblk_ioreq {
 	struct blockif_req io_req;
 	struct pci_vtblk_softc *io_sc;
+	struct pci_vtblk_queue *io_q;
 	uint8_t *io_status;
 	uint16_t io_idx;
 };
 
+/*
+ * Per-queue state. Each request queue has its own lock and blockif
+ * context, so vCPUs submitting on different queues never contend. The
+ * contexts share the state blockif keeps per file (backend, sparse map,
+ * caches), but each has its own descriptor, workers and overlap tracking:
+ * requests on different queues are not ordered against each other, as
+ * virtio does not order them either.
+ */
+struct pci_vtblk_queue {
+	pthread_mutex_t vbq_mtx;
+	struct vqueue_info *vbq_vq;
+	struct blockif_ctxt *vbq_bc;
+	struct pci_vtblk_ioreq *vbq_ios;
+	int vbq_inline;		/* blockif completes requests as they are made */
+	/*
+	 * poll=: a thread that picks up requests from the avail ring with
+	 * guest notifications off, and sleeps until the next kick once the
+	 * ring has been idle for vbq_pollwin.
+	 */
+	struct pci_vtblk_softc *vbq_sc;
+	pthread_t vbq_polltid;
+	pthread_cond_t vbq_pollcond;
+	uint64_t vbq_pollwin;	/* mach_absolute_time() units */
+	int vbq_kicked;
+	int vbq_pollstop;	/* the thread is to exit */
+};
+
 /*
  * Per-device softc
  */
 struct pci_vtblk_softc {
 	struct virtio_softc vbsc_vs;
 	pthread_mutex_t vsc_mtx;
-	struct vqueue_info vbsc_vq;
+	struct virtio_consts vbsc_consts;
+	struct vqueue_info *vbsc_vqs;
+	struct pci_vtblk_queue *vbsc_queues;
+	int vbsc_nq;
 	struct vtblk_config vbsc_cfg;
-	struct blockif_ctxt *bc;
 	char vbsc_ident[VTBLK_BLK_ID_BYTES];
-	struct pci_vtblk_ioreq vbsc_ios[VTBLK_RINGSZ];
+	struct pci_vtblk_softc *vbsc_pollnext;	/* devices with poll= */
 };
 
 #pragma clang diagnostic pop
@@ -152,7 +218,7 @@ static int pci_vtblk_cfgwrite(void *, int, int, uint32_t);
 
 static struct virtio_consts vtblk_vi_consts = {
 	"vtblk", /* our name */
-	1, /* we support 1 virtqueue */
+	1, /* number of virtqueues, overridden by queues= */
 	sizeof(struct vtblk_config), /* config reg size */
 	pci_vtblk_reset, /* reset */
 	pci_vtblk_notify, /* device-wide qnotify */
@@ -162,24 +228,55 @@ static struct virtio_consts vtblk_vi_consts = {
 	VTBLK_S_HOSTCAPS, /* our capabilities */
 };
 
+/* Devices with polling threads, which are stopped at exit */
+static struct pci_vtblk_softc *pci_vtblk_poll_head;
+
+static void
+pci_vtblk_set_wce(struct pci_vtblk_softc *sc, int wce)
+{
+	int i;
+
+	sc->vbsc_cfg.vbc_writeback = (uint8_t) wce;
+	for (i = 0; i < sc->vbsc_nq; i++)
+		blockif_set_wce(sc->vbsc_queues[i].vbq_bc, wce);
+}
+
 static void
 pci_vtblk_reset(void *vsc)
 {
 	struct pci_vtblk_softc *sc = vsc;
+	int i;
 
 	DPRINTF(("vtblk: device reset requested !\n"));
+	/*
+	 * The rings are cleared under every queue lock, so nothing is taking
+	 * requests off them or completing requests meanwhile. vq_interrupt()
+	 * takes the softc lock with a queue lock held, so the queue locks come
+	 * first and the softc lock, held by our caller, is dropped meanwhile.
+	 */
+	pthread_mutex_unlock(&sc->vsc_mtx);
+	for (i = 0; i < sc->vbsc_nq; i++)
+		pthread_mutex_lock(&sc->vbsc_queues[i].vbq_mtx);
+	pthread_mutex_lock(&sc->vsc_mtx);
 	vi_reset_dev(&sc->vbsc_vs);
+	for (i = 0; i < sc->vbsc_nq; i++)
+		pthread_mutex_unlock(&sc->vbsc_queues[i].vbq_mtx);
+	/* A guest that switched to writethrough gets the default back */
+	if (sc->vbsc_consts.vc_hv_caps & VTBLK_F_CONFIG_WCE)
+		pci_vtblk_set_wce(sc, 1);
 }
 
-/* xhyve: FIXME
- *
- * pci_vtblk_done seems to deadlock when called from pci_vtblk_proc?
+/*
+ * Return a finished request to the guest, without notifying it. This is
+ * the callback of queues whose requests blockif runs inline, where it is
+ * made from pci_vtblk_proc() with the queue lock held; pci_vtblk_notify()
+ * then notifies the guest once for the whole batch.
  */
 static void
-pci_vtblk_done_locked(struct blockif_req *br, int err)
+pci_vtblk_done_inline(struct blockif_req *br, int err)
 {
 	struct pci_vtblk_ioreq *io = br->br_param;
-	struct pci_vtblk_softc *sc = io->io_sc;
+	struct vqueue_info *vq = io->io_q->vbq_vq;
 
 	/* convert errno into a virtio block error return */
 	if (err == EOPNOTSUPP || err == ENOSYS)
@@ -193,26 +290,43 @@ pci_vtblk_done_locked(struct blockif_req *br, int err)
 	 * Return the descriptor back to the host.
 	 * We wrote 1 byte (our status) to host.
 	 */
-	//pthread_mutex_lock(&sc->vsc_mtx);
-	vq_relchain(&sc->vbsc_vq, io->io_idx, 1);
-	vq_endchains(&sc->vbsc_vq, 0);
-	//pthread_mutex_unlock(&sc->vsc_mtx);
+	if (!vq_ring_ready(vq))
+		return;
+	vq_relchain(vq, io->io_idx, 1);
+}
+
+/*
+ * Return a finished request to the guest and notify it, with the queue
+ * lock held. Requests that pci_vtblk_proc() finishes itself come here:
+ * pci_vtblk_done() would take the queue lock pci_vtblk_proc() holds.
+ */
+static void
+pci_vtblk_done_locked(struct blockif_req *br, int err)
+{
+	struct pci_vtblk_ioreq *io = br->br_param;
+	struct vqueue_info *vq = io->io_q->vbq_vq;
+
+	pci_vtblk_done_inline(br, err);
+	if (vq_ring_ready(vq))
+		vq_endchains(vq, 0);
 }
 
 static void
 pci_vtblk_done(struct blockif_req *br, int err) {
 	struct pci_vtblk_ioreq *io = br->br_param;
-	struct pci_vtblk_softc *sc = io->io_sc;
+	struct pci_vtblk_queue *q = io->io_q;
 
-	pthread_mutex_lock(&sc->vsc_mtx);
+	pthread_mutex_lock(&q->vbq_mtx);
 	pci_vtblk_done_locked(br, err);
-	pthread_mutex_unlock(&sc->vsc_mtx);
+	pthread_mutex_unlock(&q->vbq_mtx);
 }
 
 static void
-pci_vtblk_proc(struct pci_vtblk_softc *sc, struct vqueue_info *vq)
+pci_vtblk_proc(struct pci_vtblk_softc *sc, struct pci_vtblk_queue *q)
 {
+	struct vqueue_info *vq = q->vbq_vq;
 	struct virtio_blk_hdr *vbh;
+	struct virtio_blk_discard *vbd;
 	struct pci_vtblk_ioreq *io;
 	int i, n;
 	int err;
@@ -233,7 +347,7 @@ pci_vtblk_proc(struct pci_vtblk_softc *sc, struct vqueue_info *vq)
 	 */
 	assert(n >= 2 && n <= BLOCKIF_IOV_MAX + 2);
 
-	io = &sc->vbsc_ios[idx];
+	io = &q->vbq_ios[idx];
 	assert((flags[0] & VRING_DESC_F_WRITE) == 0);
 	assert(iov[0].iov_len == sizeof(struct virtio_blk_hdr));
 	vbh = iov[0].iov_base;
@@ -251,7 +365,8 @@ pci_vtblk_proc(struct pci_vtblk_softc *sc, struct vqueue_info *vq)
 	 * we don't advertise the capability.
 	 */
 	type = vbh->vbh_type & ~VBH_FLAG_BARRIER;
-	writeop = (type == VBH_OP_WRITE);
+	writeop = (type == VBH_OP_WRITE || type == VBH_OP_DISCARD ||
+	    type == VBH_OP_WRITE_ZEROES);
 
 	iolen = 0;
 	for (i = 1; i < n; i++) {
@@ -269,16 +384,46 @@ pci_vtblk_proc(struct pci_vtblk_softc *sc, struct vqueue_info *vq)
 	DPRINTF(("virtio-block: %s op, %zd bytes, %d segs\n\r", 
 		 writeop ? "write" : "read/ident", iolen, i - 1));
 
+	/* Reads and writes are of whole sectors */
+	if ((type == VBH_OP_READ || type == VBH_OP_WRITE) &&
+	    (iolen & (DEV_BSIZE - 1)) != 0) {
+		pci_vtblk_done_locked(&io->io_req, EINVAL);
+		return;
+	}
+
 	switch (type) {
 	case VBH_OP_READ:
-		err = blockif_read(sc->bc, &io->io_req);
+		err = blockif_read(q->vbq_bc, &io->io_req);
 		break;
 	case VBH_OP_WRITE:
-		err = blockif_write(sc->bc, &io->io_req);
+		err = blockif_write(q->vbq_bc, &io->io_req);
 		break;
 	case VBH_OP_FLUSH:
 	case VBH_OP_FLUSH_OUT:
-		err = blockif_flush(sc->bc, &io->io_req);
+		err = blockif_flush(q->vbq_bc, &io->io_req);
+		break;
+	case VBH_OP_DISCARD:
+	case VBH_OP_WRITE_ZEROES:
+		/* We advertise a single segment per request */
+		if (n != 2 || iov[1].iov_len < sizeof(struct virtio_blk_discard)) {
+			pci_vtblk_done_locked(&io->io_req, EINVAL);
+			return;
+		}
+		vbd = iov[1].iov_base;
+		if (vbd->vbd_num_sectors > VTBLK_MAX_DISCARD_SECT ||
+		    vbd->vbd_sector > sc->vbsc_cfg.vbc_capacity ||
+		    vbd->vbd_num_sectors >
+		    sc->vbsc_cfg.vbc_capacity - vbd->vbd_sector) {
+			pci_vtblk_done_locked(&io->io_req, EINVAL);
+			return;
+		}
+		io->io_req.br_iovcnt = 0;
+		io->io_req.br_offset = (off_t) (vbd->vbd_sector * DEV_BSIZE);
+		io->io_req.br_resid = ((ssize_t) vbd->vbd_num_sectors) * DEV_BSIZE;
+		if (type == VBH_OP_DISCARD)
+			err = blockif_delete(q->vbq_bc, &io->io_req);
+		else
+			err = blockif_zero(q->vbq_bc, &io->io_req);
 		break;
 	case VBH_OP_IDENT:
 		/* Assume a single buffer */
@@ -286,49 +431,285 @@ pci_vtblk_proc(struct pci_vtblk_softc *sc, struct vqueue_info *vq)
 		memset(iov[1].iov_base, 0, iov[1].iov_len);
 		strncpy(iov[1].iov_base, sc->vbsc_ident,
 		    MIN(iov[1].iov_len, sizeof(sc->vbsc_ident)));
-		/* xhyve: FIXME */
 		pci_vtblk_done_locked(&io->io_req, 0);
 		return;
 	default:
-		/* xhyve: FIXME */
 		pci_vtblk_done_locked(&io->io_req, EOPNOTSUPP);
 		return;
 	}
 	assert(err == 0);
 }
 
+/*
+ * Take every request off the avail ring. Called with the queue lock held.
+ */
+static void
+pci_vtblk_proc_all(struct pci_vtblk_softc *sc, struct pci_vtblk_queue *q)
+{
+	struct vqueue_info *vq = q->vbq_vq;
+
+	while (vq_has_descs(vq))
+		pci_vtblk_proc(sc, q);
+	if (q->vbq_inline && vq_ring_ready(vq))
+		vq_endchains(vq, 1);
+}
+
 static void
 pci_vtblk_notify(void *vsc, struct vqueue_info *vq)
 {
 	struct pci_vtblk_softc *sc = vsc;
+	struct pci_vtblk_queue *q = &sc->vbsc_queues[vq->vq_num];
+
+	pthread_mutex_lock(&q->vbq_mtx);
+	if (q->vbq_pollwin != 0) {
+		/* Wake the polling thread, which does the work */
+		q->vbq_kicked = 1;
+		pthread_cond_signal(&q->vbq_pollcond);
+	} else
+		pci_vtblk_proc_all(sc, q);
+	pthread_mutex_unlock(&q->vbq_mtx);
+}
 
-	while (vq_has_descs(vq))
-		pci_vtblk_proc(sc, vq);
+/*
+ * Polling thread of a queue. After a kick it turns guest notifications
+ * off and watches the avail ring, which the guest then fills without
+ * exiting, until nothing has arrived for the polling window. The ring is
+ * only looked at with the queue lock held, since a reset may clear it.
+ */
+static void *
+pci_vtblk_poll_thr(void *arg)
+{
+	struct pci_vtblk_queue *q = arg;
+	struct vqueue_info *vq = q->vbq_vq;
+	uint64_t deadline;
+	int busy;
+
+	pthread_mutex_lock(&q->vbq_mtx);
+	for (;;) {
+		while (!q->vbq_kicked && !q->vbq_pollstop)
+			pthread_cond_wait(&q->vbq_pollcond, &q->vbq_mtx);
+		if (q->vbq_pollstop)
+			break;
+		q->vbq_kicked = 0;
+		if (vq_ring_ready(vq))
+			vq->vq_used->vu_flags |= VRING_USED_F_NO_NOTIFY;
+		pci_vtblk_proc_all(q->vbq_sc, q);
+		pthread_mutex_unlock(&q->vbq_mtx);
+
+		deadline = mach_absolute_time() + q->vbq_pollwin;
+		while (mach_absolute_time() < deadline) {
+			pthread_mutex_lock(&q->vbq_mtx);
+			busy = vq_has_descs(vq) && !q->vbq_pollstop;
+			if (busy)
+				pci_vtblk_proc_all(q->vbq_sc, q);
+			pthread_mutex_unlock(&q->vbq_mtx);
+			if (busy)
+				deadline = mach_absolute_time() + q->vbq_pollwin;
+			else
+				cpu_spinwait();
+		}
+
+		pthread_mutex_lock(&q->vbq_mtx);
+		if (q->vbq_pollstop)
+			break;
+		if (!vq_ring_ready(vq))
+			continue;
+		/*
+		 * The guest may have queued a request after the last look but
+		 * before it sees notifications back on; catch it here.
+		 */
+		vq->vq_used->vu_flags &= ~VRING_USED_F_NO_NOTIFY;
+		mb();
+		if (vq_has_descs(vq))
+			q->vbq_kicked = 1;
+	}
+	pthread_mutex_unlock(&q->vbq_mtx);
+	return (NULL);
+}
+
+/*
+ * Stop the polling threads of every device at exit, so that they are not
+ * submitting requests while blockif writes back its caches.
+ */
+static void
+pci_vtblk_poll_stop(void)
+{
+	struct pci_vtblk_softc *sc;
+	struct pci_vtblk_queue *q;
+	int i;
+
+	for (sc = pci_vtblk_poll_head; sc != NULL; sc = sc->vbsc_pollnext) {
+		for (i = 0; i < sc->vbsc_nq; i++) {
+			q = &sc->vbsc_queues[i];
+			pthread_mutex_lock(&q->vbq_mtx);
+			q->vbq_pollstop = 1;
+			pthread_cond_signal(&q->vbq_pollcond);
+			pthread_mutex_unlock(&q->vbq_mtx);
+		}
+		for (i = 0; i < sc->vbsc_nq; i++)
+			pthread_join(sc->vbsc_queues[i].vbq_polltid, NULL);
+	}
+	pci_vtblk_poll_head = NULL;
+}
+
+static void
+pci_vtblk_free(struct pci_vtblk_softc *sc)
+{
+	int i;
+
+	for (i = 0; i < sc->vbsc_nq; i++) {
+		if (sc->vbsc_queues[i].vbq_bc != NULL)
+			blockif_close(sc->vbsc_queues[i].vbq_bc);
+		free(sc->vbsc_queues[i].vbq_ios);
+	}
+	free(sc->vbsc_queues);
+	free(sc->vbsc_vqs);
+	free(sc);
+}
+
+/*
+ * Pull the options handled by the virtio-blk emulation itself out of the
+ * device option string, returning the remainder for blockif_open. Unless
+ * a queue depth is given, one matching the ring size is requested so the
+ * guest can never overrun blockif.
+ */
+static char *
+pci_vtblk_opts(const char *opts, int *ringsz, int *nq, int *pollus)
+{
+	char *bopts, *xopts, *nopt, *cp;
+	size_t len;
+	int qdepth;
+
+	len = strlen(opts) + sizeof(",qdepth=32768");
+	bopts = calloc(1, len);
+	nopt = xopts = strdup(opts);
+	if (bopts == NULL || nopt == NULL) {
+		free(bopts);
+		free(nopt);
+		return (NULL);
+	}
+	qdepth = 0;
+	while (xopts != NULL) {
+		cp = strsep(&xopts, ",");
+		if (cp != nopt && sscanf(cp, "ringsz=%d", ringsz) == 1) {
+			if (*ringsz < 1 || *ringsz > VTBLK_MAXRINGSZ ||
+			    !powerof2(*ringsz)) {
+				fprintf(stderr, "virtio-block: invalid ring size "
+				    "%d\n", *ringsz);
+				free(bopts);
+				free(nopt);
+				return (NULL);
+			}
+			continue;
+		}
+		if (cp != nopt && sscanf(cp, "queues=%d", nq) == 1) {
+			if (*nq < 1 || *nq > VTBLK_MAXQUEUES) {
+				fprintf(stderr, "virtio-block: invalid number "
+				    "of queues %d\n", *nq);
+				free(bopts);
+				free(nopt);
+				return (NULL);
+			}
+			continue;
+		}
+		if (cp != nopt && sscanf(cp, "poll=%d", pollus) == 1) {
+			if (*pollus < 0 || *pollus > VTBLK_MAXPOLL) {
+				fprintf(stderr, "virtio-block: invalid polling "
+				    "window %d\n", *pollus);
+				free(bopts);
+				free(nopt);
+				return (NULL);
+			}
+			continue;
+		}
+		if (cp != nopt && !strncmp(cp, "qdepth=", 7))
+			qdepth = 1;
+		if (cp != nopt)
+			strlcat(bopts, ",", len);
+		strlcat(bopts, cp, len);
+	}
+	if (*ringsz != 0 && !qdepth)
+		snprintf(bopts + strlen(bopts), len - strlen(bopts),
+		    ",qdepth=%d", *ringsz);
+	free(nopt);
+	return (bopts);
 }
 
 static int
 pci_vtblk_init(struct pci_devinst *pi, char *opts)
 {
 	char bident[sizeof("XX:X:X")];
+	mach_timebase_info_data_t tb;
 	struct blockif_ctxt *bctxt;
 	MD5_CTX mdctx;
 	u_char digest[16];
 	struct pci_vtblk_softc *sc;
 	off_t size;
-	int i, sectsz, sts, sto;
+	char *bopts;
+	int i, j, sectsz, sts, sto, ringsz, qsz, nq, pollus;
 
 	if (opts == NULL) {
 		printf("virtio-block: backing device required\n");
 		return (1);
 	}
 
+	ringsz = 0;
+	nq = 1;
+	pollus = 0;
+	bopts = pci_vtblk_opts(opts, &ringsz, &nq, &pollus);
+	if (bopts == NULL)
+		return (1);
+
+	sc = calloc(1, sizeof(struct pci_vtblk_softc));
+	if (sc == NULL) {
+		perror("calloc");
+		free(bopts);
+		return (1);
+	}
+	sc->vbsc_queues = calloc(((size_t) nq), sizeof(struct pci_vtblk_queue));
+	sc->vbsc_vqs = calloc(((size_t) nq), sizeof(struct vqueue_info));
+	if (sc->vbsc_queues == NULL || sc->vbsc_vqs == NULL) {
+		perror("calloc");
+		free(bopts);
+		pci_vtblk_free(sc);
+		return (1);
+	}
+	sc->vbsc_nq = nq;
+
 	/*
-	 * The supplied backing file has to exist
+	 * The supplied backing file has to exist. Each queue gets its own
+	 * blockif context on it.
 	 */
 	snprintf(bident, sizeof(bident), "%d:%d", pi->pi_slot, pi->pi_func);
-	bctxt = blockif_open(opts, bident);
-	if (bctxt == NULL) {       	
-		perror("Could not open backing file");
+	for (i = 0; i < nq; i++) {
+		bctxt = blockif_open(bopts, bident);
+		if (bctxt == NULL) {
+			perror("Could not open backing file");
+			free(bopts);
+			pci_vtblk_free(sc);
+			return (1);
+		}
+		sc->vbsc_queues[i].vbq_bc = bctxt;
+		sc->vbsc_queues[i].vbq_inline = blockif_inline(bctxt);
+	}
+	free(bopts);
+	bctxt = sc->vbsc_queues[0].vbq_bc;
+
+	/*
+	 * Every ring slot may hold an outstanding request, so the ring
+	 * cannot be larger than the blockif queue. Without an explicit
+	 * size, grow the ring to the largest power of two the queue allows.
+	 */
+	qsz = blockif_queuesz(bctxt);
+	if (ringsz == 0) {
+		ringsz = VTBLK_RINGSZ;
+		while (ringsz * 2 <= qsz && ringsz * 2 <= VTBLK_MAXRINGSZ)
+			ringsz *= 2;
+	}
+	if (ringsz > qsz) {
+		fprintf(stderr, "virtio-block: ring size %d exceeds queue "
+		    "depth %d\n", ringsz, qsz);
+		pci_vtblk_free(sc);
 		return (1);
 	}
 
@@ -336,24 +717,53 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 	sectsz = blockif_sectsz(bctxt);
 	blockif_psectsz(bctxt, &sts, &sto);
 
-	sc = calloc(1, sizeof(struct pci_vtblk_softc));
-	sc->bc = bctxt;
-	for (i = 0; i < VTBLK_RINGSZ; i++) {
-		struct pci_vtblk_ioreq *io = &sc->vbsc_ios[i];
-		io->io_req.br_callback = pci_vtblk_done;
-		io->io_req.br_param = io;
-		io->io_sc = sc;
-		io->io_idx = (uint16_t) i;
+	for (j = 0; j < nq; j++) {
+		struct pci_vtblk_queue *q = &sc->vbsc_queues[j];
+
+		pthread_mutex_init(&q->vbq_mtx, NULL);
+		pthread_cond_init(&q->vbq_pollcond, NULL);
+		q->vbq_sc = sc;
+		q->vbq_vq = &sc->vbsc_vqs[j];
+		q->vbq_ios = calloc(((size_t) ringsz),
+			sizeof(struct pci_vtblk_ioreq));
+		if (q->vbq_ios == NULL) {
+			perror("calloc");
+			pci_vtblk_free(sc);
+			return (1);
+		}
+		for (i = 0; i < ringsz; i++) {
+			struct pci_vtblk_ioreq *io = &q->vbq_ios[i];
+			io->io_req.br_callback = q->vbq_inline ?
+			    pci_vtblk_done_inline : pci_vtblk_done;
+			io->io_req.br_param = io;
+			io->io_sc = sc;
+			io->io_q = q;
+			io->io_idx = (uint16_t) i;
+		}
 	}
 
 	pthread_mutex_init(&sc->vsc_mtx, NULL);
 
 	/* init virtio softc and virtqueues */
-	vi_softc_linkup(&sc->vbsc_vs, &vtblk_vi_consts, sc, pi, &sc->vbsc_vq);
+	sc->vbsc_consts = vtblk_vi_consts;
+	sc->vbsc_consts.vc_nvq = nq;
+	if (nq > 1)
+		sc->vbsc_consts.vc_hv_caps |= VTBLK_F_MQ;
+	if (blockif_candelete(bctxt))
+		sc->vbsc_consts.vc_hv_caps |= VTBLK_F_DISCARD;
+	if (!blockif_is_ro(bctxt))
+		sc->vbsc_consts.vc_hv_caps |= VTBLK_F_WRITE_ZEROES;
+	/* Let the guest see, and turn off, a write-back cache */
+	if (blockif_get_wce(bctxt))
+		sc->vbsc_consts.vc_hv_caps |= VTBLK_F_CONFIG_WCE;
+	vi_softc_linkup(&sc->vbsc_vs, &sc->vbsc_consts, sc, pi, sc->vbsc_vqs);
 	sc->vbsc_vs.vs_mtx = &sc->vsc_mtx;
+	/* queue notifies take the per-queue lock, see pci_vtblk_notify */
+	sc->vbsc_vs.vs_flags |= VIRTIO_QNOTIFY_NOLOCK;
 
-	sc->vbsc_vq.vq_qsize = VTBLK_RINGSZ;
-	/* sc->vbsc_vq.vq_notify = we have no per-queue notify */
+	for (j = 0; j < nq; j++)
+		sc->vbsc_vqs[j].vq_qsize = (uint16_t) ringsz;
+	/* sc->vbsc_vqs[j].vq_notify = we have no per-queue notify */
 
 	/*
 	 * Create an identifier for the backing file. Use parts of the
@@ -380,7 +790,16 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 	    (uint8_t) ((sto != 0) ? ((sts - sto) / sectsz) : 0);
 	sc->vbsc_cfg.vbc_topology.min_io_size = 0;
 	sc->vbsc_cfg.vbc_topology.opt_io_size = 0;
-	sc->vbsc_cfg.vbc_writeback = 0;
+	sc->vbsc_cfg.vbc_writeback = (uint8_t) blockif_get_wce(bctxt);
+	sc->vbsc_cfg.vbc_num_queues = (uint16_t) nq;
+	sc->vbsc_cfg.vbc_max_discard_sectors = VTBLK_MAX_DISCARD_SECT;
+	sc->vbsc_cfg.vbc_max_discard_seg = 1;
+	sc->vbsc_cfg.vbc_discard_sector_alignment =
+	    (uint32_t) MAX(sts, sectsz) / DEV_BSIZE;
+	sc->vbsc_cfg.vbc_max_write_zeroes_sectors = VTBLK_MAX_DISCARD_SECT;
+	sc->vbsc_cfg.vbc_max_write_zeroes_seg = 1;
+	sc->vbsc_cfg.vbc_write_zeroes_may_unmap =
+	    (uint8_t) blockif_candelete(bctxt);
 
 	/*
 	 * Should we move some of this into virtio.c?  Could
@@ -394,18 +813,43 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 	pci_set_cfgdata16(pi, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
 	if (vi_intr_init(&sc->vbsc_vs, 1, fbsdrun_virtio_msix())) {
-		blockif_close(sc->bc);
-		free(sc);
+		pci_vtblk_free(sc);
 		return (1);
 	}
 	vi_set_io_bar(&sc->vbsc_vs, 0);
+
+	if (pollus != 0) {
+		/*
+		 * Registered after blockif's own exit handler, which is in
+		 * place once a context is open, so it runs before it.
+		 */
+		if (pci_vtblk_poll_head == NULL)
+			atexit(pci_vtblk_poll_stop);
+		sc->vbsc_pollnext = pci_vtblk_poll_head;
+		pci_vtblk_poll_head = sc;
+		mach_timebase_info(&tb);
+		for (j = 0; j < nq; j++) {
+			struct pci_vtblk_queue *q = &sc->vbsc_queues[j];
+
+			q->vbq_pollwin = ((uint64_t) pollus) * 1000 * tb.denom /
+			    tb.numer;
+			pthread_create(&q->vbq_polltid, NULL, pci_vtblk_poll_thr,
+			    q);
+		}
+	}
 	return (0);
 }
 
 static int
-pci_vtblk_cfgwrite(UNUSED void *vsc, int offset, UNUSED int size,
-	UNUSED uint32_t value)
+pci_vtblk_cfgwrite(void *vsc, int offset, int size, uint32_t value)
 {
+	struct pci_vtblk_softc *sc = vsc;
+
+	if (offset == (int) offsetof(struct vtblk_config, vbc_writeback) &&
+	    size == 1 && (sc->vbsc_consts.vc_hv_caps & VTBLK_F_CONFIG_WCE)) {
+		pci_vtblk_set_wce(sc, value != 0);
+		return (0);
+	}
 	DPRINTF(("vtblk: write to readonly reg %d\n\r", offset));
 	return (1);
 }
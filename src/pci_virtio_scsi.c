@@ -0,0 +1,1422 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Virtio SCSI controller. Each disk given to the device is a LUN of
+ * target 0, backed by its own blockif context, which the request queues
+ * share. The SCSI commands a disk driver needs are emulated here; reads,
+ * writes, cache flushes and UNMAP go to blockif, as many at a time as the
+ * guest queues. There is no hotplug, so the event queue stays idle.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <xhyve/support/misc.h>
+#include <xhyve/support/atomic.h>
+#include <xhyve/support/endian.h>
+#include <xhyve/support/linker_set.h>
+#include <xhyve/support/md5.h>
+#include <xhyve/xhyve.h>
+#include <xhyve/pci_emul.h>
+#include <xhyve/virtio.h>
+#include <xhyve/block_if.h>
+#include <xhyve/block_backend.h>
+
+#define VTSCSI_RINGSZ 128
+#define VTSCSI_MAXRINGSZ 32768
+#define VTSCSI_CTLRINGSZ 64	/* control and event queues */
+#define VTSCSI_MAXQUEUES 32
+#define VTSCSI_MAXLUNS 256
+
+#define VTSCSI_CTLQ 0
+#define VTSCSI_EVTQ 1
+#define VTSCSI_REQQ 2		/* first request queue */
+
+#define VTSCSI_CDB_SIZE 32	/* default and largest CDB */
+#define VTSCSI_SENSE_SIZE 96	/* default sense buffer */
+#define VTSCSI_FIXED_SENSE 18	/* what we return of it */
+
+/* Descriptors of a request: header, response and the data */
+#define VTSCSI_IOV_MAX (BLOCKIF_IOV_MAX + 4)
+#define VTSCSI_RESP_IOV 4
+
+#define VTSCSI_SERIAL_BYTES 20 + 1
+
+/* Largest UNMAP, in bytes */
+#define VTSCSI_MAX_UNMAP (1ULL << 32)
+
+/* Response codes */
+#define VTSCSI_S_OK 0
+#define VTSCSI_S_OVERRUN 1
+#define VTSCSI_S_BAD_TARGET 3
+#define VTSCSI_S_FAILURE 9
+#define VTSCSI_S_FUNCTION_REJECTED 11
+#define VTSCSI_S_INCORRECT_LUN 12
+
+/* Control queue requests */
+#define VTSCSI_T_TMF 0
+#define	VTSCSI_T_TMF_ABORT_TASK 0
+#define	VTSCSI_T_TMF_ABORT_TASK_SET 1
+#define	VTSCSI_T_TMF_CLEAR_TASK_SET 3
+#define	VTSCSI_T_TMF_I_T_NEXUS_RESET 4
+#define	VTSCSI_T_TMF_LOGICAL_UNIT_RESET 5
+#define VTSCSI_T_AN_QUERY 1
+#define VTSCSI_T_AN_SUBSCRIBE 2
+
+/* SCSI commands */
+#define SCSI_TEST_UNIT_READY 0x00
+#define SCSI_REQUEST_SENSE 0x03
+#define SCSI_READ_6 0x08
+#define SCSI_WRITE_6 0x0a
+#define SCSI_INQUIRY 0x12
+#define SCSI_MODE_SENSE_6 0x1a
+#define SCSI_START_STOP_UNIT 0x1b
+#define SCSI_PREVENT_ALLOW 0x1e
+#define SCSI_READ_CAPACITY_10 0x25
+#define SCSI_READ_10 0x28
+#define SCSI_WRITE_10 0x2a
+#define SCSI_VERIFY_10 0x2f
+#define SCSI_SYNCHRONIZE_CACHE_10 0x35
+#define SCSI_UNMAP 0x42
+#define SCSI_MODE_SENSE_10 0x5a
+#define SCSI_READ_16 0x88
+#define SCSI_WRITE_16 0x8a
+#define SCSI_VERIFY_16 0x8f
+#define SCSI_SYNCHRONIZE_CACHE_16 0x91
+#define SCSI_SERVICE_ACTION_IN_16 0x9e
+#define	SCSI_SAI_READ_CAPACITY_16 0x10
+#define SCSI_REPORT_LUNS 0xa0
+#define SCSI_READ_12 0xa8
+#define SCSI_WRITE_12 0xaa
+#define SCSI_VERIFY_12 0xaf
+
+/* Status */
+#define SCSI_STATUS_OK 0x00
+#define SCSI_STATUS_CHECK_COND 0x02
+#define SCSI_STATUS_TASK_SET_FULL 0x28
+
+/* Sense keys */
+#define SSD_KEY_NO_SENSE 0x00
+#define SSD_KEY_HARDWARE_ERROR 0x04
+#define SSD_KEY_ILLEGAL_REQUEST 0x05
+#define SSD_KEY_DATA_PROTECT 0x07
+
+/* Additional sense codes */
+#define SSD_ASC_PARAM_LIST_LENGTH 0x1a
+#define SSD_ASC_INVALID_OPCODE 0x20
+#define SSD_ASC_LBA_OUT_OF_RANGE 0x21
+#define SSD_ASC_INVALID_FIELD_CDB 0x24
+#define SSD_ASC_LUN_NOT_SUPPORTED 0x25
+#define SSD_ASC_INVALID_FIELD_PARAM 0x26
+#define SSD_ASC_WRITE_PROTECTED 0x27
+#define SSD_ASC_INTERNAL_FAILURE 0x44
+
+/*
+ * Host capabilities
+ */
+#define VTSCSI_S_HOSTCAPS \
+	(VIRTIO_RING_F_INDIRECT_DESC) /* indirect descriptors */
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpacked"
+/*
+ * Config space "registers"
+ */
+struct vtscsi_config {
+	uint32_t vsc_num_queues;
+	uint32_t vsc_seg_max;
+	uint32_t vsc_max_sectors;
+	uint32_t vsc_cmd_per_lun;
+	uint32_t vsc_event_info_size;
+	uint32_t vsc_sense_size;
+	uint32_t vsc_cdb_size;
+	uint16_t vsc_max_channel;
+	uint16_t vsc_max_target;
+	uint32_t vsc_max_lun;
+} __packed;
+
+/*
+ * Request queue header, followed by any data-out, and the response the
+ * device writes, followed by any data-in. The CDB and sense buffer are as
+ * long as the config says.
+ */
+struct virtio_scsi_cmd_req {
+	uint8_t vcr_lun[8];
+	uint64_t vcr_id;
+	uint8_t vcr_task_attr;
+	uint8_t vcr_prio;
+	uint8_t vcr_crn;
+	uint8_t vcr_cdb[VTSCSI_CDB_SIZE];
+} __packed;
+
+struct virtio_scsi_cmd_resp {
+	uint32_t vcs_sense_len;
+	uint32_t vcs_resid;
+	uint16_t vcs_status_qualifier;
+	uint8_t vcs_status;
+	uint8_t vcs_response;
+	uint8_t vcs_sense[VTSCSI_FIXED_SENSE];
+} __packed;
+
+/*
+ * Control queue requests
+ */
+struct virtio_scsi_ctrl_tmf {
+	uint32_t vct_type;
+	uint32_t vct_subtype;
+	uint8_t vct_lun[8];
+	uint64_t vct_id;
+} __packed;
+
+struct virtio_scsi_ctrl_an_resp {
+	uint32_t vca_event_actual;
+	uint8_t vca_response;
+} __packed;
+
+#pragma clang diagnostic pop
+
+/*
+ * Debug printf
+ */
+static int pci_vtscsi_debug;
+#define DPRINTF(params) if (pci_vtscsi_debug) printf params
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct pci_vtscsi_ioreq {
+	struct blockif_req io_req;
+	struct pci_vtscsi_queue *io_q;
+	struct pci_vtscsi_lun *io_lun;	/* NULL for a TMF on every LUN */
+	struct iovec io_resp[VTSCSI_RESP_IOV];
+	int io_nresp;
+	uint32_t io_resid;		/* data buffer not transferred */
+	uint32_t io_dlen;		/* data-in returned on success */
+	uint16_t io_idx;
+	/* TMF waiting for io_lun to go idle, from before reset io_gen */
+	int io_waiting;
+	u_int io_gen;
+};
+
+struct pci_vtscsi_lun {
+	struct blockif_ctxt *vsl_bc;
+	uint64_t vsl_nblocks;
+	int vsl_sectsz;
+	int vsl_pexp;		/* log2 of logical blocks per physical */
+	int vsl_palign;		/* first aligned logical block */
+	int vsl_inline;		/* blockif completes requests as they are made */
+	int vsl_ro;
+	int vsl_candelete;
+	volatile u_int vsl_busy;	/* requests in blockif */
+	char vsl_serial[VTSCSI_SERIAL_BYTES];
+};
+
+/*
+ * Per-queue state. Each virtqueue has its own lock, as in virtio-blk.
+ * Completing the last request on a LUN may complete waiting TMFs, so a
+ * request queue lock can be held while the control queue lock is taken:
+ * request queues come before the control queue, and all of them before
+ * the softc lock.
+ */
+struct pci_vtscsi_queue {
+	pthread_mutex_t vsq_mtx;
+	struct vqueue_info *vsq_vq;
+	struct pci_vtscsi_softc *vsq_sc;
+	struct pci_vtscsi_ioreq *vsq_ios;
+};
+
+/*
+ * Per-device softc
+ */
+struct pci_vtscsi_softc {
+	struct virtio_softc vss_vs;
+	pthread_mutex_t vss_mtx;
+	struct virtio_consts vss_consts;
+	struct vqueue_info *vss_vqs;
+	struct pci_vtscsi_queue *vss_queues;	/* control, event, requests */
+	int vss_nvq;
+	struct pci_vtscsi_lun *vss_luns;
+	int vss_nluns;
+	volatile u_int vss_tmfs;	/* TMFs waiting for LUNs to go idle */
+	volatile u_int vss_gen;		/* device resets */
+	struct vtscsi_config vss_cfg;
+};
+
+#pragma clang diagnostic pop
+
+static void pci_vtscsi_reset(void *);
+static void pci_vtscsi_notify(void *, struct vqueue_info *);
+static int pci_vtscsi_cfgread(void *, int, int, uint32_t *);
+static int pci_vtscsi_cfgwrite(void *, int, int, uint32_t);
+static void pci_vtscsi_tmf_check(struct pci_vtscsi_softc *);
+
+static struct virtio_consts vtscsi_vi_consts = {
+	"vtscsi", /* our name */
+	VTSCSI_REQQ + 1, /* number of virtqueues, overridden by queues= */
+	sizeof(struct vtscsi_config), /* config reg size */
+	pci_vtscsi_reset, /* reset */
+	pci_vtscsi_notify, /* device-wide qnotify */
+	pci_vtscsi_cfgread, /* read PCI config */
+	pci_vtscsi_cfgwrite, /* write PCI config */
+	NULL, /* apply negotiated features */
+	VTSCSI_S_HOSTCAPS, /* our capabilities */
+};
+
+static size_t
+pci_vtscsi_iov_to_buf(const struct iovec *iov, int cnt, void *buf, size_t len)
+{
+	size_t done, l;
+	int i;
+
+	done = 0;
+	for (i = 0; i < cnt && done < len; i++) {
+		l = MIN(iov[i].iov_len, len - done);
+		memcpy((uint8_t *) buf + done, iov[i].iov_base, l);
+		done += l;
+	}
+	return (done);
+}
+
+static size_t
+pci_vtscsi_buf_to_iov(const void *buf, size_t len, const struct iovec *iov,
+	int cnt)
+{
+	size_t done, l;
+	int i;
+
+	done = 0;
+	for (i = 0; i < cnt && done < len; i++) {
+		l = MIN(iov[i].iov_len, len - done);
+		memcpy(iov[i].iov_base, (const uint8_t *) buf + done, l);
+		done += l;
+	}
+	return (done);
+}
+
+static void
+pci_vtscsi_reset(void *vsc)
+{
+	struct pci_vtscsi_softc *sc = vsc;
+	int i;
+
+	DPRINTF(("vtscsi: device reset requested !\n"));
+	/*
+	 * As in virtio-blk, the rings are cleared under every queue lock,
+	 * taken before the softc lock our caller holds. The control queue
+	 * goes last; see struct pci_vtscsi_queue.
+	 */
+	pthread_mutex_unlock(&sc->vss_mtx);
+	for (i = sc->vss_nvq - 1; i >= 0; i--)
+		pthread_mutex_lock(&sc->vss_queues[i].vsq_mtx);
+	pthread_mutex_lock(&sc->vss_mtx);
+	vi_reset_dev(&sc->vss_vs);
+	sc->vss_cfg.vsc_sense_size = VTSCSI_SENSE_SIZE;
+	sc->vss_cfg.vsc_cdb_size = VTSCSI_CDB_SIZE;
+	/* TMFs still waiting belong to the old rings */
+	atomic_add_int(&sc->vss_gen, 1);
+	pci_vtscsi_tmf_check(sc);
+	for (i = 0; i < sc->vss_nvq; i++)
+		pthread_mutex_unlock(&sc->vss_queues[i].vsq_mtx);
+}
+
+/*
+ * Complete a request on a request queue with the given response, status
+ * and, for a check condition, sense, along with dlen bytes of data-in.
+ * Called with the queue lock held.
+ */
+static void
+pci_vtscsi_respond(struct pci_vtscsi_ioreq *io, uint8_t response,
+	uint8_t status, uint8_t key, uint8_t asc, uint32_t dlen)
+{
+	struct vqueue_info *vq = io->io_q->vsq_vq;
+	struct virtio_scsi_cmd_resp resp;
+	size_t len;
+
+	memset(&resp, 0, sizeof(resp));
+	len = offsetof(struct virtio_scsi_cmd_resp, vcs_sense);
+	if (response == VTSCSI_S_OK && status == SCSI_STATUS_CHECK_COND) {
+		/* Fixed format, current error */
+		resp.vcs_sense[0] = 0x70;
+		resp.vcs_sense[2] = key;
+		resp.vcs_sense[7] = VTSCSI_FIXED_SENSE - 8;
+		resp.vcs_sense[12] = asc;
+		resp.vcs_sense_len = MIN(VTSCSI_FIXED_SENSE,
+		    io->io_q->vsq_sc->vss_cfg.vsc_sense_size);
+		len += resp.vcs_sense_len;
+	}
+	resp.vcs_resid = io->io_resid;
+	resp.vcs_status = status;
+	resp.vcs_response = response;
+
+	if (!vq_ring_ready(vq))
+		return;
+	pci_vtscsi_buf_to_iov(&resp, len, io->io_resp, io->io_nresp);
+	vq_relchain(vq, io->io_idx,
+	    (uint32_t) blockif_iov_len(io->io_resp, io->io_nresp) + dlen);
+}
+
+static void
+pci_vtscsi_check(struct pci_vtscsi_ioreq *io, uint8_t key, uint8_t asc)
+{
+	pci_vtscsi_respond(io, VTSCSI_S_OK, SCSI_STATUS_CHECK_COND, key, asc,
+	    0);
+}
+
+/*
+ * Return emulated data-in, up to the allocation length.
+ */
+static void
+pci_vtscsi_datain(struct pci_vtscsi_ioreq *io, const struct iovec *din,
+	int nin, const void *buf, size_t len, size_t alloc)
+{
+	size_t n;
+
+	n = pci_vtscsi_buf_to_iov(buf, MIN(len, alloc), din, nin);
+	io->io_resid = (uint32_t) (blockif_iov_len(din, nin) - n);
+	pci_vtscsi_respond(io, VTSCSI_S_OK, SCSI_STATUS_OK, 0, 0,
+	    (uint32_t) n);
+}
+
+/*
+ * Complete the TMFs whose LUNs have no requests left in blockif, and
+ * drop those from before a reset. Called with the control queue lock held.
+ */
+static void
+pci_vtscsi_tmf_check(struct pci_vtscsi_softc *sc)
+{
+	struct pci_vtscsi_queue *q = &sc->vss_queues[VTSCSI_CTLQ];
+	struct vqueue_info *vq = q->vsq_vq;
+	struct pci_vtscsi_ioreq *io;
+	uint8_t response;
+	int i, j, idle;
+
+	for (i = 0; i < vq->vq_qsize; i++) {
+		io = &q->vsq_ios[i];
+		if (!io->io_waiting)
+			continue;
+		if (io->io_gen == sc->vss_gen) {
+			if (io->io_lun != NULL)
+				idle = (io->io_lun->vsl_busy == 0);
+			else
+				for (idle = 1, j = 0; idle && j < sc->vss_nluns;
+				    j++)
+					idle = (sc->vss_luns[j].vsl_busy == 0);
+			if (!idle)
+				continue;
+		}
+		io->io_waiting = 0;
+		atomic_subtract_int(&sc->vss_tmfs, 1);
+		if (io->io_gen != sc->vss_gen || !vq_ring_ready(vq))
+			continue;
+		response = VTSCSI_S_OK;
+		pci_vtscsi_buf_to_iov(&response, 1, io->io_resp, io->io_nresp);
+		vq_relchain(vq, io->io_idx, 1);
+	}
+	if (vq_ring_ready(vq))
+		vq_endchains(vq, 0);
+}
+
+/*
+ * Account for a request leaving blockif. The spec has a TMF complete only
+ * once the requests it affects have, so the last request on a LUN looks
+ * for TMFs waiting on it.
+ */
+static void
+pci_vtscsi_lun_put(struct pci_vtscsi_softc *sc, struct pci_vtscsi_lun *lun)
+{
+	struct pci_vtscsi_queue *q;
+
+	if (atomic_fetchadd_int(&lun->vsl_busy, (u_int) -1) == 1 &&
+	    sc->vss_tmfs != 0) {
+		q = &sc->vss_queues[VTSCSI_CTLQ];
+		pthread_mutex_lock(&q->vsq_mtx);
+		pci_vtscsi_tmf_check(sc);
+		pthread_mutex_unlock(&q->vsq_mtx);
+	}
+}
+
+static void
+pci_vtscsi_io_done(struct pci_vtscsi_ioreq *io, int err)
+{
+	/* convert errno into sense data */
+	if (err == 0)
+		pci_vtscsi_respond(io, VTSCSI_S_OK, SCSI_STATUS_OK, 0, 0,
+		    io->io_dlen);
+	else if (err == EROFS)
+		pci_vtscsi_check(io, SSD_KEY_DATA_PROTECT,
+		    SSD_ASC_WRITE_PROTECTED);
+	else if (err == EOPNOTSUPP || err == ENOSYS)
+		pci_vtscsi_check(io, SSD_KEY_ILLEGAL_REQUEST,
+		    SSD_ASC_INVALID_OPCODE);
+	else
+		pci_vtscsi_check(io, SSD_KEY_HARDWARE_ERROR,
+		    SSD_ASC_INTERNAL_FAILURE);
+}
+
+/*
+ * Callback of requests to LUNs whose requests blockif runs inline, made
+ * from pci_vtscsi_proc() with the queue lock held; pci_vtscsi_notify()
+ * notifies the guest once for the whole batch.
+ */
+static void
+pci_vtscsi_done_inline(struct blockif_req *br, int err)
+{
+	struct pci_vtscsi_ioreq *io = br->br_param;
+	struct pci_vtscsi_lun *lun = io->io_lun;
+
+	pci_vtscsi_io_done(io, err);
+	pci_vtscsi_lun_put(io->io_q->vsq_sc, lun);
+}
+
+static void
+pci_vtscsi_done(struct blockif_req *br, int err)
+{
+	struct pci_vtscsi_ioreq *io = br->br_param;
+	struct pci_vtscsi_queue *q = io->io_q;
+	struct pci_vtscsi_lun *lun = io->io_lun;
+
+	pthread_mutex_lock(&q->vsq_mtx);
+	pci_vtscsi_io_done(io, err);
+	if (vq_ring_ready(q->vsq_vq))
+		vq_endchains(q->vsq_vq, 0);
+	pthread_mutex_unlock(&q->vsq_mtx);
+	/* The slot may be reused from here on */
+	pci_vtscsi_lun_put(q->vsq_sc, lun);
+}
+
+/*
+ * Hand a request to the LUN's blockif context. A full queue is reported
+ * as TASK SET FULL, and the guest retries once it has fewer outstanding.
+ */
+static void
+pci_vtscsi_submit(struct pci_vtscsi_ioreq *io,
+	int (*op)(struct blockif_ctxt *, struct blockif_req *))
+{
+	struct pci_vtscsi_lun *lun = io->io_lun;
+
+	io->io_req.br_callback = lun->vsl_inline ? pci_vtscsi_done_inline :
+	    pci_vtscsi_done;
+	atomic_add_int(&lun->vsl_busy, 1);
+	if ((*op)(lun->vsl_bc, &io->io_req) != 0) {
+		pci_vtscsi_respond(io, VTSCSI_S_OK, SCSI_STATUS_TASK_SET_FULL,
+		    0, 0, 0);
+		pci_vtscsi_lun_put(io->io_q->vsq_sc, lun);
+	}
+}
+
+static void
+pci_vtscsi_rw(struct pci_vtscsi_ioreq *io, const uint8_t *cdb,
+	const struct iovec *data, int ndata)
+{
+	struct pci_vtscsi_lun *lun = io->io_lun;
+	uint64_t lba, nblocks, len;
+	size_t buflen;
+	int n, writeop;
+
+	switch (cdb[0]) {
+	case SCSI_READ_6:
+	case SCSI_WRITE_6:
+		lba = ((uint64_t) (cdb[1] & 0x1f) << 16) | be16dec(cdb + 2);
+		nblocks = cdb[4] != 0 ? (uint64_t) cdb[4] : 256;
+		break;
+	case SCSI_READ_10:
+	case SCSI_WRITE_10:
+		lba = be32dec(cdb + 2);
+		nblocks = be16dec(cdb + 7);
+		break;
+	case SCSI_READ_12:
+	case SCSI_WRITE_12:
+		lba = be32dec(cdb + 2);
+		nblocks = be32dec(cdb + 6);
+		break;
+	default:
+		lba = be64dec(cdb + 2);
+		nblocks = be32dec(cdb + 10);
+		break;
+	}
+	writeop = (cdb[0] == SCSI_WRITE_6 || cdb[0] == SCSI_WRITE_10 ||
+	    cdb[0] == SCSI_WRITE_12 || cdb[0] == SCSI_WRITE_16);
+
+	if (writeop && lun->vsl_ro) {
+		pci_vtscsi_check(io, SSD_KEY_DATA_PROTECT,
+		    SSD_ASC_WRITE_PROTECTED);
+		return;
+	}
+	if (lba > lun->vsl_nblocks || nblocks > lun->vsl_nblocks - lba) {
+		pci_vtscsi_check(io, SSD_KEY_ILLEGAL_REQUEST,
+		    SSD_ASC_LBA_OUT_OF_RANGE);
+		return;
+	}
+	len = nblocks * (uint64_t) lun->vsl_sectsz;
+	buflen = blockif_iov_len(data, ndata);
+	if (buflen < len) {
+		pci_vtscsi_respond(io, VTSCSI_S_OVERRUN, SCSI_STATUS_OK, 0, 0,
+		    0);
+		return;
+	}
+	io->io_resid = (uint32_t) (buflen - len);
+	if (nblocks == 0) {
+		pci_vtscsi_respond(io, VTSCSI_S_OK, SCSI_STATUS_OK, 0, 0, 0);
+		return;
+	}
+	/* seg_max keeps a well-behaved guest within BLOCKIF_IOV_MAX */
+	n = blockif_iov_slice(data, MIN(ndata, BLOCKIF_IOV_MAX), 0, len,
+	    io->io_req.br_iov);
+	if (blockif_iov_len(io->io_req.br_iov, n) < len) {
+		pci_vtscsi_respond(io, VTSCSI_S_FAILURE, SCSI_STATUS_OK, 0, 0,
+		    0);
+		return;
+	}
+	io->io_req.br_iovcnt = n;
+	io->io_req.br_offset = (off_t) (lba * (uint64_t) lun->vsl_sectsz);
+	io->io_req.br_resid = (ssize_t) len;
+	io->io_dlen = writeop ? 0 : (uint32_t) len;
+
+	DPRINTF(("virtio-scsi: %s %llu blocks at %llu, %d segs\n\r",
+	    writeop ? "write" : "read", nblocks, lba, n));
+
+	pci_vtscsi_submit(io, writeop ? blockif_write : blockif_read);
+}
+
+/*
+ * UNMAP, with the single block descriptor the block limits page allows.
+ */
+static void
+pci_vtscsi_unmap(struct pci_vtscsi_ioreq *io, const uint8_t *cdb,
+	const struct iovec *dout, int nout)
+{
+	struct pci_vtscsi_lun *lun = io->io_lun;
+	uint8_t buf[24];
+	uint64_t lba, nblocks;
+	size_t plen, got;
+	uint16_t bdlen;
+
+	if (!lun->vsl_candelete) {
+		pci_vtscsi_check(io, SSD_KEY_ILLEGAL_REQUEST,
+		    SSD_ASC_INVALID_OPCODE);
+		return;
+	}
+	plen = be16dec(cdb + 7);
+	if (plen == 0) {
+		pci_vtscsi_respond(io, VTSCSI_S_OK, SCSI_STATUS_OK, 0, 0, 0);
+		return;
+	}
+	got = pci_vtscsi_iov_to_buf(dout, nout, buf, MIN(plen, sizeof(buf)));
+	if (got < 8) {
+		pci_vtscsi_check(io, SSD_KEY_ILLEGAL_REQUEST,
+		    SSD_ASC_PARAM_LIST_LENGTH);
+		return;
+	}
+	bdlen = be16dec(buf + 2);
+	if (bdlen == 0) {
+		pci_vtscsi_respond(io, VTSCSI_S_OK, SCSI_STATUS_OK, 0, 0, 0);
+		return;
+	}
+	if (bdlen > 16) {
+		pci_vtscsi_check(io, SSD_KEY_ILLEGAL_REQUEST,
+		    SSD_ASC_INVALID_FIELD_PARAM);
+		return;
+	}
+	if (bdlen < 16 || got < sizeof(buf)) {
+		pci_vtscsi_check(io, SSD_KEY_ILLEGAL_REQUEST,
+		    SSD_ASC_PARAM_LIST_LENGTH);
+		return;
+	}
+	lba = be64dec(buf + 8);
+	nblocks = be32dec(buf + 16);
+	if (lba > lun->vsl_nblocks || nblocks > lun->vsl_nblocks - lba) {
+		pci_vtscsi_check(io, SSD_KEY_ILLEGAL_REQUEST,
+		    SSD_ASC_LBA_OUT_OF_RANGE);
+		return;
+	}
+	if (nblocks == 0) {
+		pci_vtscsi_respond(io, VTSCSI_S_OK, SCSI_STATUS_OK, 0, 0, 0);
+		return;
+	}
+	io->io_req.br_iovcnt = 0;
+	io->io_req.br_offset = (off_t) (lba * (uint64_t) lun->vsl_sectsz);
+	io->io_req.br_resid = (ssize_t) (nblocks * (uint64_t) lun->vsl_sectsz);
+	io->io_dlen = 0;
+	pci_vtscsi_submit(io, blockif_delete);
+}
+
+static void
+pci_vtscsi_flush(struct pci_vtscsi_ioreq *io)
+{
+	io->io_req.br_iovcnt = 0;
+	io->io_req.br_offset = 0;
+	io->io_req.br_resid = 0;
+	io->io_dlen = 0;
+	pci_vtscsi_submit(io, blockif_flush);
+}
+
+/*
+ * INQUIRY: standard data, or one of the vital product data pages. Returns
+ * the length, or -1 for a page we do not have.
+ */
+static int
+pci_vtscsi_inquiry(struct pci_vtscsi_lun *lun, const uint8_t *cdb,
+	uint8_t *buf)
+{
+	static const uint8_t vpd_pages[] = { 0x00, 0x80, 0x83, 0xb0, 0xb1,
+	    0xb2 };
+	uint64_t unmap;
+	size_t slen;
+	int gran;
+
+	memset(buf, 0, 256);
+	if (lun == NULL) {
+		/* Peripheral qualifier 3: no unit here */
+		buf[0] = 0x7f;
+		return (36);
+	}
+	if (!(cdb[1] & 0x01)) {
+		if (cdb[2] != 0)
+			return (-1);
+		buf[2] = 0x06;		/* SPC-4 */
+		buf[3] = 0x02;		/* response data format */
+		buf[4] = 36 - 5;
+		buf[7] = 0x02;		/* CmdQue */
+		memcpy(buf + 8, "BHYVE   ", 8);
+		memcpy(buf + 16, "VIRTUAL DISK    ", 16);
+		memcpy(buf + 32, "1.0 ", 4);
+		return (36);
+	}
+
+	buf[1] = cdb[2];
+	switch (cdb[2]) {
+	case 0x00:
+		/* Supported pages */
+		buf[3] = sizeof(vpd_pages);
+		memcpy(buf + 4, vpd_pages, sizeof(vpd_pages));
+		return (4 + (int) sizeof(vpd_pages));
+	case 0x80:
+		/* Unit serial number */
+		slen = strlen(lun->vsl_serial);
+		buf[3] = (uint8_t) slen;
+		memcpy(buf + 4, lun->vsl_serial, slen);
+		return (4 + (int) slen);
+	case 0x83:
+		/* Device identification: a T10 vendor ID designator */
+		slen = strlen(lun->vsl_serial);
+		buf[4] = 0x02;		/* ASCII */
+		buf[5] = 0x01;		/* T10 vendor ID, of the LUN */
+		buf[7] = (uint8_t) (8 + slen);
+		memcpy(buf + 8, "BHYVE   ", 8);
+		memcpy(buf + 16, lun->vsl_serial, slen);
+		buf[3] = (uint8_t) (4 + buf[7]);
+		return (4 + buf[3]);
+	case 0xb0:
+		/* Block limits */
+		buf[3] = 0x3c;
+		gran = 1 << lun->vsl_pexp;
+		be16enc(buf + 6, (uint16_t) gran);
+		if (lun->vsl_candelete) {
+			unmap = VTSCSI_MAX_UNMAP / (uint64_t) lun->vsl_sectsz;
+			be32enc(buf + 20, (uint32_t) MIN(unmap, 0xffffffffULL));
+			be32enc(buf + 24, 1);
+			be32enc(buf + 28, (uint32_t) gran);
+			be32enc(buf + 32, 0x80000000U |
+			    (uint32_t) lun->vsl_palign);
+		}
+		return (4 + 0x3c);
+	case 0xb1:
+		/* Block device characteristics: not rotating */
+		buf[3] = 0x3c;
+		be16enc(buf + 4, 1);
+		return (4 + 0x3c);
+	case 0xb2:
+		/* Logical block provisioning */
+		buf[3] = 4;
+		if (lun->vsl_candelete) {
+			buf[5] = 0x80;	/* LBPU */
+			buf[6] = 0x02;	/* thin provisioned */
+		}
+		return (8);
+	default:
+		break;
+	}
+	return (-1);
+}
+
+/*
+ * MODE SENSE(6) and (10): the caching and control pages, with a block
+ * descriptor unless the guest asks not to have one.
+ */
+static int
+pci_vtscsi_mode_sense(struct pci_vtscsi_lun *lun, const uint8_t *cdb,
+	uint8_t *buf)
+{
+	uint8_t *p;
+	int hlen, page, pc, ten;
+
+	memset(buf, 0, 256);
+	ten = (cdb[0] == SCSI_MODE_SENSE_10);
+	page = cdb[2] & 0x3f;
+	pc = cdb[2] >> 6;
+	if (page != 0x08 && page != 0x0a && page != 0x3f)
+		return (-1);
+
+	hlen = ten ? 8 : 4;
+	p = buf + hlen;
+	buf[ten ? 3 : 2] = lun->vsl_ro ? 0x80 : 0;	/* WP */
+	if (!(cdb[1] & 0x08)) {
+		/* Short block descriptor */
+		buf[ten ? 7 : 3] = 8;
+		be32enc(p, (uint32_t) MIN(lun->vsl_nblocks, 0xffffffULL));
+		be32enc(p + 4, (uint32_t) lun->vsl_sectsz);
+		p += 8;
+	}
+	if (page == 0x08 || page == 0x3f) {
+		p[0] = 0x08;
+		p[1] = 0x12;
+		/* Changeable values: none */
+		if (pc != 1 && blockif_get_wce(lun->vsl_bc))
+			p[2] = 0x04;	/* WCE */
+		p += 2 + 0x12;
+	}
+	if (page == 0x0a || page == 0x3f) {
+		p[0] = 0x0a;
+		p[1] = 0x0a;
+		p += 2 + 0x0a;
+	}
+	if (ten)
+		be16enc(buf, (uint16_t) (p - buf - 2));
+	else
+		buf[0] = (uint8_t) (p - buf - 1);
+	return ((int) (p - buf));
+}
+
+/*
+ * Run a command from a request queue.
+ */
+static void
+pci_vtscsi_cmd(struct pci_vtscsi_softc *sc, struct pci_vtscsi_ioreq *io,
+	const struct virtio_scsi_cmd_req *req, const struct iovec *dout,
+	int nout, const struct iovec *din, int nin)
+{
+	struct pci_vtscsi_lun *lun;
+	const uint8_t *cdb = req->vcr_cdb;
+	uint8_t buf[8 + 8 * VTSCSI_MAXLUNS];
+	uint64_t last;
+	int i, len, id;
+
+	if (req->vcr_lun[0] != 1 || req->vcr_lun[1] != 0) {
+		pci_vtscsi_respond(io, VTSCSI_S_BAD_TARGET, SCSI_STATUS_OK, 0,
+		    0, 0);
+		return;
+	}
+	id = be16dec(req->vcr_lun + 2) & 0x3fff;
+	lun = id < sc->vss_nluns ? &sc->vss_luns[id] : NULL;
+	io->io_lun = lun;
+
+	switch (cdb[0]) {
+	case SCSI_INQUIRY:
+		len = pci_vtscsi_inquiry(lun, cdb, buf);
+		if (len < 0)
+			pci_vtscsi_check(io, SSD_KEY_ILLEGAL_REQUEST,
+			    SSD_ASC_INVALID_FIELD_CDB);
+		else
+			pci_vtscsi_datain(io, din, nin, buf, (size_t) len,
+			    be16dec(cdb + 3));
+		return;
+	case SCSI_REPORT_LUNS:
+		memset(buf, 0, sizeof(buf));
+		be32enc(buf, (uint32_t) (8 * sc->vss_nluns));
+		for (i = 0; i < sc->vss_nluns; i++)
+			buf[8 + 8 * i + 1] = (uint8_t) i;
+		pci_vtscsi_datain(io, din, nin, buf,
+		    (size_t) (8 + 8 * sc->vss_nluns), be32dec(cdb + 6));
+		return;
+	case SCSI_REQUEST_SENSE:
+		/* Sense goes back with each command, so there is none here */
+		memset(buf, 0, VTSCSI_FIXED_SENSE);
+		buf[0] = 0x70;
+		buf[2] = SSD_KEY_NO_SENSE;
+		buf[7] = VTSCSI_FIXED_SENSE - 8;
+		if (lun == NULL) {
+			buf[2] = SSD_KEY_ILLEGAL_REQUEST;
+			buf[12] = SSD_ASC_LUN_NOT_SUPPORTED;
+		}
+		pci_vtscsi_datain(io, din, nin, buf, VTSCSI_FIXED_SENSE,
+		    (size_t) cdb[4]);
+		return;
+	default:
+		break;
+	}
+
+	if (lun == NULL) {
+		pci_vtscsi_check(io, SSD_KEY_ILLEGAL_REQUEST,
+		    SSD_ASC_LUN_NOT_SUPPORTED);
+		return;
+	}
+
+	switch (cdb[0]) {
+	case SCSI_TEST_UNIT_READY:
+	case SCSI_START_STOP_UNIT:
+	case SCSI_PREVENT_ALLOW:
+	case SCSI_VERIFY_10:
+	case SCSI_VERIFY_12:
+	case SCSI_VERIFY_16:
+		pci_vtscsi_respond(io, VTSCSI_S_OK, SCSI_STATUS_OK, 0, 0, 0);
+		break;
+	case SCSI_READ_6:
+	case SCSI_READ_10:
+	case SCSI_READ_12:
+	case SCSI_READ_16:
+		pci_vtscsi_rw(io, cdb, din, nin);
+		break;
+	case SCSI_WRITE_6:
+	case SCSI_WRITE_10:
+	case SCSI_WRITE_12:
+	case SCSI_WRITE_16:
+		pci_vtscsi_rw(io, cdb, dout, nout);
+		break;
+	case SCSI_SYNCHRONIZE_CACHE_10:
+	case SCSI_SYNCHRONIZE_CACHE_16:
+		pci_vtscsi_flush(io);
+		break;
+	case SCSI_UNMAP:
+		pci_vtscsi_unmap(io, cdb, dout, nout);
+		break;
+	case SCSI_READ_CAPACITY_10:
+		last = lun->vsl_nblocks - 1;
+		be32enc(buf, (uint32_t) MIN(last, 0xffffffffULL));
+		be32enc(buf + 4, (uint32_t) lun->vsl_sectsz);
+		pci_vtscsi_datain(io, din, nin, buf, 8, 8);
+		break;
+	case SCSI_SERVICE_ACTION_IN_16:
+		if ((cdb[1] & 0x1f) != SCSI_SAI_READ_CAPACITY_16) {
+			pci_vtscsi_check(io, SSD_KEY_ILLEGAL_REQUEST,
+			    SSD_ASC_INVALID_FIELD_CDB);
+			break;
+		}
+		memset(buf, 0, 32);
+		be64enc(buf, lun->vsl_nblocks - 1);
+		be32enc(buf + 8, (uint32_t) lun->vsl_sectsz);
+		buf[13] = (uint8_t) lun->vsl_pexp;
+		be16enc(buf + 14, (uint16_t) lun->vsl_palign);
+		if (lun->vsl_candelete)
+			buf[14] |= 0x80;	/* LBPME */
+		pci_vtscsi_datain(io, din, nin, buf, 32, be32dec(cdb + 10));
+		break;
+	case SCSI_MODE_SENSE_6:
+	case SCSI_MODE_SENSE_10:
+		len = pci_vtscsi_mode_sense(lun, cdb, buf);
+		if (len < 0)
+			pci_vtscsi_check(io, SSD_KEY_ILLEGAL_REQUEST,
+			    SSD_ASC_INVALID_FIELD_CDB);
+		else
+			pci_vtscsi_datain(io, din, nin, buf, (size_t) len,
+			    cdb[0] == SCSI_MODE_SENSE_6 ? (size_t) cdb[4] :
+			    (size_t) be16dec(cdb + 7));
+		break;
+	default:
+		DPRINTF(("virtio-scsi: unsupported command 0x%x\n\r", cdb[0]));
+		pci_vtscsi_check(io, SSD_KEY_ILLEGAL_REQUEST,
+		    SSD_ASC_INVALID_OPCODE);
+		break;
+	}
+}
+
+static void
+pci_vtscsi_proc(struct pci_vtscsi_softc *sc, struct pci_vtscsi_queue *q)
+{
+	struct vqueue_info *vq = q->vsq_vq;
+	struct virtio_scsi_cmd_req req;
+	struct pci_vtscsi_ioreq *io;
+	struct iovec iov[VTSCSI_IOV_MAX], dout[VTSCSI_IOV_MAX];
+	struct iovec din[VTSCSI_IOV_MAX];
+	uint16_t idx, flags[VTSCSI_IOV_MAX];
+	size_t hdrsz, respsz;
+	int n, nr, nout, nin;
+
+	n = vq_getchain(vq, &idx, iov, VTSCSI_IOV_MAX, flags);
+	if (n <= 0)
+		return;
+	if (n > VTSCSI_IOV_MAX) {
+		fprintf(stderr, "virtio-scsi: request with %d segments\n\r",
+		    n);
+		vq_relchain(vq, idx, 0);
+		return;
+	}
+
+	/*
+	 * The device-readable descriptors hold the header and data-out,
+	 * the device-writable ones after them the response and data-in.
+	 */
+	io = &q->vsq_ios[idx];
+	for (nr = 0; nr < n && !(flags[nr] & VRING_DESC_F_WRITE); nr++)
+		;
+	hdrsz = offsetof(struct virtio_scsi_cmd_req, vcr_cdb) +
+	    sc->vss_cfg.vsc_cdb_size;
+	respsz = offsetof(struct virtio_scsi_cmd_resp, vcs_sense) +
+	    sc->vss_cfg.vsc_sense_size;
+	io->io_nresp = blockif_iov_slice(&iov[nr], MIN(n - nr, VTSCSI_RESP_IOV),
+	    0, respsz, io->io_resp);
+	if (blockif_iov_len(iov, nr) < hdrsz ||
+	    blockif_iov_len(io->io_resp, io->io_nresp) < respsz) {
+		fprintf(stderr, "virtio-scsi: malformed request\n\r");
+		vq_relchain(vq, idx, 0);
+		return;
+	}
+	memset(&req, 0, sizeof(req));
+	pci_vtscsi_iov_to_buf(iov, nr, &req, MIN(hdrsz, sizeof(req)));
+	nout = blockif_iov_slice(iov, nr, hdrsz, SIZE_MAX, dout);
+	nin = blockif_iov_slice(&iov[nr], n - nr, respsz, SIZE_MAX, din);
+	io->io_resid = (uint32_t) (blockif_iov_len(dout, nout) +
+	    blockif_iov_len(din, nin));
+
+	pci_vtscsi_cmd(sc, io, &req, dout, nout, din, nin);
+}
+
+/*
+ * A task management function. ABORT TASK, which does not say which queue
+ * the task is on, waits like the resets for the whole LUN to drain; the
+ * request queues carry on meanwhile. Called with the control queue lock
+ * held.
+ */
+static void
+pci_vtscsi_tmf(struct pci_vtscsi_softc *sc, struct pci_vtscsi_ioreq *io,
+	const struct virtio_scsi_ctrl_tmf *tmf)
+{
+	struct vqueue_info *vq = io->io_q->vsq_vq;
+	uint8_t response;
+	int id;
+
+	id = be16dec(tmf->vct_lun + 2) & 0x3fff;
+	switch (tmf->vct_subtype) {
+	case VTSCSI_T_TMF_ABORT_TASK:
+	case VTSCSI_T_TMF_ABORT_TASK_SET:
+	case VTSCSI_T_TMF_CLEAR_TASK_SET:
+	case VTSCSI_T_TMF_LOGICAL_UNIT_RESET:
+	case VTSCSI_T_TMF_I_T_NEXUS_RESET:
+		if (tmf->vct_lun[0] != 1 || tmf->vct_lun[1] != 0) {
+			response = VTSCSI_S_BAD_TARGET;
+			break;
+		}
+		if (tmf->vct_subtype == VTSCSI_T_TMF_I_T_NEXUS_RESET)
+			io->io_lun = NULL;
+		else if (id < sc->vss_nluns)
+			io->io_lun = &sc->vss_luns[id];
+		else {
+			response = VTSCSI_S_INCORRECT_LUN;
+			break;
+		}
+		/* A slot left waiting across a reset is already counted */
+		if (!io->io_waiting) {
+			io->io_waiting = 1;
+			atomic_add_int(&sc->vss_tmfs, 1);
+		}
+		io->io_gen = sc->vss_gen;
+		pci_vtscsi_tmf_check(sc);
+		return;
+	default:
+		response = VTSCSI_S_FUNCTION_REJECTED;
+		break;
+	}
+	pci_vtscsi_buf_to_iov(&response, 1, io->io_resp, io->io_nresp);
+	vq_relchain(vq, io->io_idx, 1);
+}
+
+static void
+pci_vtscsi_ctl_proc(struct pci_vtscsi_softc *sc, struct pci_vtscsi_queue *q)
+{
+	struct vqueue_info *vq = q->vsq_vq;
+	struct virtio_scsi_ctrl_tmf tmf;
+	struct virtio_scsi_ctrl_an_resp an;
+	struct pci_vtscsi_ioreq *io;
+	struct iovec iov[VTSCSI_RESP_IOV * 2];
+	uint16_t idx, flags[VTSCSI_RESP_IOV * 2];
+	size_t got;
+	int n, nr;
+
+	n = vq_getchain(vq, &idx, iov, VTSCSI_RESP_IOV * 2, flags);
+	if (n <= 0)
+		return;
+	if (n > VTSCSI_RESP_IOV * 2) {
+		fprintf(stderr, "virtio-scsi: control request with %d "
+		    "segments\n\r", n);
+		vq_relchain(vq, idx, 0);
+		return;
+	}
+	io = &q->vsq_ios[idx];
+	for (nr = 0; nr < n && !(flags[nr] & VRING_DESC_F_WRITE); nr++)
+		;
+	io->io_nresp = blockif_iov_slice(&iov[nr], MIN(n - nr, VTSCSI_RESP_IOV),
+	    0, sizeof(an), io->io_resp);
+	memset(&tmf, 0, sizeof(tmf));
+	got = pci_vtscsi_iov_to_buf(iov, nr, &tmf, sizeof(tmf));
+	if (io->io_nresp <= 0 || got < sizeof(tmf.vct_type)) {
+		fprintf(stderr, "virtio-scsi: malformed control request\n\r");
+		vq_relchain(vq, idx, 0);
+		return;
+	}
+
+	switch (tmf.vct_type) {
+	case VTSCSI_T_TMF:
+		if (got < sizeof(tmf))
+			break;
+		pci_vtscsi_tmf(sc, io, &tmf);
+		return;
+	case VTSCSI_T_AN_QUERY:
+	case VTSCSI_T_AN_SUBSCRIBE:
+		/* No asynchronous events are reported */
+		memset(&an, 0, sizeof(an));
+		an.vca_response = VTSCSI_S_OK;
+		vq_relchain(vq, idx, (uint32_t) pci_vtscsi_buf_to_iov(&an,
+		    sizeof(an), io->io_resp, io->io_nresp));
+		return;
+	default:
+		break;
+	}
+	DPRINTF(("virtio-scsi: control request type %u\n\r", tmf.vct_type));
+	vq_relchain(vq, idx, 0);
+}
+
+static void
+pci_vtscsi_notify(void *vsc, struct vqueue_info *vq)
+{
+	struct pci_vtscsi_softc *sc = vsc;
+	struct pci_vtscsi_queue *q = &sc->vss_queues[vq->vq_num];
+
+	/* The event queue holds buffers for events that never come */
+	if (vq->vq_num == VTSCSI_EVTQ)
+		return;
+
+	pthread_mutex_lock(&q->vsq_mtx);
+	while (vq_has_descs(vq)) {
+		if (vq->vq_num == VTSCSI_CTLQ)
+			pci_vtscsi_ctl_proc(sc, q);
+		else
+			pci_vtscsi_proc(sc, q);
+	}
+	if (vq_ring_ready(vq))
+		vq_endchains(vq, 1);
+	pthread_mutex_unlock(&q->vsq_mtx);
+}
+
+static void
+pci_vtscsi_free(struct pci_vtscsi_softc *sc)
+{
+	int i;
+
+	for (i = 0; i < sc->vss_nluns; i++)
+		if (sc->vss_luns[i].vsl_bc != NULL)
+			blockif_close(sc->vss_luns[i].vsl_bc);
+	if (sc->vss_queues != NULL)
+		for (i = 0; i < sc->vss_nvq; i++)
+			free(sc->vss_queues[i].vsq_ios);
+	free(sc->vss_luns);
+	free(sc->vss_queues);
+	free(sc->vss_vqs);
+	free(sc);
+}
+
+/*
+ * Pull the options handled by the virtio-scsi emulation itself out of a
+ * disk's option string, returning the remainder for blockif_open. They
+ * apply to the whole controller, whichever disk they are given with.
+ */
+static char *
+pci_vtscsi_opts(const char *opts, int *ringsz, int *nq)
+{
+	char *bopts, *xopts, *nopt, *cp;
+	size_t len;
+
+	len = strlen(opts) + 1;
+	bopts = calloc(1, len);
+	nopt = xopts = strdup(opts);
+	if (bopts == NULL || nopt == NULL) {
+		free(bopts);
+		free(nopt);
+		return (NULL);
+	}
+	while (xopts != NULL) {
+		cp = strsep(&xopts, ",");
+		if (cp != nopt && sscanf(cp, "ringsz=%d", ringsz) == 1) {
+			if (*ringsz < 1 || *ringsz > VTSCSI_MAXRINGSZ ||
+			    !powerof2(*ringsz)) {
+				fprintf(stderr, "virtio-scsi: invalid ring size "
+				    "%d\n", *ringsz);
+				free(bopts);
+				free(nopt);
+				return (NULL);
+			}
+			continue;
+		}
+		if (cp != nopt && sscanf(cp, "queues=%d", nq) == 1) {
+			if (*nq < 1 || *nq > VTSCSI_MAXQUEUES) {
+				fprintf(stderr, "virtio-scsi: invalid number "
+				    "of queues %d\n", *nq);
+				free(bopts);
+				free(nopt);
+				return (NULL);
+			}
+			continue;
+		}
+		if (cp != nopt)
+			strlcat(bopts, ",", len);
+		strlcat(bopts, cp, len);
+	}
+	free(nopt);
+	return (bopts);
+}
+
+/*
+ * Open a disk as the next LUN.
+ */
+static int
+pci_vtscsi_lun_open(struct pci_vtscsi_softc *sc, struct pci_devinst *pi,
+	const char *opts, const char *bopts)
+{
+	char bident[sizeof("XX:X:XXX")];
+	struct pci_vtscsi_lun *lun;
+	struct blockif_ctxt *bctxt;
+	MD5_CTX mdctx;
+	u_char digest[16];
+	int sts, sto;
+
+	lun = &sc->vss_luns[sc->vss_nluns];
+	snprintf(bident, sizeof(bident), "%d:%d:%d", pi->pi_slot, pi->pi_func,
+	    sc->vss_nluns);
+	bctxt = blockif_open(bopts, bident);
+	if (bctxt == NULL) {
+		perror("Could not open backing file");
+		return (1);
+	}
+	sc->vss_nluns++;
+	lun->vsl_bc = bctxt;
+	lun->vsl_inline = blockif_inline(bctxt);
+	lun->vsl_sectsz = blockif_sectsz(bctxt);
+	lun->vsl_nblocks = (uint64_t) (blockif_size(bctxt) / lun->vsl_sectsz);
+	if (lun->vsl_nblocks == 0) {
+		fprintf(stderr, "virtio-scsi: %s is empty\n", opts);
+		return (1);
+	}
+	blockif_psectsz(bctxt, &sts, &sto);
+	lun->vsl_pexp = (sts > lun->vsl_sectsz) ?
+	    (ffs(sts / lun->vsl_sectsz) - 1) : 0;
+	lun->vsl_palign = (sto != 0) ? ((sts - sto) / lun->vsl_sectsz) : 0;
+	lun->vsl_ro = blockif_is_ro(bctxt);
+	lun->vsl_candelete = blockif_candelete(bctxt);
+
+	/*
+	 * Create a serial number for the disk. Use parts of the md5 sum
+	 * of the filename
+	 */
+	MD5Init(&mdctx);
+	MD5Update(&mdctx, opts, ((unsigned) strlen(opts)));
+	MD5Final(digest, &mdctx);
+	snprintf(lun->vsl_serial, VTSCSI_SERIAL_BYTES,
+	    "BHYVE-%02X%02X-%02X%02X-%02X%02X", digest[0], digest[1],
+	    digest[2], digest[3], digest[4], digest[5]);
+	return (0);
+}
+
+static int
+pci_vtscsi_init(struct pci_devinst *pi, char *opts)
+{
+	struct pci_vtscsi_softc *sc;
+	char *xopts, *nopt, *cp, *bopts;
+	int i, j, ringsz, nq, nluns, qdepth, qsz;
+
+	if (opts == NULL) {
+		printf("virtio-scsi: backing device required\n");
+		return (1);
+	}
+
+	nluns = 1;
+	for (cp = opts; *cp != '\0'; cp++)
+		if (*cp == ';')
+			nluns++;
+	if (nluns > VTSCSI_MAXLUNS) {
+		fprintf(stderr, "virtio-scsi: more than %d disks\n",
+		    VTSCSI_MAXLUNS);
+		return (1);
+	}
+
+	sc = calloc(1, sizeof(struct pci_vtscsi_softc));
+	if (sc == NULL) {
+		perror("calloc");
+		return (1);
+	}
+	sc->vss_luns = calloc(((size_t) nluns), sizeof(struct pci_vtscsi_lun));
+	nopt = xopts = strdup(opts);
+	if (sc->vss_luns == NULL || nopt == NULL) {
+		free(nopt);
+		pci_vtscsi_free(sc);
+		return (1);
+	}
+
+	/*
+	 * Disks are separated by semicolons; each gets a blockif context,
+	 * which all the request queues share.
+	 */
+	ringsz = VTSCSI_RINGSZ;
+	nq = 1;
+	while ((cp = strsep(&xopts, ";")) != NULL) {
+		if (*cp == '\0') {
+			fprintf(stderr, "virtio-scsi: empty disk in %s\n", opts);
+			free(nopt);
+			pci_vtscsi_free(sc);
+			return (1);
+		}
+		bopts = pci_vtscsi_opts(cp, &ringsz, &nq);
+		if (bopts == NULL || pci_vtscsi_lun_open(sc, pi, cp, bopts)) {
+			free(bopts);
+			free(nopt);
+			pci_vtscsi_free(sc);
+			return (1);
+		}
+		free(bopts);
+	}
+	free(nopt);
+
+	/* The guest keeps each LUN within its blockif queue */
+	qdepth = INT_MAX;
+	for (i = 0; i < sc->vss_nluns; i++) {
+		qsz = blockif_queuesz(sc->vss_luns[i].vsl_bc);
+		if (qsz < qdepth)
+			qdepth = qsz;
+	}
+
+	sc->vss_nvq = VTSCSI_REQQ + nq;
+	sc->vss_queues = calloc(((size_t) sc->vss_nvq),
+	    sizeof(struct pci_vtscsi_queue));
+	sc->vss_vqs = calloc(((size_t) sc->vss_nvq), sizeof(struct vqueue_info));
+	if (sc->vss_queues == NULL || sc->vss_vqs == NULL) {
+		perror("calloc");
+		pci_vtscsi_free(sc);
+		return (1);
+	}
+	for (j = 0; j < sc->vss_nvq; j++) {
+		struct pci_vtscsi_queue *q = &sc->vss_queues[j];
+
+		qsz = j < VTSCSI_REQQ ? VTSCSI_CTLRINGSZ : ringsz;
+		sc->vss_vqs[j].vq_qsize = (uint16_t) qsz;
+		pthread_mutex_init(&q->vsq_mtx, NULL);
+		q->vsq_sc = sc;
+		q->vsq_vq = &sc->vss_vqs[j];
+		q->vsq_ios = calloc(((size_t) qsz),
+		    sizeof(struct pci_vtscsi_ioreq));
+		if (q->vsq_ios == NULL) {
+			perror("calloc");
+			pci_vtscsi_free(sc);
+			return (1);
+		}
+		for (i = 0; i < qsz; i++) {
+			struct pci_vtscsi_ioreq *io = &q->vsq_ios[i];
+			io->io_req.br_param = io;
+			io->io_q = q;
+			io->io_idx = (uint16_t) i;
+		}
+	}
+
+	pthread_mutex_init(&sc->vss_mtx, NULL);
+
+	/* init virtio softc and virtqueues */
+	sc->vss_consts = vtscsi_vi_consts;
+	sc->vss_consts.vc_nvq = sc->vss_nvq;
+	vi_softc_linkup(&sc->vss_vs, &sc->vss_consts, sc, pi, sc->vss_vqs);
+	sc->vss_vs.vs_mtx = &sc->vss_mtx;
+	/* queue notifies take the per-queue lock, see pci_vtscsi_notify */
+	sc->vss_vs.vs_flags |= VIRTIO_QNOTIFY_NOLOCK;
+
+	/* setup virtio scsi config space */
+	sc->vss_cfg.vsc_num_queues = (uint32_t) nq;
+	sc->vss_cfg.vsc_seg_max = BLOCKIF_IOV_MAX;
+	sc->vss_cfg.vsc_max_sectors = 0xffff;
+	sc->vss_cfg.vsc_cmd_per_lun = (uint32_t) qdepth;
+	sc->vss_cfg.vsc_event_info_size = 16;
+	sc->vss_cfg.vsc_sense_size = VTSCSI_SENSE_SIZE;
+	sc->vss_cfg.vsc_cdb_size = VTSCSI_CDB_SIZE;
+	sc->vss_cfg.vsc_max_channel = 0;
+	sc->vss_cfg.vsc_max_target = 0;
+	sc->vss_cfg.vsc_max_lun = (uint32_t) (sc->vss_nluns - 1);
+
+	pci_set_cfgdata16(pi, PCIR_DEVICE, VIRTIO_DEV_SCSI);
+	pci_set_cfgdata16(pi, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(pi, PCIR_CLASS, PCIC_STORAGE);
+	pci_set_cfgdata16(pi, PCIR_SUBDEV_0, VIRTIO_TYPE_SCSI);
+	pci_set_cfgdata16(pi, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (vi_intr_init(&sc->vss_vs, 1, fbsdrun_virtio_msix())) {
+		pci_vtscsi_free(sc);
+		return (1);
+	}
+	vi_set_io_bar(&sc->vss_vs, 0);
+	return (0);
+}
+
+static int
+pci_vtscsi_cfgwrite(void *vsc, int offset, int size, uint32_t value)
+{
+	struct pci_vtscsi_softc *sc = vsc;
+
+	/* The driver may set the sense and CDB sizes */
+	if (offset == (int) offsetof(struct vtscsi_config, vsc_sense_size) &&
+	    size == 4) {
+		sc->vss_cfg.vsc_sense_size = value;
+		return (0);
+	}
+	if (offset == (int) offsetof(struct vtscsi_config, vsc_cdb_size) &&
+	    size == 4 && value <= VTSCSI_CDB_SIZE) {
+		sc->vss_cfg.vsc_cdb_size = value;
+		return (0);
+	}
+	DPRINTF(("vtscsi: write to readonly reg %d\n\r", offset));
+	return (1);
+}
+
+static int
+pci_vtscsi_cfgread(void *vsc, int offset, int size, uint32_t *retval)
+{
+	struct pci_vtscsi_softc *sc = vsc;
+	void *ptr;
+
+	/* our caller has already verified offset and size */
+	ptr = (uint8_t *)&sc->vss_cfg + offset;
+	memcpy(retval, ptr, size);
+	return (0);
+}
+
+static struct pci_devemu pci_de_vscsi = {
+	.pe_emu =	"virtio-scsi",
+	.pe_init =	pci_vtscsi_init,
+	.pe_barwrite =	vi_pci_write,
+	.pe_barread =	vi_pci_read
+};
+PCI_EMUL_SET(pci_de_vscsi);
@@ -645,7 +645,7 @@ vi_pci_write(UNUSED int vcpu, struct pci_devinst *pi, int baridx,
 	uint64_t virtio_config_size, max;
 	const char *name;
 	uint32_t newoff;
-	int error;
+	int error, locked;
 
 	if (vs->vs_flags & VIRTIO_USE_MSIX) {
 		if (baridx == pci_msix_table_bar(pi) ||
@@ -660,6 +660,7 @@ vi_pci_write(UNUSED int vcpu, struct pci_devinst *pi, int baridx,
 
 	if (vs->vs_mtx)
 		pthread_mutex_lock(vs->vs_mtx);
+	locked = 1;
 
 	vc = vs->vs_vc;
 	name = vc->vc_name;
@@ -735,6 +736,15 @@ bad:
 			goto done;
 		}
 		vq = &vs->vs_queues[value];
+		/*
+		 * Devices with per-queue locking take their own lock, so
+		 * that notifies on different queues don't serialize on the
+		 * softc lock.
+		 */
+		if ((vs->vs_flags & VIRTIO_QNOTIFY_NOLOCK) && vs->vs_mtx) {
+			pthread_mutex_unlock(vs->vs_mtx);
+			locked = 0;
+		}
 		if (vq->vq_notify)
 			(*vq->vq_notify)(DEV_SOFTC(vs), vq);
 		else if (vc->vc_qnotify)
@@ -766,6 +776,6 @@ bad_qindex:
 	    "%s: write config reg %s: curq %d >= max %d\r\n",
 	    name, cr->cr_name, vs->vs_curq, vc->vc_nvq);
 done:
-	if (vs->vs_mtx)
+	if (locked && vs->vs_mtx)
 		pthread_mutex_unlock(vs->vs_mtx);
 }